@@ -1,6 +1,11 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // pipe2
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
 
 // 平台相关头文件
 #ifdef _WIN32
@@ -13,11 +18,80 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <regex.h>
+#include <poll.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#endif
+
+#define NVIDIA_CMD "nvidia-smi --query-compute-apps=pid,used_memory --format=csv,noheader,nounits"
+#define DEFAULT_DEVICE "/dev/nvidia-uvm"   // CUDA 计算进程必然打开它，显示服务一般只开 /dev/nvidia0
+#define DEFAULT_INTERVAL_MS 50             // /proc 扫描的最短间隔，刚终止过进程时使用
+#define IDLE_INTERVAL_MS 1000              // 空闲时逐步放宽到的最长间隔
+#define EVENT_INTERVAL_MS 5000             // 有进程事件时，全量扫描只用来兜底
+#define SMI_INTERVAL_MS 1000               // nvidia-smi 轮询的间隔
+#define WATCH_MAX 4096                     // 新进程复查列表容量
+#define WATCH_FIRST_MS 10                  // 新进程第一次复查的延迟，之后每次翻倍
+#define WATCH_MAX_DELAY_MS 250
+#define WATCH_WINDOW_MS 30000              // 新进程的观察窗口
+#define MAX_SCAN_THREADS 64
+#define PROC_BUCKETS 4096
+#define DIRENT_BATCH_SIZE 32768
+#define TERM_TIMEOUT_MS 3000               // SIGTERM 之后等待进程自行退出的时间
+#define KILL_CONFIRM_MS 5000               // SIGKILL 之后等待确认退出的时间
+#define KILL_POLL_MS 10                    // 没有 pidfd 时检查进程是否退出的节拍
+#define MAX_VICTIMS 1024                   // 同时等待退出的进程上限
+#define MEM_CACHE_MS 500                   // 规则需要显存时，nvidia-smi 查询结果的有效期
+#define METRICS_INTERVAL_MS 1000           // 指标文件的刷新间隔
+#define CGROUP_ROOT "/sys/fs/cgroup"       // cgroup v2 挂载点
+#define CGROUP_RECENT 256                  // 记住最近驱逐过的 cgroup 数
+#define CGROUP_DEDUPE_MS 1000              // 同一 cgroup 两次 cgroup.kill 之间的最短间隔
+
+enum { CGROUP_OFF, CGROUP_KILL, CGROUP_FREEZE };
+
+#if defined(__linux__) && !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+#if defined(__linux__) && !defined(SYS_pidfd_send_signal)
+#define SYS_pidfd_send_signal 424
 #endif
 
 // 全局运行标志
 volatile int keep_running = 1;
 volatile int signal_received = 0; // 新增：标记是否接收到信号
+volatile int reload_requested = 0; // SIGHUP：重新加载规则文件
+
+// 命令行选项
+typedef struct {
+    const char* device;   // 设备路径前缀，readlink 结果以它开头即视为占用 GPU
+    size_t device_len;
+    int interval_ms;      // 两轮检测之间的最短间隔，-1 表示按模式取默认值
+    int max_interval_ms;  // 空闲时放宽到的最长间隔，-1 表示按模式取默认值
+    int use_events;       // 用 proc connector 监听新进程
+    int threads;          // 并行扫描线程数，0 表示取 CPU 核数
+    int new_only;         // 只扫描上一轮之后新出现的 PID
+    int use_smi;          // 沿用 nvidia-smi 查询
+    int term_timeout_ms;  // SIGTERM 后等待多久再发 SIGKILL，0 表示直接 SIGKILL
+    const char* rules_path;  // 规则文件，为空表示终止所有命中进程
+    int cgroup_mode;      // 按 cgroup 整组终止或冻结
+    const char* cgroup_root;
+    const char* metrics_path;  // Prometheus 文本格式的指标文件
+    int quiet;            // 不输出逐个进程的日志，只保留错误
+} Options;
+
+static Options options = {DEFAULT_DEVICE, sizeof(DEFAULT_DEVICE) - 1, -1, -1, 1, 0, 0, 0, TERM_TIMEOUT_MS, NULL, CGROUP_OFF, CGROUP_ROOT, NULL, 0};
 
 // 平台特定的信号/控制台处理
 #ifdef _WIN32
@@ -31,11 +105,46 @@ BOOL WINAPI ConsoleHandler(DWORD signal) {
 }
 #else
 void handle_signal(int sig) {
+    (void)sig;
     keep_running = 0;
     signal_received = 1; // 设置信号接收标记
 }
+
+void handle_reload(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
 #endif
 
+// 逐个进程的日志，-quiet 时不输出
+void log_event(const char* fmt, ...) {
+    if (options.quiet) return;
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL); // 被信号打断时直接返回，退出更及时
+#endif
+}
+
+double now_ms(void) {
+#ifdef _WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
 // 跨平台终止进程函数
 int kill_process(int pid) {
 #ifdef _WIN32
@@ -60,56 +169,1712 @@ int kill_process(int pid) {
 #endif
 }
 
-int main() {
-    // 注册终止信号处理
-#ifdef _WIN32
-    SetConsoleCtrlHandler(ConsoleHandler, TRUE);
-    const char* nvidia_cmd = "nvidia-smi --query-compute-apps=pid --format=csv,noheader";
+// 终止一个检测到的进程，start_time 非 0 时用来确认 PID 没有被复用；
+// 返回 0 表示已处理，1 表示该进程已在终止中或所在 cgroup 已被处理过，-1 表示失败。
+// 只有返回 0 才算新发现：冻结的 cgroup 会一直留在原地，不能让它把扫描间隔一直压在最短
+#ifdef __linux__
+int terminate_process(int pid, unsigned long long start_time);
+int policy_spares(int pid, long mem_mib, int* line, int* uncacheable);
 #else
-    signal(SIGINT, handle_signal);
-    const char* nvidia_cmd = "nvidia-smi --query-compute-apps=pid --format=csv,noheader";
+int terminate_process(int pid, unsigned long long start_time) {
+    (void)start_time;
+    log_event("Killing PID: %d\n", pid);
+    return kill_process(pid);
+}
+
+// 规则文件依赖 /proc，其他平台不支持
+int policy_spares(int pid, long mem_mib, int* line, int* uncacheable) {
+    (void)pid;
+    (void)mem_mib;
+    *line = 0;
+    *uncacheable = 0;
+    return 0;
+}
 #endif
 
-    while (keep_running) {
-        FILE* cmd = popen(nvidia_cmd, "r");
-        if (!cmd) {
+// nvidia-smi 模式：查询一次并终止所有计算进程，返回新提交终止的个数
+int smi_sweep(void) {
+    FILE* cmd = popen(NVIDIA_CMD, "r");
+    if (!cmd) {
 #ifdef _WIN32
-            fprintf(stderr, "Command failed: %lu\n", GetLastError());
+        fprintf(stderr, "Command failed: %lu\n", GetLastError());
 #else
-            perror("popen failed");
+        perror("popen failed");
 #endif
-            Sleep(1);
+        return -1;
+    }
+
+    char buffer[256];
+    int found = 0;
+
+    // 读取并终止所有GPU进程
+    while (fgets(buffer, sizeof(buffer), cmd) != NULL) {
+        int pid = 0, line, uncacheable;
+        long mem_mib = -1;
+        if (sscanf(buffer, "%d, %ld", &pid, &mem_mib) < 1 || pid <= 0) continue;
+        if (policy_spares(pid, mem_mib, &line, &uncacheable)) continue;
+
+        if (terminate_process(pid, 0) == 0) {
+            found++;
+        }
+    }
+
+    pclose(cmd);
+    return found;
+}
+
+#ifdef __linux__
+// /proc 扫描模式：直接找持有设备节点的进程，不再每轮 fork nvidia-smi
+
+struct linux_dirent64 {
+    uint64_t d_ino; // 内核结构是定长的，不随 _FILE_OFFSET_BITS 变化
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct ProcEntry {
+    int pid;
+    unsigned long long start_time;  // /proc/<pid>/stat 第 22 字段，用来识别 PID 复用
+    int fd_dir;                     // 复用的 /proc/<pid>/fd 目录句柄，-1 表示未缓存
+    unsigned seen;                  // 最近一次在 /proc 中出现的轮次
+    int checked;                    // 至少完整扫描过一次
+    int gone;                       // 进程已退出
+    int denied;                     // 无权读取 fd 目录，不再尝试
+    int hit;                        // 本轮发现持有设备
+    unsigned policy_gen;            // 缓存的策略判断对应的策略版本，0 表示未判断
+    int spared;                     // 策略判断结果：放过
+    int spared_volatile;            // 判断依赖显存，每次重新计算
+    struct ProcEntry* next;
+} ProcEntry;
+
+static struct {
+    int proc_fd;                    // /proc 目录句柄，每轮 lseek 回开头复用
+    int self_pid;
+    int cache_fds;                  // 句柄数达到上限后不再缓存新的目录句柄
+    ProcEntry* buckets[PROC_BUCKETS];
+    ProcEntry** list;               // 本轮待扫描的进程
+    size_t count, cap;
+    unsigned sweep;
+
+    // 扫描线程：主线程分发一轮，所有线程按原子下标抢任务
+    pthread_t threads[MAX_SCAN_THREADS];
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned generation;
+    size_t next;
+    int active;
+    int quit;
+
+    unsigned long sweeps;
+    double total_ms, max_ms;
+} scanner = {.proc_fd = -1, .cache_fds = 1,
+             .lock = PTHREAD_MUTEX_INITIALIZER,
+             .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+
+// 读取进程启动时间（自开机以来的时钟滴答数），失败返回 0；state 非空时顺带取出进程状态
+static unsigned long long read_proc_stat(int pid, char* state) {
+    char path[32], buf[1024];
+    snprintf(path, sizeof(path), "%d/stat", pid);
+    int fd = openat(scanner.proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+
+    // comm 字段可能含空格和括号，从最后一个 ')' 之后开始数；其后是第 3 个字段
+    char* p = strrchr(buf, ')');
+    if (!p) return 0;
+    if (state) *state = p[1] ? p[2] : '?';
+    for (int field = 2; field < 22 && p; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+static void close_entry_fd(ProcEntry* e) {
+    if (e->fd_dir >= 0) {
+        close(e->fd_dir);
+        e->fd_dir = -1;
+    }
+}
+
+// 指标：计数器和对数分桶直方图，定期以 Prometheus 文本格式原子地写到文件
+// （先写临时文件再 rename），供 node_exporter 的 textfile collector 读取
+static const double histogram_bounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+#define HISTOGRAM_BUCKETS (sizeof(histogram_bounds) / sizeof(histogram_bounds[0]))
+
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS + 1];  // 最后一个桶是 +Inf
+    unsigned long count;
+    double sum;
+} Histogram;
+
+enum {
+    OUTCOME_GONE,       // 处理前已退出
+    OUTCOME_TERM,       // 响应 SIGTERM 退出
+    OUTCOME_KILLED,     // SIGKILL 后退出
+    OUTCOME_STUCK,      // SIGKILL 后仍未退出
+    OUTCOME_FAILED,     // 无法发送信号
+    OUTCOME_COUNT
+};
+
+static const char* outcome_names[OUTCOME_COUNT] = {"gone", "sigterm", "sigkill", "stuck", "failed"};
+
+static struct {
+    pthread_mutex_t lock;           // 终止线程和主线程都会更新
+    unsigned long detections;       // 提交给终止线程的进程数
+    unsigned long outcomes[OUTCOME_COUNT];
+    unsigned long escalations;      // SIGTERM 超时升级为 SIGKILL 的次数
+    unsigned long spared;           // 被规则放过的判断次数
+    Histogram sweep;                // 一轮全量扫描耗时
+    Histogram detect_to_exit;       // 提交终止到确认退出
+    Histogram start_to_signal;      // 进程启动到收到第一个信号
+    double last_write_ms;
+    unsigned long last_kills;
+} metrics = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void histogram_add(Histogram* h, double seconds) {
+    size_t i = 0;
+    while (i < HISTOGRAM_BUCKETS && seconds > histogram_bounds[i]) i++;
+    pthread_mutex_lock(&metrics.lock);
+    h->counts[i]++;
+    h->count++;
+    h->sum += seconds;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+static void metrics_count(unsigned long* counter) {
+    pthread_mutex_lock(&metrics.lock);
+    (*counter)++;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+static void metrics_histogram(FILE* out, const char* name, const char* help, const Histogram* h) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long cumulative = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += h->counts[i];
+        fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, histogram_bounds[i], cumulative);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+    fprintf(out, "%s_sum %.6f\n%s_count %lu\n", name, h->sum, name, h->count);
+}
+
+static void metrics_counter(FILE* out, const char* name, const char* help, unsigned long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+// 终止线程：先 SIGTERM 给进程留出保存检查点的时间，超时后升级为 SIGKILL，
+// 所有待终止进程的 pidfd 放在同一个 poll 里等待，N 个进程只占一个超时窗口
+typedef struct {
+    int pid;
+    unsigned long long start_time;
+    int pidfd;                      // -1 表示内核不支持 pidfd，退回按 PID 发信号
+    int killed;                     // 已升级为 SIGKILL
+    double started_ms;
+    double deadline_ms;
+    int confirm;                    // 所在 cgroup 已整组终止，只需确认退出，不再发信号
+} Victim;
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int wake[2];                    // 提交新进程时写入一个字节唤醒 poll
+    Victim incoming[MAX_VICTIMS];   // 主线程提交、尚未被终止线程接手的进程
+    int incoming_count;
+    Victim active[MAX_VICTIMS];     // 正在等待退出的进程，只由终止线程访问
+    int active_count;
+    int inflight[MAX_VICTIMS];      // 已提交未结束的 PID，用于去重
+    int inflight_count;
+    int started;
+    int quit;
+} killer = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = {-1, -1}};
+
+static int pidfd_open(int pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int pidfd_send_signal(int pidfd, int sig) {
+    return (int)syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+// 进程是否仍在运行（不存在、已成僵尸或 PID 已被复用都算退出）
+static int victim_alive(const Victim* v) {
+    char state = '?';
+    unsigned long long start = read_proc_stat(v->pid, &state);
+    if (start == 0 || state == 'Z' || state == 'X') return 0;
+    return v->start_time == 0 || start == v->start_time;
+}
+
+static int victim_signal(Victim* v, int sig) {
+    int ret = v->pidfd >= 0 ? pidfd_send_signal(v->pidfd, sig) : kill(v->pid, sig);
+    if (ret == -1 && errno != ESRCH) {
+        fprintf(stderr, "Error signalling PID %d: %s\n", v->pid, strerror(errno));
+    }
+    return ret;
+}
+
+static void victim_done(Victim* v, int outcome) {
+    static const char* messages[OUTCOME_COUNT] = {
+        "was already gone", "exited on SIGTERM", "killed",
+        "still alive after SIGKILL, giving up", "could not be signalled",
+    };
+    double elapsed = now_ms() - v->started_ms;
+    log_event("PID %d %s after %.0f ms\n", v->pid, messages[outcome], elapsed);
+    if (v->pidfd >= 0) close(v->pidfd);
+
+    metrics_count(&metrics.outcomes[outcome]);
+    if (outcome == OUTCOME_TERM || outcome == OUTCOME_KILLED) {
+        histogram_add(&metrics.detect_to_exit, elapsed / 1000.0);
+    }
+
+    pthread_mutex_lock(&killer.lock);
+    for (int i = 0; i < killer.inflight_count; i++) {
+        if (killer.inflight[i] == v->pid) {
+            killer.inflight[i] = killer.inflight[--killer.inflight_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&killer.lock);
+}
+
+// 记录进程从启动到收到第一个信号（或所在 cgroup 被写入）经过的时间。
+// 启动时间是开机以来的时钟滴答，和 CLOCK_BOOTTIME 比较得到进程存活了多久
+static void record_start_to_signal(unsigned long long start_time) {
+    struct timespec boot;
+    long hz = sysconf(_SC_CLK_TCK);
+    if (start_time && hz > 0 && clock_gettime(CLOCK_BOOTTIME, &boot) == 0) {
+        double age = boot.tv_sec + boot.tv_nsec / 1e9 - (double)start_time / hz;
+        histogram_add(&metrics.start_to_signal, age > 0 ? age : 0);
+    }
+}
+
+// 接手一个新提交的进程：打开 pidfd，核对启动时间后发出第一个信号
+static void victim_start(Victim v) {
+    // 整组终止的进程此时多半已经退出，同样算作被杀，检测到退出的耗时才有记录
+    int gone = v.confirm ? OUTCOME_KILLED : OUTCOME_GONE;
+    v.pidfd = pidfd_open(v.pid);
+    if (v.pidfd < 0 && errno == ESRCH) {
+        victim_done(&v, gone);
+        return;
+    }
+    // pidfd 打开之后再核对启动时间：此后信号只会发给这个进程本身
+    if (v.start_time == 0) v.start_time = read_proc_stat(v.pid, NULL);
+    if (!victim_alive(&v)) {
+        victim_done(&v, gone);
+        return;
+    }
+    if (v.confirm) {
+        v.killed = 1;
+        v.deadline_ms = now_ms() + KILL_CONFIRM_MS;
+        killer.active[killer.active_count++] = v;
+        return;
+    }
+
+    v.killed = options.term_timeout_ms <= 0;
+    if (victim_signal(&v, v.killed ? SIGKILL : SIGTERM) == -1) {
+        victim_done(&v, errno == ESRCH ? OUTCOME_GONE : OUTCOME_FAILED);
+        return;
+    }
+
+    record_start_to_signal(v.start_time);
+    v.deadline_ms = now_ms() + (v.killed ? KILL_CONFIRM_MS : options.term_timeout_ms);
+    killer.active[killer.active_count++] = v;
+}
+
+static void* killer_main(void* arg) {
+    (void)arg;
+    struct pollfd fds[MAX_VICTIMS + 1];
+
+    for (;;) {
+        pthread_mutex_lock(&killer.lock);
+        Victim batch[MAX_VICTIMS];
+        int n = killer.incoming_count;
+        memcpy(batch, killer.incoming, n * sizeof(Victim));
+        killer.incoming_count = 0;
+        int quit = killer.quit;
+        pthread_mutex_unlock(&killer.lock);
+
+        for (int i = 0; i < n; i++) {
+            victim_start(batch[i]);
+        }
+        if (quit && killer.active_count == 0) break;
+
+        // 退出确认：pidfd 可读表示进程已退出；没有 pidfd 的进程每个节拍查一次 /proc
+        double now = now_ms();
+        double next = now + 1000;
+        int nfds = 0, polling = 0;
+        fds[nfds++] = (struct pollfd){killer.wake[0], POLLIN, 0};
+        for (int i = 0; i < killer.active_count; i++) {
+            Victim* v = &killer.active[i];
+            if (v->deadline_ms < next) next = v->deadline_ms;
+            if (v->pidfd >= 0) fds[nfds++] = (struct pollfd){v->pidfd, POLLIN, 0};
+            else polling = 1;
+        }
+        int timeout = next > now ? (int)(next - now + 0.999) : 0;
+        if (polling && timeout > KILL_POLL_MS) timeout = KILL_POLL_MS;
+
+        if (poll(fds, nfds, timeout) > 0 && (fds[0].revents & POLLIN)) {
+            char drain[64];
+            while (read(killer.wake[0], drain, sizeof(drain)) > 0) {}
+        }
+
+        now = now_ms();
+        int kept = 0;
+        for (int i = 0, f = 1; i < killer.active_count; i++) {
+            Victim v = killer.active[i];
+            int exited = v.pidfd >= 0 ? (fds[f++].revents & (POLLIN | POLLHUP)) != 0 : !victim_alive(&v);
+
+            if (exited) {
+                victim_done(&v, v.killed ? OUTCOME_KILLED : OUTCOME_TERM);
+                continue;
+            }
+            if (now >= v.deadline_ms) {
+                if (v.killed) {
+                    // 一般是卡在不可中断睡眠（D 状态），放弃等待
+                    victim_done(&v, OUTCOME_STUCK);
+                    continue;
+                }
+                log_event("PID %d ignored SIGTERM, sending SIGKILL\n", v.pid);
+                metrics_count(&metrics.escalations);
+                v.killed = 1;
+                v.deadline_ms = now + KILL_CONFIRM_MS;
+                if (victim_signal(&v, SIGKILL) == -1 && errno == ESRCH) {
+                    victim_done(&v, OUTCOME_KILLED);
+                    continue;
+                }
+            }
+            killer.active[kept++] = v;
+        }
+        killer.active_count = kept;
+    }
+    return NULL;
+}
+
+int killer_init(void) {
+    if (scanner.proc_fd < 0) {
+        scanner.proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (pipe2(killer.wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("pipe failed");
+        return -1;
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);  // 信号只交给主线程，好让它的 poll 及时返回
+    int ret = pthread_create(&killer.thread, NULL, killer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    killer.started = 1;
+    return 0;
+}
+
+// 等待所有已提交的进程处理完（最长一个 SIGTERM 超时加一个确认窗口）
+void killer_shutdown(void) {
+    if (!killer.started) return;
+    pthread_mutex_lock(&killer.lock);
+    killer.quit = 1;
+    pthread_mutex_unlock(&killer.lock);
+    (void)!write(killer.wake[1], "", 1);
+    pthread_join(killer.thread, NULL);
+    close(killer.wake[0]);
+    close(killer.wake[1]);
+}
+
+// 读取进程所在的 cgroup v2 路径（"0::/path" 这一行），失败时返回 -1
+static int read_proc_cgroup(int pid, char* out, size_t size) {
+    char path[32], buf[4096];
+    out[0] = '\0';
+    snprintf(path, sizeof(path), "%d/cgroup", pid);
+    int fd = openat(scanner.proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+
+    char* line = buf;
+    while (*line) {
+        size_t len = strcspn(line, "\n");
+        if (strncmp(line, "0::", 3) == 0) {
+            if (len - 3 >= size) return -1;
+            memcpy(out, line + 3, len - 3);
+            out[len - 3] = '\0';
+            return 0;
+        }
+        line += len;
+        if (*line) line++;
+    }
+    return -1;
+}
+
+// 按 cgroup 整组驱逐：向 cgroup.kill 写 1 一次杀掉组内所有进程（含正在 fork 的子进程），
+// 或向 cgroup.freeze 写 1 冻结整组留待排查。同一 cgroup 在去重窗口内只写一次
+static struct {
+    char self[512];                 // 本进程所在 cgroup，它和它的祖先都不能动
+    struct {
+        char path[512];
+        double when_ms;
+    } recent[CGROUP_RECENT];
+    int recent_count;
+    unsigned long writes;
+    unsigned long covered;          // 被已有写入覆盖、无需再处理的进程数
+} cgroups;
+
+// 写入 cgroup 控制文件，返回 0 成功
+static int cgroup_write(const char* cgroup, const char* file, const char* value) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s/%s", options.cgroup_root, cgroup, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    int err = errno;
+    close(fd);
+    if (n < 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// 返回 0 表示已驱逐整组，1 表示该组刚处理过，-1 表示不能按组处理（交给按进程终止）
+static int cgroup_evict(int pid) {
+    char cgroup[512];
+    if (read_proc_cgroup(pid, cgroup, sizeof(cgroup)) != 0) return -1;
+
+    // 根 cgroup，或本进程所在的 cgroup 及其祖先，驱逐会波及整机或自己
+    size_t len = strlen(cgroup);
+    if (strcmp(cgroup, "/") == 0 ||
+        (strncmp(cgroups.self, cgroup, len) == 0 && (cgroups.self[len] == '\0' || cgroups.self[len] == '/'))) {
+        return -1;
+    }
+
+    double now = now_ms();
+    int slot = -1;
+    for (int i = 0; i < cgroups.recent_count; i++) {
+        if (strcmp(cgroups.recent[i].path, cgroup) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    // 冻结是持久状态，冻结过的组一直不用再写；整组终止后组可能被重新填充，过了窗口再写
+    if (slot >= 0 && (options.cgroup_mode == CGROUP_FREEZE || now - cgroups.recent[slot].when_ms < CGROUP_DEDUPE_MS)) {
+        cgroups.covered++;
+        return 1;
+    }
+
+    int freeze = options.cgroup_mode == CGROUP_FREEZE;
+    log_event("%s cgroup %s (PID %d)\n", freeze ? "Freezing" : "Killing", cgroup, pid);
+    if (cgroup_write(cgroup, freeze ? "cgroup.freeze" : "cgroup.kill", "1") != 0) return -1;
+    cgroups.writes++;
+
+    if (slot < 0) {
+        if (cgroups.recent_count < CGROUP_RECENT) {
+            slot = cgroups.recent_count++;
+        } else {
+            // 表满时覆盖最旧的一项
+            slot = 0;
+            for (int i = 1; i < CGROUP_RECENT; i++) {
+                if (cgroups.recent[i].when_ms < cgroups.recent[slot].when_ms) slot = i;
+            }
+        }
+        snprintf(cgroups.recent[slot].path, sizeof(cgroups.recent[slot].path), "%s", cgroup);
+    }
+    cgroups.recent[slot].when_ms = now;
+    return 0;
+}
+
+int cgroup_init(void) {
+    if (read_proc_cgroup(getpid(), cgroups.self, sizeof(cgroups.self)) != 0) {
+        fprintf(stderr, "Cannot determine own cgroup v2 path, -cgroup is unavailable\n");
+        return -1;
+    }
+    return 0;
+}
+
+// 把进程交给终止线程，返回 0 成功，1 表示已在处理中，-1 表示队列已满
+static int killer_submit(int pid, unsigned long long start_time, int confirm) {
+    pthread_mutex_lock(&killer.lock);
+    for (int i = 0; i < killer.inflight_count; i++) {
+        if (killer.inflight[i] == pid) {
+            pthread_mutex_unlock(&killer.lock);
+            return 1;
+        }
+    }
+    if (killer.inflight_count == MAX_VICTIMS) {
+        pthread_mutex_unlock(&killer.lock);
+        if (!confirm) fprintf(stderr, "Too many pending kills, PID %d left for the next sweep\n", pid);
+        return -1;
+    }
+    killer.inflight[killer.inflight_count++] = pid;
+    killer.incoming[killer.incoming_count++] = (Victim){pid, start_time, -1, 0, now_ms(), 0, confirm};
+    pthread_mutex_unlock(&killer.lock);
+
+    (void)!write(killer.wake[1], "", 1);
+    return 0;
+}
+
+// 提交一个待终止进程，立即返回；同一进程重复提交会被忽略
+int terminate_process(int pid, unsigned long long start_time) {
+    // 按 cgroup 驱逐失败时退回按进程终止（冻结模式除外：只冻结不杀）
+    if (options.cgroup_mode) {
+        int ret = cgroup_evict(pid);
+        if (ret == 0) {
+            // 整组写入同样计入检测数和启动到处置的耗时；整组终止后还交给终止线程确认退出，
+            // 延迟直方图才能覆盖 cgroup 模式。冻结不会让进程退出，没有退出耗时
+            metrics_count(&metrics.detections);
+            if (start_time == 0) start_time = read_proc_stat(pid, NULL);
+            record_start_to_signal(start_time);
+            if (options.cgroup_mode == CGROUP_KILL) killer_submit(pid, start_time, 1);
+            return 0;
+        }
+        if (ret > 0 || options.cgroup_mode == CGROUP_FREEZE) return ret;
+    }
+
+    int ret = killer_submit(pid, start_time, 0);
+    if (ret == 0) {
+        metrics_count(&metrics.detections);
+        log_event("Killing PID: %d\n", pid);
+    }
+    return ret;
+}
+
+// 策略引擎：规则文件启动时编译一次，SIGHUP 时重新编译并整体替换。
+// 每行一条规则，“allow|deny 条件...”，同一行的条件须全部满足：
+//   exe PATH、uid N|NAME、cgroup PREFIX、mem MIB（显存不少于）、all、
+//   cmdline REGEX（扩展正则，取到行尾，须放在最后）
+// 另有“default allow|deny”指定都不匹配时的动作。命中任一 allow 的进程一定放过，
+// 否则命中 deny 或默认动作为 deny 时终止。只有单个 exe/uid 条件的规则放进哈希集合。
+enum {
+    NEED_EXE = 1,
+    NEED_UID = 2,
+    NEED_CGROUP = 4,
+    NEED_CMDLINE = 8,
+    NEED_MEM = 16,
+};
+
+typedef struct {
+    int allow;
+    int line;
+    int needs;
+    char* exe;
+    unsigned uid;
+    char* cgroup;
+    size_t cgroup_len;
+    long mem_mib;
+    int has_regex;
+    regex_t cmdline;
+} Rule;
+
+// 开放寻址哈希集合，键为字符串或 UID
+typedef struct {
+    char** keys;
+    size_t cap, count;
+} StrSet;
+
+typedef struct {
+    unsigned* keys;   // 存 uid + 1，0 表示空槽
+    size_t cap, count;
+} UidSet;
+
+typedef struct {
+    Rule* rules;
+    int count;
+    StrSet exe[2];    // 下标 0 为 deny，1 为 allow
+    UidSet uid[2];
+    int default_allow;
+    int needs;        // 所有规则用到的进程属性
+} Policy;
+
+static Policy* policy;          // 当前生效的策略，为空表示终止所有命中进程
+static unsigned policy_generation = 1;
+
+static unsigned long long hash_str(const char* s) {
+    unsigned long long h = 1469598103934665603ULL;  // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+// 按 PID 查询显存占用（MiB），一次 nvidia-smi 查询的结果缓存 MEM_CACHE_MS，查不到返回 -1
+static long gpu_memory_mib(int pid) {
+    static struct {
+        int pid;
+        long mib;
+    } table[MAX_VICTIMS];
+    static int count;
+    static double fetched = -1e9;
+
+    double now = now_ms();
+    if (now - fetched > MEM_CACHE_MS) {
+        fetched = now;
+        count = 0;
+        FILE* cmd = popen(NVIDIA_CMD, "r");
+        if (cmd) {
+            char buffer[256];
+            while (count < MAX_VICTIMS && fgets(buffer, sizeof(buffer), cmd)) {
+                if (sscanf(buffer, "%d, %ld", &table[count].pid, &table[count].mib) == 2) count++;
+            }
+            pclose(cmd);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (table[i].pid == pid) return table[i].mib;
+    }
+    return -1;
+}
+
+static int strset_has(const StrSet* set, const char* key) {
+    if (!set->count) return 0;
+    for (size_t i = hash_str(key) & (set->cap - 1);; i = (i + 1) & (set->cap - 1)) {
+        if (!set->keys[i]) return 0;
+        if (strcmp(set->keys[i], key) == 0) return 1;
+    }
+}
+
+static int strset_add(StrSet* set, char* key) {
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 16;
+        char** keys = calloc(cap, sizeof(char*));
+        if (!keys) return -1;
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->keys[i]) continue;
+            size_t j = hash_str(set->keys[i]) & (cap - 1);
+            while (keys[j]) j = (j + 1) & (cap - 1);
+            keys[j] = set->keys[i];
+        }
+        free(set->keys);
+        set->keys = keys;
+        set->cap = cap;
+    }
+    if (strset_has(set, key)) {
+        free(key);
+        return 0;
+    }
+    size_t i = hash_str(key) & (set->cap - 1);
+    while (set->keys[i]) i = (i + 1) & (set->cap - 1);
+    set->keys[i] = key;
+    set->count++;
+    return 0;
+}
+
+static int uidset_has(const UidSet* set, unsigned uid) {
+    if (!set->count) return 0;
+    for (size_t i = (uid * 2654435761u) & (set->cap - 1);; i = (i + 1) & (set->cap - 1)) {
+        if (!set->keys[i]) return 0;
+        if (set->keys[i] == uid + 1) return 1;
+    }
+}
+
+static int uidset_add(UidSet* set, unsigned uid) {
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 16;
+        unsigned* keys = calloc(cap, sizeof(unsigned));
+        if (!keys) return -1;
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->keys[i]) continue;
+            size_t j = ((set->keys[i] - 1) * 2654435761u) & (cap - 1);
+            while (keys[j]) j = (j + 1) & (cap - 1);
+            keys[j] = set->keys[i];
+        }
+        free(set->keys);
+        set->keys = keys;
+        set->cap = cap;
+    }
+    if (uidset_has(set, uid)) return 0;
+    size_t i = (uid * 2654435761u) & (set->cap - 1);
+    while (set->keys[i]) i = (i + 1) & (set->cap - 1);
+    set->keys[i] = uid + 1;
+    set->count++;
+    return 0;
+}
+
+static void policy_free(Policy* p) {
+    if (!p) return;
+    for (int i = 0; i < p->count; i++) {
+        free(p->rules[i].exe);
+        free(p->rules[i].cgroup);
+        if (p->rules[i].has_regex) regfree(&p->rules[i].cmdline);
+    }
+    for (int a = 0; a < 2; a++) {
+        for (size_t i = 0; i < p->exe[a].cap; i++) free(p->exe[a].keys[i]);
+        free(p->exe[a].keys);
+        free(p->uid[a].keys);
+    }
+    free(p->rules);
+    free(p);
+}
+
+// 解析一行规则的条件部分，失败返回 -1 并输出原因
+static int rule_parse(Rule* r, char* p, const char* path) {
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        char* key = p;
+        while (*p && *p != ' ' && *p != '\t') p++;
+        if (*p) *p++ = '\0';
+        while (*p == ' ' || *p == '\t') p++;
+
+        if (strcmp(key, "all") == 0) continue;
+        if (strcmp(key, "cmdline") == 0) {
+            // 正则取到行尾，允许包含空格
+            int err = regcomp(&r->cmdline, p, REG_EXTENDED | REG_NOSUB);
+            if (err) {
+                char msg[128];
+                regerror(err, &r->cmdline, msg, sizeof(msg));
+                fprintf(stderr, "%s:%d: bad cmdline regex: %s\n", path, r->line, msg);
+                return -1;
+            }
+            r->has_regex = 1;
+            r->needs |= NEED_CMDLINE;
+            break;
+        }
+
+        char* value = p;
+        while (*p && *p != ' ' && *p != '\t') p++;
+        if (*p) *p++ = '\0';
+        if (!*value) {
+            fprintf(stderr, "%s:%d: missing value for '%s'\n", path, r->line, key);
+            return -1;
+        }
+
+        if (strcmp(key, "exe") == 0) {
+            free(r->exe);
+            r->exe = strdup(value);
+            r->needs |= NEED_EXE;
+        } else if (strcmp(key, "cgroup") == 0) {
+            free(r->cgroup);
+            // 去掉末尾的 '/'，"/" 本身变成空前缀，匹配所有 cgroup
+            r->cgroup_len = strlen(value);
+            while (r->cgroup_len > 0 && value[r->cgroup_len - 1] == '/') value[--r->cgroup_len] = '\0';
+            r->cgroup = strdup(value);
+            r->needs |= NEED_CGROUP;
+        } else if (strcmp(key, "uid") == 0) {
+            char* end;
+            unsigned long uid = strtoul(value, &end, 10);
+            if (*end) {
+                struct passwd* pw = getpwnam(value);
+                if (!pw) {
+                    fprintf(stderr, "%s:%d: unknown user '%s'\n", path, r->line, value);
+                    return -1;
+                }
+                uid = pw->pw_uid;
+            }
+            r->uid = (unsigned)uid;
+            r->needs |= NEED_UID;
+        } else if (strcmp(key, "mem") == 0) {
+            r->mem_mib = atol(value);
+            r->needs |= NEED_MEM;
+        } else {
+            fprintf(stderr, "%s:%d: unknown condition '%s'\n", path, r->line, key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 编译规则文件，出错时返回 NULL
+Policy* policy_load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open rules file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    Policy* p = calloc(1, sizeof(Policy));
+    if (!p) {
+        fclose(file);
+        return NULL;
+    }
+
+    char line[1024];
+    int lineno = 0, cap = 0, ok = 1;
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char* s = line;
+        while (*s == ' ' || *s == '\t') s++;
+        if (!*s || *s == '#') continue;
+
+        char* action = s;
+        while (*s && *s != ' ' && *s != '\t') s++;
+        if (*s) *s++ = '\0';
+
+        if (strcmp(action, "default") == 0) {
+            while (*s == ' ' || *s == '\t') s++;
+            if (strncmp(s, "allow", 5) == 0) p->default_allow = 1;
+            else if (strncmp(s, "deny", 4) == 0) p->default_allow = 0;
+            else {
+                fprintf(stderr, "%s:%d: default must be allow or deny\n", path, lineno);
+                ok = 0;
+            }
+            continue;
+        }
+        if (strcmp(action, "allow") != 0 && strcmp(action, "deny") != 0) {
+            fprintf(stderr, "%s:%d: expected allow, deny or default\n", path, lineno);
+            ok = 0;
+            continue;
+        }
+
+        Rule r = {0};
+        r.allow = action[0] == 'a';
+        r.line = lineno;
+        r.mem_mib = -1;
+        if (rule_parse(&r, s, path) != 0) {
+            free(r.exe);
+            free(r.cgroup);
+            ok = 0;
+            continue;
+        }
+
+        // 单个 exe 或 uid 条件走哈希集合，其余按顺序逐条匹配
+        if (r.needs == NEED_EXE) {
+            strset_add(&p->exe[r.allow], r.exe);
+        } else if (r.needs == NEED_UID) {
+            uidset_add(&p->uid[r.allow], r.uid);
+        } else {
+            if (p->count == cap) {
+                cap = cap ? cap * 2 : 16;
+                Rule* rules = realloc(p->rules, cap * sizeof(Rule));
+                if (!rules) {
+                    ok = 0;
+                    continue;
+                }
+                p->rules = rules;
+            }
+            p->rules[p->count++] = r;
+        }
+        p->needs |= r.needs;
+    }
+    fclose(file);
+
+    if (!ok) {
+        policy_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+// 当前进程的属性，按需读取
+typedef struct {
+    int pid;
+    int have;
+    char exe[512];
+    unsigned uid;
+    char cgroup[512];
+    char cmdline[4096];
+    long mem_mib;   // -1 表示未知
+} ProcInfo;
+
+static void info_fetch(ProcInfo* info, int needs) {
+    char path[32];
+    needs &= ~info->have;
+    if (needs & NEED_EXE) {
+        snprintf(path, sizeof(path), "%d/exe", info->pid);
+        ssize_t n = readlinkat(scanner.proc_fd, path, info->exe, sizeof(info->exe) - 1);
+        info->exe[n > 0 ? n : 0] = '\0';
+    }
+    if (needs & NEED_UID) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%d", info->pid);
+        info->uid = fstatat(scanner.proc_fd, path, &st, 0) == 0 ? st.st_uid : (unsigned)-1;
+    }
+    if (needs & NEED_CGROUP) {
+        read_proc_cgroup(info->pid, info->cgroup, sizeof(info->cgroup));
+    }
+    if (needs & NEED_CMDLINE) {
+        // 参数之间的 NUL 换成空格
+        info->cmdline[0] = '\0';
+        snprintf(path, sizeof(path), "%d/cmdline", info->pid);
+        int fd = openat(scanner.proc_fd, path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t n = read(fd, info->cmdline, sizeof(info->cmdline) - 1);
+            close(fd);
+            if (n < 0) n = 0;
+            while (n > 0 && info->cmdline[n - 1] == '\0') n--;
+            for (ssize_t i = 0; i < n; i++) {
+                if (info->cmdline[i] == '\0') info->cmdline[i] = ' ';
+            }
+            info->cmdline[n] = '\0';
+        }
+    }
+    if (needs & NEED_MEM && info->mem_mib < 0) {
+        info->mem_mib = gpu_memory_mib(info->pid);
+    }
+    info->have |= needs;
+}
+
+static int rule_matches(const Rule* r, ProcInfo* info) {
+    info_fetch(info, r->needs);
+    if ((r->needs & NEED_EXE) && strcmp(info->exe, r->exe) != 0) return 0;
+    if ((r->needs & NEED_UID) && info->uid != r->uid) return 0;
+    // cgroup 按子树匹配：等于前缀或以“前缀/”开头
+    if ((r->needs & NEED_CGROUP) &&
+        (strncmp(info->cgroup, r->cgroup, r->cgroup_len) != 0 ||
+         (info->cgroup[r->cgroup_len] != '\0' && info->cgroup[r->cgroup_len] != '/'))) return 0;
+    // 显存未知时条件不成立
+    if ((r->needs & NEED_MEM) && (info->mem_mib < 0 || info->mem_mib < r->mem_mib)) return 0;
+    if (r->has_regex && regexec(&r->cmdline, info->cmdline, 0, NULL, 0) != 0) return 0;
+    return 1;
+}
+
+// 按当前策略判断是否放过进程；mem_mib 为已知显存（-1 表示未知），
+// line 返回决定结果的规则行号（0 表示集合或默认动作），uncacheable 表示结果依赖显存不能缓存
+int policy_spares(int pid, long mem_mib, int* line, int* uncacheable) {
+    *line = 0;
+    *uncacheable = 0;
+    if (!policy) return 0;
+
+    Policy* p = policy;
+    ProcInfo info;
+    info.pid = pid;
+    info.have = mem_mib >= 0 ? NEED_MEM : 0;
+    info.mem_mib = mem_mib;
+    *uncacheable = (p->needs & NEED_MEM) != 0;
+
+    // allow 优先
+    if (p->exe[1].count && (info_fetch(&info, NEED_EXE), strset_has(&p->exe[1], info.exe))) return 1;
+    if (p->uid[1].count && (info_fetch(&info, NEED_UID), uidset_has(&p->uid[1], info.uid))) return 1;
+    for (int i = 0; i < p->count; i++) {
+        if (p->rules[i].allow && rule_matches(&p->rules[i], &info)) {
+            *line = p->rules[i].line;
+            return 1;
+        }
+    }
+
+    if (p->exe[0].count && (info_fetch(&info, NEED_EXE), strset_has(&p->exe[0], info.exe))) return 0;
+    if (p->uid[0].count && (info_fetch(&info, NEED_UID), uidset_has(&p->uid[0], info.uid))) return 0;
+    for (int i = 0; i < p->count; i++) {
+        if (!p->rules[i].allow && rule_matches(&p->rules[i], &info)) {
+            *line = p->rules[i].line;
+            return 0;
+        }
+    }
+    return p->default_allow;
+}
+
+// 重新加载规则文件；失败时保留旧策略继续运行
+int policy_reload(void) {
+    Policy* p = policy_load(options.rules_path);
+    if (!p) {
+        fprintf(stderr, "Keeping previous rules\n");
+        return -1;
+    }
+    policy_free(policy);
+    policy = p;
+    policy_generation++;
+    printf("Loaded %d rules from %s\n",
+           p->count + (int)(p->exe[0].count + p->exe[1].count + p->uid[0].count + p->uid[1].count),
+           options.rules_path);
+    return 0;
+}
+
+// 扫描一个进程的 fd 目录，任一 fd 指向设备前缀即命中
+static void scan_entry(ProcEntry* e, char* batch) {
+    int fd = e->fd_dir;
+    if (fd >= 0) {
+        lseek(fd, 0, SEEK_SET);
+    } else {
+        // 未缓存的进程每次重新打开，同时核对启动时间，防止 PID 已被复用
+        unsigned long long start = read_proc_stat(e->pid, NULL);
+        if (e->start_time && start != e->start_time) {
+            e->gone = 1;
+            return;
+        }
+        e->start_time = start;
+
+        char path[32];
+        snprintf(path, sizeof(path), "%d/fd", e->pid);
+        fd = openat(scanner.proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT) e->gone = 1;
+            else if (errno == EACCES || errno == EPERM) e->denied = 1;
+            else if (errno == EMFILE || errno == ENFILE) scanner.cache_fds = 0;
+            return;
+        }
+        if (scanner.cache_fds) e->fd_dir = fd;
+    }
+
+    char link[256];
+    long n = 0;
+    while (!e->hit && (n = syscall(SYS_getdents64, fd, batch, DIRENT_BATCH_SIZE)) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct linux_dirent64* d = (struct linux_dirent64*)(batch + offset);
+            offset += d->d_reclen;
+            if (d->d_name[0] == '.') continue;
+
+            ssize_t len = readlinkat(fd, d->d_name, link, sizeof(link) - 1);
+            if (len < (ssize_t)options.device_len) continue;
+            if (memcmp(link, options.device, options.device_len) == 0) {
+                e->hit = 1;
+                break;
+            }
+        }
+    }
+    // 进程退出后，持有的目录句柄读取会返回 ENOENT
+    if (n < 0 && errno == ENOENT) e->gone = 1;
+
+    e->checked = 1;
+    if (fd != e->fd_dir) close(fd);
+}
+
+// 抢占式处理本轮列表，直到分完
+static void scan_claim(char* batch) {
+    size_t i;
+    while ((i = __atomic_fetch_add(&scanner.next, 1, __ATOMIC_RELAXED)) < scanner.count) {
+        scan_entry(scanner.list[i], batch);
+    }
+}
+
+static void* scan_worker(void* arg) {
+    (void)arg;
+    char* batch = malloc(DIRENT_BATCH_SIZE);
+    unsigned seen = 0;
+    if (!batch) return NULL;
+
+    pthread_mutex_lock(&scanner.lock);
+    for (;;) {
+        while (!scanner.quit && scanner.generation == seen) {
+            pthread_cond_wait(&scanner.start, &scanner.lock);
+        }
+        if (scanner.quit) break;
+        seen = scanner.generation;
+        pthread_mutex_unlock(&scanner.lock);
+
+        scan_claim(batch);
+
+        pthread_mutex_lock(&scanner.lock);
+        if (--scanner.active == 0) pthread_cond_signal(&scanner.done);
+    }
+    pthread_mutex_unlock(&scanner.lock);
+    free(batch);
+    return NULL;
+}
+
+static ProcEntry* proc_find(int pid) {
+    for (ProcEntry* e = scanner.buckets[(unsigned)pid % PROC_BUCKETS]; e; e = e->next) {
+        if (e->pid == pid) return e;
+    }
+    return NULL;
+}
+
+static ProcEntry* proc_lookup(int pid) {
+    ProcEntry** slot = &scanner.buckets[(unsigned)pid % PROC_BUCKETS];
+    for (ProcEntry* e = *slot; e; e = e->next) {
+        if (e->pid == pid) return e;
+    }
+    ProcEntry* e = calloc(1, sizeof(ProcEntry));
+    if (!e) return NULL;
+    e->pid = pid;
+    e->fd_dir = -1;
+    e->next = *slot;
+    *slot = e;
+    return e;
+}
+
+static int list_push(ProcEntry* e) {
+    if (scanner.count == scanner.cap) {
+        size_t cap = scanner.cap ? scanner.cap * 2 : 1024;
+        ProcEntry** list = realloc(scanner.list, cap * sizeof(ProcEntry*));
+        if (!list) return -1;
+        scanner.list = list;
+        scanner.cap = cap;
+    }
+    scanner.list[scanner.count++] = e;
+    return 0;
+}
+
+// 按策略判断命中的进程是否放过，结果按策略版本缓存在表项里
+static int entry_spared(ProcEntry* e) {
+    if (e->policy_gen == policy_generation && !e->spared_volatile) return e->spared;
+
+    int line, uncacheable;
+    int spared = policy_spares(e->pid, -1, &line, &uncacheable);
+    // 只在结果第一次得出或发生变化时提示，避免每轮刷屏
+    if (spared && (e->policy_gen != policy_generation || !e->spared)) {
+        metrics_count(&metrics.spared);
+        if (line) log_event("Sparing PID %d (rule at line %d)\n", e->pid, line);
+        else log_event("Sparing PID %d\n", e->pid);
+    }
+    e->policy_gen = policy_generation;
+    e->spared = spared;
+    e->spared_volatile = uncacheable;
+    return spared;
+}
+
+// 删除已退出或本轮没再出现的进程
+static void proc_prune(void) {
+    for (int b = 0; b < PROC_BUCKETS; b++) {
+        ProcEntry** slot = &scanner.buckets[b];
+        while (*slot) {
+            ProcEntry* e = *slot;
+            if (e->gone || e->seen != scanner.sweep) {
+                *slot = e->next;
+                close_entry_fd(e);
+                free(e);
+            } else {
+                slot = &e->next;
+            }
+        }
+    }
+}
+
+int scanner_init(void) {
+    scanner.proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scanner.proc_fd < 0) {
+        perror("open /proc failed");
+        return -1;
+    }
+    scanner.self_pid = getpid();
+
+    // 每个进程缓存一个目录句柄，把软上限提到硬上限
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int n = options.threads;
+    if (n <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (int)cpus : 1;
+    }
+    if (n > MAX_SCAN_THREADS) n = MAX_SCAN_THREADS;
+    // 主线程也参与扫描，额外启动 n - 1 个线程；信号只交给主线程
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < n - 1; i++) {
+        if (pthread_create(&scanner.threads[scanner.nthreads], NULL, scan_worker, NULL) != 0) break;
+        scanner.nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+void scanner_shutdown(void) {
+    pthread_mutex_lock(&scanner.lock);
+    scanner.quit = 1;
+    pthread_cond_broadcast(&scanner.start);
+    pthread_mutex_unlock(&scanner.lock);
+    for (int i = 0; i < scanner.nthreads; i++) {
+        pthread_join(scanner.threads[i], NULL);
+    }
+
+    scanner.sweep++;
+    proc_prune();
+    free(scanner.list);
+    if (scanner.proc_fd >= 0) close(scanner.proc_fd);
+
+    if (scanner.sweeps) {
+        printf("Sweeps: %lu, avg %.2f ms, max %.2f ms\n",
+               scanner.sweeps, scanner.total_ms / scanner.sweeps, scanner.max_ms);
+    }
+}
+
+// 扫描一轮并终止命中的进程，返回新提交终止的个数
+int proc_sweep(void) {
+    static char batch[DIRENT_BATCH_SIZE];
+    double started = now_ms();
+
+    scanner.sweep++;
+    scanner.count = 0;
+
+    // 列出 /proc 下的数字目录
+    lseek(scanner.proc_fd, 0, SEEK_SET);
+    long n;
+    while ((n = syscall(SYS_getdents64, scanner.proc_fd, batch, DIRENT_BATCH_SIZE)) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct linux_dirent64* d = (struct linux_dirent64*)(batch + offset);
+            offset += d->d_reclen;
+            if (d->d_name[0] < '1' || d->d_name[0] > '9') continue;
+
+            int pid = atoi(d->d_name);
+            if (pid == scanner.self_pid) continue;
+            ProcEntry* e = proc_lookup(pid);
+            if (!e) continue;
+            e->seen = scanner.sweep;
+            e->hit = 0;
+            if (e->denied || (options.new_only && e->checked)) continue;
+            list_push(e);
+        }
+    }
+
+    // 唤醒扫描线程，主线程同时参与
+    pthread_mutex_lock(&scanner.lock);
+    scanner.next = 0;
+    scanner.active = scanner.nthreads;
+    scanner.generation++;
+    pthread_cond_broadcast(&scanner.start);
+    pthread_mutex_unlock(&scanner.lock);
+
+    scan_claim(batch);
+
+    pthread_mutex_lock(&scanner.lock);
+    while (scanner.active > 0) {
+        pthread_cond_wait(&scanner.done, &scanner.lock);
+    }
+    pthread_mutex_unlock(&scanner.lock);
+
+    double elapsed = now_ms() - started;
+    scanner.sweeps++;
+    scanner.total_ms += elapsed;
+    histogram_add(&metrics.sweep, elapsed / 1000.0);
+    if (elapsed > scanner.max_ms) scanner.max_ms = elapsed;
+
+    int found = 0;
+    for (size_t i = 0; i < scanner.count; i++) {
+        ProcEntry* e = scanner.list[i];
+        if (!e->hit || e->gone || entry_spared(e)) continue;
+        if (terminate_process(e->pid, e->start_time) == 0) {
+            found++;
+        }
+    }
+
+    proc_prune();
+    return found;
+}
+
+// 从表中删除一个进程（PID 已被复用或进程已退出）
+static void proc_forget(int pid) {
+    ProcEntry** slot = &scanner.buckets[(unsigned)pid % PROC_BUCKETS];
+    for (; *slot; slot = &(*slot)->next) {
+        if ((*slot)->pid == pid) {
+            ProcEntry* e = *slot;
+            *slot = e->next;
+            close_entry_fd(e);
+            free(e);
+            return;
+        }
+    }
+}
+
+// 在主线程里立即检查单个进程：1 表示新提交终止，2 表示已在终止中或所在 cgroup 已处理过，
+// 0 表示未命中，-1 表示进程已不存在
+static int proc_check(int pid) {
+    static char batch[DIRENT_BATCH_SIZE];
+    if (pid == scanner.self_pid) return -1;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        ProcEntry* e = proc_lookup(pid);
+        if (!e) return 0;
+        e->seen = scanner.sweep;
+        e->hit = 0;
+        if (e->denied) return 0;
+
+        scan_entry(e, batch);
+        if (e->gone) {
+            // 表里可能还是同一 PID 的旧进程，清掉后按新进程再查一次
+            proc_forget(pid);
             continue;
         }
+        if (!e->hit || entry_spared(e)) return 0;
+
+        int ret = terminate_process(pid, e->start_time);
+        return ret < 0 ? 0 : ret == 0 ? 1 : 2;
+    }
+    return -1;
+}
+
+// 新进程复查列表：exec 之后过一段时间才打开设备很常见（比如 import torch），
+// 所以按指数退避反复检查，直到超出观察窗口
+typedef struct {
+    int pid;
+    int delay_ms;
+    double due_ms;
+    double expire_ms;
+} WatchPid;
 
-        char buffer[256];
-        int found = 0;
+static struct {
+    int fd;                         // 订阅了 proc connector 的 netlink 套接字，-1 表示不可用
+    WatchPid pids[WATCH_MAX];
+    int count;
+    int found;                      // 本次等待期间新提交终止的进程数
+    int resync;                     // 事件缓冲区溢出丢了事件，需要立即全量扫描
+    unsigned long events;
+} events = {.fd = -1};
 
-        // 读取并终止所有GPU进程
-        while (fgets(buffer, sizeof(buffer), cmd) != NULL) {
-            int pid = atoi(buffer);
-            if (pid <= 0) continue;
+static void watch_add(int pid, double now) {
+    for (int i = 0; i < events.count; i++) {
+        if (events.pids[i].pid == pid) {
+            events.pids[i].delay_ms = WATCH_FIRST_MS;
+            events.pids[i].due_ms = now + WATCH_FIRST_MS;
+            events.pids[i].expire_ms = now + WATCH_WINDOW_MS;
+            return;
+        }
+    }
+    // 列表满时丢掉最早加入的，它们仍会被全量扫描覆盖
+    if (events.count == WATCH_MAX) {
+        memmove(events.pids, events.pids + 1, (WATCH_MAX - 1) * sizeof(WatchPid));
+        events.count--;
+    }
+    WatchPid* w = &events.pids[events.count++];
+    w->pid = pid;
+    w->delay_ms = WATCH_FIRST_MS;
+    w->due_ms = now + WATCH_FIRST_MS;
+    w->expire_ms = now + WATCH_WINDOW_MS;
+}
 
-            printf("Killing PID: %d\n", pid);
-            if (kill_process(pid) == 0) {
-                found = 1;
+// 复查到期的新进程，返回最近一次到期时间
+static double watch_run(double now) {
+    double next = now + WATCH_WINDOW_MS;
+    int kept = 0;
+    for (int i = 0; i < events.count; i++) {
+        WatchPid w = events.pids[i];
+        if (w.due_ms <= now) {
+            int ret = proc_check(w.pid);
+            if (ret != 0 || now >= w.expire_ms) {
+                if (ret == 1) events.found++;
+                continue;
             }
+            w.delay_ms = w.delay_ms * 2 > WATCH_MAX_DELAY_MS ? WATCH_MAX_DELAY_MS : w.delay_ms * 2;
+            w.due_ms = now + w.delay_ms;
         }
+        if (w.due_ms < next) next = w.due_ms;
+        events.pids[kept++] = w;
+    }
+    events.count = kept;
+    return next;
+}
+
+// 订阅 proc connector 的进程事件，需要 CAP_NET_ADMIN
+int events_open(void) {
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0) return -1;
 
-        pclose(cmd);
+    struct sockaddr_nl addr = {0};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    addr.nl_pid = getpid();
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
 
-        if (!found) {
-            printf("No GPU processes found.\n");
+    struct {
+        struct nlmsghdr nl;
+        struct cn_msg cn;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.nl.nlmsg_len = sizeof(msg);
+    msg.nl.nlmsg_type = NLMSG_DONE;
+    msg.nl.nlmsg_pid = getpid();
+    msg.cn.id.idx = CN_IDX_PROC;
+    msg.cn.id.val = CN_VAL_PROC;
+    msg.cn.len = sizeof(enum proc_cn_mcast_op);
+    msg.op = PROC_CN_MCAST_LISTEN;
+    if (send(fd, &msg, sizeof(msg), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    events.fd = fd;
+    return 0;
+}
+
+void events_close(void) {
+    if (events.fd >= 0) close(events.fd);
+    events.fd = -1;
+}
+
+// 读出所有待处理事件，新 exec 的进程和 fork 出的子进程（继承了父进程的 fd）立即检查
+static void events_read(void) {
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t len;
+    while ((len = recv(events.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        double now = now_ms();
+        for (struct nlmsghdr* nl = (struct nlmsghdr*)buf; NLMSG_OK(nl, (size_t)len); nl = NLMSG_NEXT(nl, len)) {
+            if (nl->nlmsg_type == NLMSG_ERROR || nl->nlmsg_type == NLMSG_NOOP) continue;
+            struct cn_msg* cn = NLMSG_DATA(nl);
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) continue;
+            // cn_msg 之后的事件体只按 4 字节对齐，拷出来再读
+            struct proc_event event;
+            struct proc_event* ev = &event;
+            memset(&event, 0, sizeof(event));
+            memcpy(&event, cn->data, cn->len < sizeof(event) ? cn->len : sizeof(event));
+
+            int pid;
+            if (ev->what == PROC_EVENT_EXEC) {
+                pid = ev->event_data.exec.process_tgid;
+                // exec 之后可执行文件和命令行都变了，下次检查时重新判断
+                ProcEntry* old = proc_find(pid);
+                if (old) old->spared_volatile = 1;
+            } else if (ev->what == PROC_EVENT_FORK &&
+                       ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid) {
+                pid = ev->event_data.fork.child_tgid;
+            } else {
+                continue;
+            }
+            events.events++;
+
+            int ret = proc_check(pid);
+            if (ret == 1) events.found++;
+            else if (ret == 0) watch_add(pid, now);
         }
+    }
+    // 缓冲区溢出（ENOBUFS）会丢事件，马上补一次全量扫描
+    if (len < 0 && errno == ENOBUFS) events.resync = 1;
+}
+
+// 把指标写到 -metrics 指定的文件；force 为 0 时距上次不足 METRICS_INTERVAL_MS 则跳过
+void metrics_write(int force) {
+    if (!options.metrics_path) return;
+    double now = now_ms();
+    if (!force && now - metrics.last_write_ms < METRICS_INTERVAL_MS) return;
+
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", options.metrics_path);
+    FILE* out = fopen(tmp, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot write metrics to %s: %s\n", tmp, strerror(errno));
+        metrics.last_write_ms = now;
+        return;
+    }
+
+    pthread_mutex_lock(&metrics.lock);
+    unsigned long kills = metrics.outcomes[OUTCOME_TERM] + metrics.outcomes[OUTCOME_KILLED];
+    double elapsed = (now - metrics.last_write_ms) / 1000.0;
+    double rate = metrics.last_write_ms > 0 && elapsed > 0 ? (kills - metrics.last_kills) / elapsed : 0;
 
+    metrics_counter(out, "kill_gpu_procs_sweeps_total", "Full /proc sweeps.", scanner.sweeps);
+    metrics_histogram(out, "kill_gpu_procs_sweep_duration_seconds", "Duration of a full /proc sweep.", &metrics.sweep);
+    metrics_counter(out, "kill_gpu_procs_process_events_total", "Process exec/fork events received.", events.events);
+    metrics_counter(out, "kill_gpu_procs_detections_total", "Processes handed to the killer.", metrics.detections);
+    metrics_counter(out, "kill_gpu_procs_spared_total", "Detections spared by the rules file.", metrics.spared);
+    fprintf(out, "# HELP kill_gpu_procs_kills_total Killer outcomes by result.\n"
+                 "# TYPE kill_gpu_procs_kills_total counter\n");
+    for (int i = 0; i < OUTCOME_COUNT; i++) {
+        fprintf(out, "kill_gpu_procs_kills_total{result=\"%s\"} %lu\n", outcome_names[i], metrics.outcomes[i]);
+    }
+    metrics_counter(out, "kill_gpu_procs_escalations_total", "SIGTERM timeouts escalated to SIGKILL.", metrics.escalations);
+    metrics_counter(out, "kill_gpu_procs_failures_total", "Processes that could not be signalled or survived SIGKILL.",
+                    metrics.outcomes[OUTCOME_FAILED] + metrics.outcomes[OUTCOME_STUCK]);
+    metrics_counter(out, "kill_gpu_procs_cgroup_writes_total", "cgroup.kill / cgroup.freeze writes.", cgroups.writes);
+    fprintf(out, "# HELP kill_gpu_procs_kills_per_second Kills per second since the previous write.\n"
+                 "# TYPE kill_gpu_procs_kills_per_second gauge\nkill_gpu_procs_kills_per_second %.3f\n", rate);
+    metrics_histogram(out, "kill_gpu_procs_detect_to_exit_seconds",
+                      "Time from detection until the process was confirmed gone.", &metrics.detect_to_exit);
+    metrics_histogram(out, "kill_gpu_procs_start_to_signal_seconds",
+                      "Time from process start until the first signal (clock tick resolution).", &metrics.start_to_signal);
+
+    metrics.last_kills = kills;
+    metrics.last_write_ms = now;
+    pthread_mutex_unlock(&metrics.lock);
+
+    if (fclose(out) != 0 || rename(tmp, options.metrics_path) != 0) {
+        fprintf(stderr, "Cannot write metrics to %s: %s\n", options.metrics_path, strerror(errno));
+        remove(tmp);
+    }
+}
+
+// 等待至多 ms 毫秒，期间处理进程事件和复查列表，返回新提交终止的进程数
+int events_wait(int ms) {
+    double deadline = now_ms() + ms;
+    events.found = 0;
+    events.resync = 0;
+
+    while (keep_running && !reload_requested && !events.resync) {
+        double now = now_ms();
+        double next = events.count ? watch_run(now) : deadline;
+        if (next > deadline) next = deadline;
+        // 空闲等待可长达数秒，指标文件仍按自己的节奏刷新
+        metrics_write(0);
+        if (options.metrics_path && next > now + METRICS_INTERVAL_MS) next = now + METRICS_INTERVAL_MS;
+        if (now >= deadline) break;
+
+        struct pollfd pfd = {events.fd, POLLIN, 0};
+        int timeout = (int)(next - now + 0.999);
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno != EINTR) break;
+        if (ret > 0) events_read();
+    }
+    return events.found;
+}
+#endif
+
+void show_help(void) {
+    printf("Usage: kill_gpu_procs [options]\n");
+    printf("  -device PATH    device path prefix to look for (default %s)\n", DEFAULT_DEVICE);
+    printf("  -interval MS    shortest delay between sweeps, used right after a kill (default %d, %d with -smi)\n",
+           DEFAULT_INTERVAL_MS, SMI_INTERVAL_MS);
+    printf("  -max-interval MS  longest delay once idle (default %d, %d with process events)\n",
+           IDLE_INTERVAL_MS, EVENT_INTERVAL_MS);
+    printf("  -poll           do not listen for process events, only poll\n");
+    printf("  -threads N      scanner threads (default: number of CPUs)\n");
+    printf("  -new-only       only scan PIDs that appeared since the previous sweep\n");
+    printf("  -term-timeout MS  grace period between SIGTERM and SIGKILL, 0 sends SIGKILL at once (default %d)\n",
+           TERM_TIMEOUT_MS);
+    printf("  -rules FILE     allow/deny rules deciding which processes to kill; SIGHUP reloads it\n");
+    printf("  -cgroup kill|freeze  evict the offender's whole cgroup v2 via cgroup.kill, or freeze it\n");
+    printf("  -cgroup-root DIR  cgroup v2 mount point (default %s)\n", CGROUP_ROOT);
+    printf("  -metrics FILE   write Prometheus text-format metrics to FILE every second (atomic rename)\n");
+    printf("  -quiet          do not log individual processes, only errors\n");
+    printf("  -smi            query nvidia-smi instead of scanning /proc\n");
+    printf("  -help           show this help\n");
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-help") == 0) {
+            show_help();
+            return 0;
+        } else if (strcmp(argv[i], "-smi") == 0) {
+            options.use_smi = 1;
+        } else if (strcmp(argv[i], "-new-only") == 0) {
+            options.new_only = 1;
+        } else if (strcmp(argv[i], "-device") == 0 && i + 1 < argc) {
+            options.device = argv[++i];
+            options.device_len = strlen(options.device);
+        } else if (strcmp(argv[i], "-poll") == 0) {
+            options.use_events = 0;
+        } else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc) {
+            options.interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-max-interval") == 0 && i + 1 < argc) {
+            options.max_interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-cgroup") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "kill") == 0) options.cgroup_mode = CGROUP_KILL;
+            else if (strcmp(argv[i], "freeze") == 0) options.cgroup_mode = CGROUP_FREEZE;
+            else {
+                fprintf(stderr, "-cgroup expects kill or freeze\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-cgroup-root") == 0 && i + 1 < argc) {
+            options.cgroup_root = argv[++i];
+        } else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc) {
+            options.metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "-quiet") == 0) {
+            options.quiet = 1;
+        } else if (strcmp(argv[i], "-rules") == 0 && i + 1 < argc) {
+            options.rules_path = argv[++i];
+        } else if (strcmp(argv[i], "-term-timeout") == 0 && i + 1 < argc) {
+            options.term_timeout_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            show_help();
+            return 1;
+        }
+    }
+#ifndef __linux__
+    options.use_smi = 1;  // 只有 Linux 提供 /proc/<pid>/fd
+    if (options.rules_path || options.cgroup_mode || options.metrics_path) {
+        fprintf(stderr, "-rules, -cgroup and -metrics are only supported on Linux\n");
+        return 1;
+    }
+#endif
+    if (options.use_smi) options.use_events = 0;
+    if (options.interval_ms < 0) {
+        options.interval_ms = options.use_smi ? SMI_INTERVAL_MS : DEFAULT_INTERVAL_MS;
+    }
+
+    // 注册终止信号处理
 #ifdef _WIN32
-        Sleep(1000);  // Windows sleep单位毫秒
+    SetConsoleCtrlHandler(ConsoleHandler, TRUE);
 #else
-        sleep(1);     // Linux sleep单位秒
+    signal(SIGINT, handle_signal);
+    signal(SIGHUP, handle_reload);
 #endif
+
+#ifdef __linux__
+    if (!options.use_smi && scanner_init() != 0) {
+        return 1;
+    }
+    if (killer_init() != 0) {
+        return 1;
+    }
+    if (options.rules_path && policy_reload() != 0) {
+        return 1;
+    }
+    if (options.cgroup_mode && cgroup_init() != 0) {
+        return 1;
+    }
+    if (options.use_events && events_open() != 0) {
+        fprintf(stderr, "Process events unavailable (%s), falling back to polling\n", strerror(errno));
+        options.use_events = 0;
+    }
+#endif
+    if (options.max_interval_ms < 0) {
+        options.max_interval_ms = options.use_events ? EVENT_INTERVAL_MS : IDLE_INTERVAL_MS;
+    }
+    if (options.max_interval_ms < options.interval_ms) {
+        options.max_interval_ms = options.interval_ms;
+    }
+
+    int idle = 0;
+    int interval = options.interval_ms;
+    while (keep_running) {
+        int found;
+#ifdef __linux__
+        if (reload_requested) {
+            reload_requested = 0;
+            if (options.rules_path) policy_reload();
+        }
+        found = options.use_smi ? smi_sweep() : proc_sweep();
+        metrics_write(0);
+#else
+        found = smi_sweep();
+#endif
+        if (found < 0) {
+            sleep_ms(SMI_INTERVAL_MS);
+            continue;
+        }
+
+        // 只在状态切换时提示一次，避免每轮刷屏
+        if (found == 0 && !idle) {
+            log_event("No GPU processes found.\n");
+        }
+        idle = found == 0;
+        fflush(stdout);
+
+        // 刚终止过进程时按最短间隔复扫，空闲后逐轮翻倍放宽
+        if (found > 0) {
+            interval = options.interval_ms;
+        } else if (interval < options.max_interval_ms) {
+            interval = interval * 2 > options.max_interval_ms ? options.max_interval_ms : interval * 2;
+        }
+
+#ifdef __linux__
+        if (options.use_events) {
+            // 新进程由事件触发检查，全量扫描只是兜底
+            if (events_wait(interval) > 0) {
+                idle = 0;
+                interval = options.interval_ms;
+            }
+            fflush(stdout);
+            continue;
+        }
+#endif
+        sleep_ms(interval);
     }
 
     printf("\nExiting...\n");
+#ifdef __linux__
+    if (options.use_events) {
+        printf("Process events: %lu\n", events.events);
+        events_close();
+    }
+    if (options.cgroup_mode) {
+        printf("Cgroup writes: %lu, processes covered by earlier writes: %lu\n", cgroups.writes, cgroups.covered);
+    }
+    killer_shutdown();  // 先等待终止中的进程，它还要读 /proc
+    metrics_write(1);
+    if (!options.use_smi) {
+        scanner_shutdown();
+    }
+#endif
 
     // 如果由信号触发退出，尝试启动桌面进程
     if (signal_received) {
@@ -117,9 +1882,9 @@ int main() {
         system("start explorer.exe"); // Windows启动资源管理器
 #else
         // Linux尝试启动GNOME或KDE（示例命令，可能需要根据桌面环境调整）
-        system("gnome-session --session=ubuntu > /dev/null 2>&1 &"); 
+        system("gnome-session --session=ubuntu > /dev/null 2>&1 &");
 #endif
     }
 
     return 0;
-}
\ No newline at end of file
+}
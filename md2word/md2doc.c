@@ -1,6 +1,14 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 #ifdef _WIN32
@@ -9,34 +17,706 @@
 #define realpath(N, R) _fullpath((R), (N), _MAX_PATH)
 #else
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
 #endif
 
 #define MAX_PATH_LEN 1024
-#define MAX_CMD_LEN 4096
+#define SPAWN_STDERR_MAX 65536
 #define DE_BUG 0
 
-void convert_file(const char *input_path, const char *options);
-void process_directory(const char *dir_path, const char *options);
+#ifdef _WIN32
+#define PATH_SEP '\\'
+#define THREAD_LOCAL __declspec(thread)
+#define MUTEX_LOCK(m) ((void)0)
+#define MUTEX_UNLOCK(m) ((void)0)
+#else
+#define PATH_SEP '/'
+#define THREAD_LOCAL __thread
+#define MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+extern char **environ;
+#endif
+
+#define REPORT_FILE_NAME "md2doc-report.json"
+#define CACHE_FILE_NAME ".md2doc-cache"
+#define CACHE_MAGIC "md2doc-cache 1"
+#define CACHE_BUCKETS 4096
+#define CACHE_ENTRY_BUCKETS 65536
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define WALK_BATCH_SIZE 65536
+#define MAX_EXCLUDES 64
+#define WATCH_BUCKETS 1024
+#define WATCH_DEBOUNCE_MS 100
+
+#define NATIVE_FALLBACK 1
+#define MAX_LIST_DEPTH 9
+#define MAX_TABLE_COLS 64
+#define PAGE_WIDTH_EMU 5943600LL // 6.5 英寸正文宽度
+#define EMU_PER_PIXEL 9525LL     // 按 96 DPI 换算
+#define SINK_FLUSH_SIZE 65536    // 流式缓冲区攒够这么多字节再交给 ZIP 条目
+#define ARENA_CHUNK_SIZE 65536
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_SIZE 32768
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_CHAIN 32
+#define DEFLATE_OUT_SIZE 16384
+#define MMAP_RELEASE_SIZE (16 << 20) // 每处理这么多输入就归还已读过的映射页
+#define MEDIA_BUCKETS 1024
+#define MEDIA_CACHE_LIMIT (128 << 20) // 批次内缓存的图片字节上限
+
+// 转换选项：pandoc 参数原样保留为参数向量，另存一份拼接串（含引擎选择）作为缓存键
+typedef struct
+{
+    char **args;
+    int count;
+    char *joined;
+    int timeout; // 单个任务的超时秒数，0 表示不限
+    int native;  // --engine=native
+} ConvertOptions;
+
+typedef struct
+{
+    int status;   // 子进程退出码；被信号终止或超时时为 -1
+    int signal;   // 终止子进程的信号，正常退出时为 0
+    int timed_out;
+    char *errors; // 捕获的 stderr，由调用者 free
+    size_t errors_len;
+    long long spawn_us; // posix_spawnp 本身的耗时
+    long long cpu_us;   // 子进程用户态 + 内核态时间，来自 wait4
+    long long max_rss_kb;
+} SpawnResult;
+
+// 单个文件的计时数据，时间单位均为微秒
+typedef struct
+{
+    const char *engine; // "pandoc"、"native" 或 "cached"
+    long long queue_us; // 入队到开始转换
+    long long spawn_us;
+    long long wall_us; // 转换器运行时间
+    long long cpu_us;
+    long long max_rss_kb;
+    long long input_bytes;
+    long long output_bytes;
+} JobStats;
+
+typedef struct
+{
+    char *path;
+    int ok;
+    JobStats stats;
+} JobRecord;
+
+static struct
+{
+    int enabled;
+    const char *out;
+    long long started;
+    JobRecord *records;
+    size_t count;
+    size_t cap;
+} report = {0, REPORT_FILE_NAME, 0, NULL, 0, 0};
+
+// 转换任务队列：目录遍历作为生产者，固定数量的工作线程并发调用 pandoc
+typedef struct Job
+{
+    struct Job *next;
+    long long queued_us;
+    char path[];
+} Job;
+
+typedef struct
+{
+    const ConvertOptions *options;
+    int workers;
+    int succeeded;
+    int failed;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t has_job;
+    pthread_t *threads;
+    Job *head;
+    Job *tail;
+    int closed;
+#endif
+} JobQueue;
+
+// 锁静态初始化：单文件转换不会调用 queue_start，但 record_result/report_add 仍会加锁
+static JobQueue queue = {
+#ifndef _WIN32
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .has_job = PTHREAD_COND_INITIALIZER,
+#endif
+    .workers = 0,
+};
+
+// 目录遍历选项
+enum
+{
+    SYMLINKS_SKIP,   // 忽略符号链接（默认，与只处理普通文件的旧行为一致）
+    SYMLINKS_FILES,  // 跟随指向文件的链接，不进入链接目录
+    SYMLINKS_FOLLOW, // 文件和目录链接都跟随，按 (dev, ino) 去重防止环路
+};
+
+#ifndef _WIN32
+typedef struct
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+} PathBuf;
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    int used;
+} DirId;
+
+#ifdef __linux__
+struct linux_dirent64
+{
+    uint64_t d_ino; // 内核结构是定长的，不随 _FILE_OFFSET_BITS 变化
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+#endif
+
+// 内置引擎的数据结构
+struct ZipWriter;
+
+// 设置了 sink 的缓冲区只保留一小段尾部，攒满后写入对应的 ZIP 条目
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+    struct ZipWriter *sink;
+} Buffer;
+
+// 定长 Huffman 的流式 deflate：32KB 滑动窗口 + 哈希链查找 LZ77 匹配
+typedef struct
+{
+    unsigned char window[2 * DEFLATE_WINDOW];
+    size_t pos; // 下一个待编码字节
+    size_t end; // 窗口内已填充的字节
+    int32_t head[DEFLATE_HASH_SIZE];
+    int32_t prev[DEFLATE_WINDOW];
+    uint32_t bits;
+    int bit_count;
+    unsigned char out[DEFLATE_OUT_SIZE];
+    size_t out_len;
+} Deflater;
+
+typedef struct
+{
+    char name[64];
+    int method; // 0 stored, 8 deflate
+    uint32_t crc;
+    uint32_t size;
+    uint32_t csize;
+    uint32_t offset;
+} ZipEntry;
+
+typedef struct ZipWriter
+{
+    FILE *fp;
+    uint32_t offset;
+    ZipEntry *entries;
+    int count;
+    int cap;
+    int failed;
+    int open;           // 当前是否有条目正在写入
+    Deflater *deflater; // 由调用者提供，条目之间复用
+} ZipWriter;
+
+// 每个线程一块分块内存池：文档模型节点从中分配，按段落回退、按文件重置，
+// 分块本身跨文件复用，避免逐节点 malloc/free
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t cap;
+    size_t used;
+    unsigned char data[];
+} ArenaChunk;
+
+typedef struct
+{
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+enum
+{
+    FMT_BOLD = 1,
+    FMT_ITALIC = 2,
+    FMT_STRIKE = 4,
+};
+
+enum
+{
+    INLINE_TEXT,
+    INLINE_CODE,
+    INLINE_BREAK,
+    INLINE_LINK,
+    INLINE_IMAGE,
+};
+
+// 行内节点，从线程内存池分配，文本直接指向段落缓冲区，不做拷贝
+typedef struct Inline
+{
+    struct Inline *next;
+    struct Inline *children; // 链接文字
+    int kind;
+    int format;
+    const char *text; // 文本、代码或图片说明
+    size_t len;
+    const char *target; // 链接地址或图片路径
+    size_t target_len;
+} Inline;
+
+typedef struct
+{
+    const char *text;
+    size_t len;
+} Slice;
+
+// 图片缓存条目，按内容哈希索引，多个路径可以指向同一条目
+typedef struct Media
+{
+    struct Media *next;
+    uint64_t hash;
+    size_t size;
+    uint32_t crc;
+    int width;
+    int height;
+    char ext[8];
+    int refs;            // 正在转换、引用了该图片的文档数
+    unsigned batch;      // 最近一次被引用的批次
+    unsigned char *data; // 超出缓存上限时为 NULL，写入时从 source 重新读取
+    char source[];
+} Media;
+
+typedef struct MediaPath
+{
+    struct MediaPath *next;
+    long long size;
+    long long mtime;
+    unsigned batch;
+    Media *media;
+    char path[];
+} MediaPath;
+
+typedef struct
+{
+    char *path;
+    Media *media;
+    int rel;
+    long long cx;
+    long long cy;
+} DocImage;
+
+typedef struct
+{
+    int level;
+    int start;
+} ListNum;
+
+typedef struct
+{
+    uint64_t key; // 类型与目标的 FNV 哈希，0 表示空槽
+    int id;
+} RelSlot;
+
+typedef struct
+{
+    Buffer xml;  // word/document.xml，边生成边压缩写入 ZIP
+    Buffer rels; // 图片与超链接关系
+    ZipWriter zip;
+    const char *dir;
+    int next_rel;
+    RelSlot *rel_slots; // 按目标去重，同一链接反复出现时只登记一次
+    size_t rel_cap;
+    DocImage *images;
+    int image_count;
+    int drawing_count;
+    ListNum *lists;
+    int list_count;
+    int fallback;
+    char reason[128];
+} DocWriter;
+
+enum
+{
+    PARA_NONE,
+    PARA_TEXT,
+    PARA_LIST_ITEM,
+    PARA_LIST_CONT,
+    PARA_QUOTE,
+};
+
+typedef struct
+{
+    size_t indent;  // 列表标记所在列
+    size_t content; // 列表项内容起始列
+    int ordered;
+    int num;
+} ListLevel;
+
+typedef struct
+{
+    DocWriter *doc;
+    Buffer para;
+    int para_kind;
+    int para_lines;
+    int para_level;
+    int para_num;
+    int first_para;
+    int blank;
+    int line_no;
+    char code_fence;
+    size_t code_fence_len;
+    size_t code_indent;
+    int code_indented;
+    int code_lines;
+    int table_cols;
+    int table_aligns[MAX_TABLE_COLS];
+    ListLevel lists[MAX_LIST_DEPTH];
+    int list_depth;
+} MdParser;
+
+static struct
+{
+    int recursive;
+    int symlinks;
+    int exclude_count;
+    const char *excludes[MAX_EXCLUDES];
+#ifndef _WIN32
+    DirId *visited;
+    size_t visited_cap;
+    size_t visited_count;
+#endif
+} walk;
+
+// 增量缓存：资源、清单和文档条目都按路径哈希索引，整个运行共享一张表
+typedef struct Resource
+{
+    struct Resource *next;
+#ifndef _WIN32
+    pthread_mutex_t lock; // 保护下列字段；哈希文件时只持有它，不占用 cache.lock
+#endif
+    long long size;
+    long long mtime;
+    uint64_t hash;
+    int checked;
+    unsigned stamp;
+    char path[];
+} Resource;
+
+struct CacheEntry;
+
+typedef struct Manifest
+{
+    struct Manifest *next;
+    struct CacheEntry *entries;
+    int dirty;
+    char dir[];
+} Manifest;
+
+typedef struct CacheEntry
+{
+    struct CacheEntry *next;
+    struct CacheEntry *next_in_manifest;
+    Manifest *manifest;
+    long long size;
+    long long mtime;
+    uint64_t content;
+    uint64_t options;
+    uint64_t resources;
+    int resource_count;
+    Resource **resource_list;
+    char path[];
+} CacheEntry;
+
+typedef struct
+{
+    long long size;
+    long long mtime;
+    uint64_t content;
+    uint64_t options;
+    uint64_t resources;
+    int resource_count;
+    char **resource_paths;
+} Fingerprint;
+
+static struct
+{
+    int force;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+    int hits;   // 资源指纹直接复用的次数
+    int misses; // 资源内容重新哈希的次数
+    Resource *resources[CACHE_BUCKETS];
+    Manifest *manifests[CACHE_BUCKETS];
+    CacheEntry *entries[CACHE_ENTRY_BUCKETS];
+} cache = {
+#ifndef _WIN32
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+    .force = 0,
+};
+
+static struct
+{
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+    MediaPath *by_path[MEDIA_BUCKETS];
+    Media *by_hash[MEDIA_BUCKETS];
+    size_t bytes;
+    unsigned batch; // 监视模式下每投入一批转换加一
+    int hits;
+    int misses;
+} media = {
+#ifndef _WIN32
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+    .bytes = 0,
+};
+
+#ifdef __linux__
+// 监视模式下按路径合并的待转换文件
+typedef struct WatchItem
+{
+    struct WatchItem *next;
+    long long due; // 静默期结束时间
+    int running;   // 已投入队列，尚未转换完
+    int dirty;     // 转换期间又有变化，完成后需要再转一次
+    char path[];
+} WatchItem;
+
+static struct
+{
+    int active;
+    volatile sig_atomic_t stop;
+    int fd;      // inotify
+    int wake[2]; // 工作线程和信号处理函数通过它唤醒 poll
+    int debounce;
+    size_t root_len;
+    char **dirs; // wd -> 目录路径
+    int dir_cap;
+    WatchItem *items[WATCH_BUCKETS];
+    int waiting;
+    int running;
+    int finished;
+    pthread_mutex_t lock;
+} watch = {
+    .fd = -1,
+    .debounce = WATCH_DEBOUNCE_MS,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+#endif
+
+int convert_file(const char *input_path, const ConvertOptions *options, JobStats *stats);
+void process_directory(const char *dir_path);
+void queue_start(int workers, const ConvertOptions *options);
+void queue_submit(const char *input_path);
+int queue_finish(void);
+int default_jobs(void);
+int run_pandoc(const char *input_path, const char *output_path, const char *dir_path,
+               const ConvertOptions *options, JobStats *stats);
+int spawn_wait(char *const argv[], int timeout_sec, SpawnResult *result);
+void native_init(void);
+void native_release(void);
+void native_sweep(void);
+void native_report(void);
+int native_convert(const char *input_path, const char *output_path, const char *dir_path,
+                   char *reason, size_t reason_len);
+long long now_ms(void);
+long long now_us(void);
+int report_write(int jobs);
+int cache_check(const char *input_path, const char *output_path, const char *options, Fingerprint *fp);
+void cache_record(const char *input_path, const Fingerprint *fp);
+void cache_save(void);
+void fingerprint_free(Fingerprint *fp);
+static unsigned bucket_of(const char *key, unsigned buckets);
+static long long thread_cpu_us(void);
+static void report_add(const char *path, int ret, const JobStats *stats);
+#ifndef _WIN32
+static int path_push(PathBuf *path, const char *name, size_t len);
+static int visited_add(dev_t dev, ino_t ino);
+static void walk_dir(int fd, PathBuf *path, size_t root_len);
+#endif
+#ifdef __linux__
+int watch_run(const char *dir_path);
+static void watch_touch(const char *path, int delay);
+static void watch_done(const char *path);
+static void watch_add_dir(const char *path);
+#endif
+void cache_refresh(void);
+void cache_report(void);
 void print_help();
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    int jobs = default_jobs();
+    int timeout = 0;
+    int native = 0;
+    int watch_mode = 0;
+    int debounce = WATCH_DEBOUNCE_MS;
+    int argi = 1;
+
+    // md2doc 自身的选项位于输入路径之前，路径之后的参数全部交给 pandoc
+    while (argi < argc && argv[argi][0] == '-')
+    {
+        if (strcmp(argv[argi], "-h") == 0 || strcmp(argv[argi], "--help") == 0)
+        {
+            print_help();
+            return EXIT_SUCCESS;
+        }
+        else if (strcmp(argv[argi], "--force") == 0)
+        {
+            cache.force = 1;
+            argi += 1;
+        }
+        else if (strcmp(argv[argi], "-r") == 0 || strcmp(argv[argi], "--recursive") == 0)
+        {
+            walk.recursive = 1;
+            argi += 1;
+        }
+        else if (strncmp(argv[argi], "--exclude=", 10) == 0)
+        {
+            if (walk.exclude_count >= MAX_EXCLUDES)
+            {
+                fprintf(stderr, "Too many --exclude patterns (max %d)\n", MAX_EXCLUDES);
+                return EXIT_FAILURE;
+            }
+            walk.excludes[walk.exclude_count++] = argv[argi] + 10;
+            argi += 1;
+        }
+        else if (strncmp(argv[argi], "--symlinks=", 11) == 0)
+        {
+            const char *policy = argv[argi] + 11;
+            if (strcmp(policy, "skip") == 0)
+                walk.symlinks = SYMLINKS_SKIP;
+            else if (strcmp(policy, "files") == 0)
+                walk.symlinks = SYMLINKS_FILES;
+            else if (strcmp(policy, "follow") == 0)
+                walk.symlinks = SYMLINKS_FOLLOW;
+            else
+            {
+                fprintf(stderr, "Unknown symlink policy: %s\n", policy);
+                return EXIT_FAILURE;
+            }
+            argi += 1;
+        }
+        else if (strncmp(argv[argi], "--engine=", 9) == 0)
+        {
+            if (strcmp(argv[argi] + 9, "native") == 0)
+                native = 1;
+            else if (strcmp(argv[argi] + 9, "pandoc") == 0)
+                native = 0;
+            else
+            {
+                fprintf(stderr, "Unknown engine: %s\n", argv[argi] + 9);
+                return EXIT_FAILURE;
+            }
+            argi += 1;
+        }
+        else if (strncmp(argv[argi], "--report=", 9) == 0)
+        {
+            if (strcmp(argv[argi] + 9, "json") != 0)
+            {
+                fprintf(stderr, "Unknown report format: %s\n", argv[argi] + 9);
+                return EXIT_FAILURE;
+            }
+            report.enabled = 1;
+            argi += 1;
+        }
+        else if (strncmp(argv[argi], "--report-out=", 13) == 0)
+        {
+            report.enabled = 1;
+            report.out = argv[argi] + 13;
+            argi += 1;
+        }
+        else if (strcmp(argv[argi], "--watch") == 0)
+        {
+            watch_mode = 1;
+            argi += 1;
+        }
+        else if (strncmp(argv[argi], "--debounce=", 11) == 0)
+        {
+            debounce = atoi(argv[argi] + 11);
+            if (debounce < 0)
+            {
+                fprintf(stderr, "Invalid debounce: %s\n", argv[argi] + 11);
+                return EXIT_FAILURE;
+            }
+            argi += 1;
+        }
+        else if (strncmp(argv[argi], "--timeout=", 10) == 0)
+        {
+            timeout = atoi(argv[argi] + 10);
+            if (timeout < 0)
+            {
+                fprintf(stderr, "Invalid timeout: %s\n", argv[argi] + 10);
+                return EXIT_FAILURE;
+            }
+            argi += 1;
+        }
+        else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc)
+        {
+            jobs = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (strncmp(argv[argi], "-j", 2) == 0 && argv[argi][2] != '\0')
+        {
+            jobs = atoi(argv[argi] + 2);
+            argi += 1;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            fprintf(stderr, "Use -h for help.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argi >= argc)
     {
-        fprintf(stderr, "Usage: %s <input_path> [pandoc_options...]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [options] <input_path> [pandoc_options...]\n", argv[0]);
         fprintf(stderr, "Use -h for help.\n");
         return EXIT_FAILURE;
     }
 
-    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+    if (jobs < 1)
     {
-        print_help();
-        return EXIT_SUCCESS;
+        fprintf(stderr, "Invalid job count: %d\n", jobs);
+        return EXIT_FAILURE;
     }
 
-    char abs_input_path[MAX_PATH_LEN];
-    if (realpath(argv[1], abs_input_path) == NULL)
+    // 由 realpath 分配结果，不受 MAX_PATH_LEN 限制
+    char *abs_input_path = realpath(argv[argi], NULL);
+    if (abs_input_path == NULL)
     {
         perror("Error resolving input path");
         return EXIT_FAILURE;
@@ -49,31 +729,90 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    char options[MAX_CMD_LEN] = "";
-    for (int i = 2; i < argc; ++i)
+    if (watch_mode && !S_ISDIR(path_stat.st_mode))
+    {
+        fprintf(stderr, "--watch requires a directory\n");
+        return EXIT_FAILURE;
+    }
+#ifdef __linux__
+    watch.debounce = debounce;
+#else
+    if (watch_mode)
+    {
+        fprintf(stderr, "--watch is only supported on Linux\n");
+        return EXIT_FAILURE;
+    }
+#endif
+
+    ConvertOptions options = {argv + argi + 1, argc - argi - 1, NULL, timeout, native};
+    const char *engine_key = native ? "--engine=native " : "";
+    size_t joined_len = strlen(engine_key) + 1;
+    for (int i = 0; i < options.count; ++i)
+        joined_len += strlen(options.args[i]) + 1;
+    options.joined = malloc(joined_len);
+    if (!options.joined)
+    {
+        perror("Out of memory");
+        return EXIT_FAILURE;
+    }
+    strcpy(options.joined, engine_key);
+    char *cursor = options.joined + strlen(engine_key);
+    for (int i = 0; i < options.count; ++i)
     {
-        strncat(options, argv[i], MAX_CMD_LEN - strlen(options) - 1);
-        strncat(options, " ", MAX_CMD_LEN - strlen(options) - 1);
+        size_t len = strlen(options.args[i]);
+        memcpy(cursor, options.args[i], len);
+        cursor[len] = ' ';
+        cursor += len + 1;
     }
+    *cursor = '\0';
 
+    if (native)
+        native_init();
+    report.started = now_us();
+
+    int ret;
     if (S_ISREG(path_stat.st_mode))
     {
-        convert_file(abs_input_path, options);
+        JobStats stats = {0};
+        int result = convert_file(abs_input_path, &options, &stats);
+        if (report.enabled)
+            report_add(abs_input_path, result, &stats);
+        ret = result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        cache_save();
     }
     else if (S_ISDIR(path_stat.st_mode))
     {
-        process_directory(abs_input_path, options);
+        queue_start(jobs, &options);
+#ifdef __linux__
+        if (watch_mode)
+        {
+            ret = watch_run(abs_input_path) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else
+#endif
+        {
+            process_directory(abs_input_path);
+            ret = queue_finish() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+            cache_save();
+        }
     }
     else
     {
         fprintf(stderr, "Input path is neither a file nor a directory\n");
-        return EXIT_FAILURE;
+        ret = EXIT_FAILURE;
     }
-
-    return EXIT_SUCCESS;
+    cache_report();
+    if (native)
+        native_report();
+    if (report.enabled && report_write(jobs) != 0)
+        ret = EXIT_FAILURE;
+    native_release();
+    free(options.joined);
+    free(abs_input_path);
+    return ret;
 }
 
-void convert_file(const char *input_path, const char *options)
+int convert_file(const char *input_path, const ConvertOptions *options, JobStats *stats)
 {
 
     if (DE_BUG)
@@ -81,28 +820,36 @@ void convert_file(const char *input_path, const char *options)
         // 新增调试输出
         printf("[DEBUG] 原始输入路径: %s\n", input_path);
 
-        char abs_path[MAX_PATH_LEN];
-        if (realpath(input_path, abs_path))
+        char *abs_path = realpath(input_path, NULL);
+        if (abs_path)
         {
             printf("[DEBUG] 规范化绝对路径: %s\n", abs_path);
+            free(abs_path);
         }
         else
         {
             perror("路径解析失败");
         }
     }
-    char output_path[MAX_PATH_LEN];
-    strncpy(output_path, input_path, MAX_PATH_LEN - 1);
-    output_path[MAX_PATH_LEN - 1] = '\0';
+    // 目录遍历生成的路径没有长度上限，输出路径按输入长度分配
+    size_t input_len = strlen(input_path);
+    char *output_path = malloc(input_len + sizeof(".docx"));
+    char *dir_path = malloc(input_len + 1);
+    if (!output_path || !dir_path)
+    {
+        fprintf(stderr, "Conversion failed for %s (out of memory)\n", input_path);
+        free(output_path);
+        free(dir_path);
+        return -1;
+    }
+    memcpy(output_path, input_path, input_len + 1);
 
     char *last_dot = strrchr(output_path, '.');
     if (last_dot != NULL)
         *last_dot = '\0';
-    strncat(output_path, ".docx", MAX_PATH_LEN - strlen(output_path) - 1);
+    strcat(output_path, ".docx");
 
-    char dir_path[MAX_PATH_LEN];
-    strncpy(dir_path, input_path, MAX_PATH_LEN - 1);
-    dir_path[MAX_PATH_LEN - 1] = '\0';
+    memcpy(dir_path, input_path, input_len + 1);
     char *last_slash = strrchr(dir_path, '/');
 #ifdef _WIN32
     if (!last_slash)
@@ -111,27 +858,135 @@ void convert_file(const char *input_path, const char *options)
     if (last_slash)
         *last_slash = '\0';
 
-    char command[MAX_CMD_LEN];
-    snprintf(command, MAX_CMD_LEN, "pandoc \"%s\" %s -o \"%s\" --resource-path=\"%s\"",
-             input_path, options, output_path, dir_path);
+    struct stat st;
+    if (stat(input_path, &st) == 0)
+        stats->input_bytes = (long long)st.st_size;
 
-    printf("Converting: %s\n", input_path);
-    int ret = system(command);
+    Fingerprint fp;
+    if (cache_check(input_path, output_path, options->joined, &fp))
+    {
+        printf("Up to date: %s\n", input_path);
+        stats->engine = "cached";
+        if (stat(output_path, &st) == 0)
+            stats->output_bytes = (long long)st.st_size;
+        fingerprint_free(&fp);
+        free(output_path);
+        free(dir_path);
+        return 0;
+    }
 
-    if (ret != 0)
+    printf("Converting: %s\n", input_path);
+    long long started = now_us();
+    int ret;
+    // 内置引擎不理解 pandoc 选项，带选项时直接交给 pandoc
+    if (options->native && options->count == 0)
     {
-        fprintf(stderr, "Conversion failed for %s (Error code: %d)\n",
-                input_path, ret);
+        char reason[160];
+        stats->engine = "native";
+        long long cpu_before = thread_cpu_us();
+        ret = native_convert(input_path, output_path, dir_path, reason, sizeof(reason));
+        stats->cpu_us = thread_cpu_us() - cpu_before;
+        if (ret == NATIVE_FALLBACK)
+        {
+            if (DE_BUG)
+                printf("[DEBUG] 内置引擎回退到 pandoc: %s (%s)\n", input_path, reason);
+            ret = run_pandoc(input_path, output_path, dir_path, options, stats);
+        }
+        else if (ret != 0)
+        {
+            fprintf(stderr, "Conversion failed for %s (%s)\n", input_path, reason);
+        }
     }
     else
+    {
+        ret = run_pandoc(input_path, output_path, dir_path, options, stats);
+    }
+    stats->wall_us = now_us() - started;
+
+    if (ret == 0)
     {
         printf("Success: %s -> %s\n", input_path, output_path);
+        cache_record(input_path, &fp);
+        if (stat(output_path, &st) == 0)
+            stats->output_bytes = (long long)st.st_size;
+    }
+    fingerprint_free(&fp);
+    free(output_path);
+    free(dir_path);
+    return ret == 0 ? 0 : -1;
+}
+
+// 启动 pandoc 转换单个文件，失败时打印原因和 pandoc 的错误输出
+int run_pandoc(const char *input_path, const char *output_path, const char *dir_path,
+               const ConvertOptions *options, JobStats *stats)
+{
+    // 先记录引擎，启动前失败时报告里也有值
+    stats->engine = "pandoc";
+
+    // pandoc <input> [options...] -o <output> --resource-path=<dir>
+    size_t resource_len = strlen("--resource-path=") + strlen(dir_path) + 1;
+    char *resource_arg = malloc(resource_len);
+    char **args = malloc((size_t)(options->count + 6) * sizeof(char *));
+    if (!resource_arg || !args)
+    {
+        free(resource_arg);
+        free(args);
+        return -1;
+    }
+    snprintf(resource_arg, resource_len, "--resource-path=%s", dir_path);
+    int n = 0;
+    args[n++] = "pandoc";
+    args[n++] = (char *)input_path;
+    for (int i = 0; i < options->count; ++i)
+        args[n++] = options->args[i];
+    args[n++] = "-o";
+    args[n++] = (char *)output_path;
+    args[n++] = resource_arg;
+    args[n] = NULL;
+
+    SpawnResult result;
+    int ret = spawn_wait(args, options->timeout, &result);
+    free(args);
+    free(resource_arg);
+    stats->spawn_us = result.spawn_us;
+    stats->cpu_us += result.cpu_us;
+    stats->max_rss_kb = result.max_rss_kb;
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "Conversion failed for %s (cannot run pandoc: %s)\n",
+                input_path, strerror(errno));
+    }
+    else if (result.status != 0)
+    {
+        char reason[64];
+        if (result.timed_out)
+            snprintf(reason, sizeof(reason), "timed out after %d s", options->timeout);
+        else if (result.signal)
+            snprintf(reason, sizeof(reason), "killed by signal %d", result.signal);
+        else
+            snprintf(reason, sizeof(reason), "Error code: %d", result.status);
+        fprintf(stderr, "Conversion failed for %s (%s)\n%.*s", input_path, reason,
+                (int)result.errors_len, result.errors ? result.errors : "");
+        if (result.timed_out || result.signal)
+            remove(output_path); // 被中断的 pandoc 可能留下不完整的输出
+        ret = -1;
+    }
+    else if (result.errors_len)
+    {
+        fprintf(stderr, "%.*s", (int)result.errors_len, result.errors);
     }
+    free(result.errors);
+    return ret != 0 ? -1 : 0;
 }
 
-void process_directory(const char *dir_path, const char *options)
+
+void process_directory(const char *dir_path)
 {
 #ifdef _WIN32
+    if (walk.recursive || walk.exclude_count > 0)
+        fprintf(stderr, "Warning: -r/--exclude are not supported on Windows, converting top level only\n");
+
     char search_path[MAX_PATH_LEN];
     snprintf(search_path, MAX_PATH_LEN, "%s\\*.md", dir_path);
 
@@ -147,47 +1002,4087 @@ void process_directory(const char *dir_path, const char *options)
         {
             char file_path[MAX_PATH_LEN];
             snprintf(file_path, MAX_PATH_LEN, "%s\\%s", dir_path, find_data.cFileName);
-            convert_file(file_path, options);
+            queue_submit(file_path);
         }
     } while (FindNextFile(hFind, &find_data));
 
     FindClose(hFind);
 #else
-    DIR *dir = opendir(dir_path);
-    if (!dir)
+    size_t root_len = strlen(dir_path);
+    PathBuf path = {NULL, 0, 0};
+    if (path_push(&path, dir_path, root_len) != 0)
+        return;
+
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
     {
         perror("Directory open error");
+        free(path.buf);
         return;
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)))
+    struct stat st;
+    if (walk.symlinks == SYMLINKS_FOLLOW && fstat(fd, &st) == 0)
+        visited_add(st.st_dev, st.st_ino);
+    walk_dir(fd, &path, root_len);
+    free(path.buf);
+    free(walk.visited);
+    walk.visited = NULL;
+    walk.visited_cap = walk.visited_count = 0;
+#endif
+}
+
+#ifndef _WIN32
+static int path_push(PathBuf *path, const char *name, size_t len)
+{
+    if (path->len + len + 2 > path->cap)
+    {
+        size_t cap = path->cap ? path->cap : 256;
+        while (path->len + len + 2 > cap)
+            cap *= 2;
+        char *grown = realloc(path->buf, cap);
+        if (!grown)
+            return -1;
+        path->buf = grown;
+        path->cap = cap;
+    }
+    memcpy(path->buf + path->len, name, len);
+    path->len += len;
+    path->buf[path->len] = '\0';
+    return 0;
+}
+
+// 记录已进入的目录，跟随符号链接时避免环路和重复转换
+static int visited_add(dev_t dev, ino_t ino)
+{
+    if (walk.visited_count * 2 >= walk.visited_cap)
+    {
+        size_t cap = walk.visited_cap ? walk.visited_cap * 2 : 256;
+        DirId *table = calloc(cap, sizeof(DirId));
+        if (!table)
+            return 1;
+        for (size_t i = 0; i < walk.visited_cap; ++i)
+        {
+            if (!walk.visited[i].used)
+                continue;
+            size_t j = (size_t)(walk.visited[i].ino * 31 + walk.visited[i].dev) & (cap - 1);
+            while (table[j].used)
+                j = (j + 1) & (cap - 1);
+            table[j] = walk.visited[i];
+        }
+        free(walk.visited);
+        walk.visited = table;
+        walk.visited_cap = cap;
+    }
+
+    size_t j = (size_t)(ino * 31 + dev) & (walk.visited_cap - 1);
+    while (walk.visited[j].used)
+    {
+        if (walk.visited[j].dev == dev && walk.visited[j].ino == ino)
+            return 0;
+        j = (j + 1) & (walk.visited_cap - 1);
+    }
+    walk.visited[j].used = 1;
+    walk.visited[j].dev = dev;
+    walk.visited[j].ino = ino;
+    walk.visited_count++;
+    return 1;
+}
+
+// rel 为相对输入目录的路径；不含 '/' 的模式同时匹配文件名
+static int is_excluded(const char *rel, const char *name)
+{
+    for (int i = 0; i < walk.exclude_count; ++i)
+    {
+        const char *pattern = walk.excludes[i];
+        if (fnmatch(pattern, rel, FNM_PATHNAME) == 0)
+            return 1;
+        if (strchr(pattern, '/') == NULL && fnmatch(pattern, name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void walk_entry(int dirfd, PathBuf *path, size_t root_len, const char *name, unsigned char type)
+{
+    size_t name_len = strlen(name);
+    if (name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.')))
+        return;
+
+    int is_md = name_len > 3 && memcmp(name + name_len - 3, ".md", 3) == 0;
+    int maybe_dir = walk.recursive && (type == DT_DIR || type == DT_UNKNOWN || type == DT_LNK);
+    if (!is_md && !maybe_dir)
+        return;
+
+    struct stat st;
+    if (type == DT_UNKNOWN || (type == DT_LNK && walk.symlinks != SYMLINKS_SKIP))
+    {
+        int flags = type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+        if (fstatat(dirfd, name, &st, flags) != 0)
+            return;
+        if (S_ISREG(st.st_mode))
+            type = DT_REG;
+        else if (S_ISDIR(st.st_mode) && (type != DT_LNK || walk.symlinks == SYMLINKS_FOLLOW))
+            type = DT_DIR;
+        else
+            return;
+    }
+    if (type != DT_REG && type != DT_DIR)
+        return;
+    if (type == DT_REG && !is_md)
+        return;
+    if (type == DT_DIR && !walk.recursive)
+        return;
+
+    // 在共享路径缓冲区末尾追加文件名，处理完再截断，不为每个条目重新拼接完整路径
+    size_t saved = path->len;
+    if (path_push(path, "/", 1) != 0 || path_push(path, name, name_len) != 0)
+    {
+        path->len = saved;
+        path->buf[saved] = '\0';
+        return;
+    }
+
+    if (walk.exclude_count == 0 || !is_excluded(path->buf + root_len + 1, name))
     {
-        if (entry->d_type == DT_REG)
+        if (type == DT_REG)
+        {
+#ifdef __linux__
+            if (watch.active)
+                watch_touch(path->buf, 0);
+            else
+#endif
+                queue_submit(path->buf);
+        }
+        else
         {
-            const char *name = entry->d_name;
-            size_t len = strlen(name);
-            if (len > 3 && strcmp(name + len - 3, ".md") == 0)
+            int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                                             (walk.symlinks == SYMLINKS_FOLLOW ? 0 : O_NOFOLLOW));
+            if (fd >= 0)
+            {
+                if (walk.symlinks != SYMLINKS_FOLLOW || (fstat(fd, &st) == 0 && visited_add(st.st_dev, st.st_ino)))
+                    walk_dir(fd, path, root_len);
+                else
+                    close(fd);
+            }
+            else
             {
-                char file_path[MAX_PATH_LEN];
-                snprintf(file_path, MAX_PATH_LEN, "%s/%s", dir_path, name);
-                convert_file(file_path, options);
+                fprintf(stderr, "Directory open error: %s: %s\n", path->buf, strerror(errno));
             }
         }
     }
-    closedir(dir);
-#endif
+
+    path->len = saved;
+    path->buf[saved] = '\0';
+}
+
+// 遍历 fd 指向的目录（函数负责关闭 fd），找到的 .md 文件立即投入转换队列
+static void walk_dir(int fd, PathBuf *path, size_t root_len)
+{
+#ifdef __linux__
+    if (watch.active)
+        watch_add_dir(path->buf);
+
+    // getdents64 一次系统调用取回一整批目录项
+    char *batch = malloc(WALK_BATCH_SIZE);
+    if (!batch)
+    {
+        close(fd);
+        return;
+    }
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, batch, WALK_BATCH_SIZE)) > 0)
+    {
+        for (long offset = 0; offset < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(batch + offset);
+            offset += d->d_reclen;
+            walk_entry(fd, path, root_len, d->d_name, d->d_type);
+        }
+    }
+    if (n < 0)
+        fprintf(stderr, "Directory read error: %s: %s\n", path->buf, strerror(errno));
+    free(batch);
+    close(fd);
+#else
+    DIR *dir = fdopendir(fd);
+    if (!dir)
+    {
+        close(fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+        walk_entry(dirfd(dir), path, root_len, entry->d_name, entry->d_type);
+    closedir(dir);
+#endif
+}
+#endif
+
+int default_jobs(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static void record_result(int ret)
+{
+    MUTEX_LOCK(&queue.lock);
+    if (ret == 0)
+        queue.succeeded++;
+    else
+        queue.failed++;
+    MUTEX_UNLOCK(&queue.lock);
+}
+
+#ifndef _WIN32
+static void *worker_main(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.head == NULL && !queue.closed)
+            pthread_cond_wait(&queue.has_job, &queue.lock);
+        Job *job = queue.head;
+        if (job == NULL)
+        {
+            // 队列已关闭且任务已取空
+            pthread_mutex_unlock(&queue.lock);
+            native_release();
+            return NULL;
+        }
+        queue.head = job->next;
+        if (queue.head == NULL)
+            queue.tail = NULL;
+        pthread_mutex_unlock(&queue.lock);
+
+        JobStats stats = {0};
+        stats.queue_us = now_us() - job->queued_us;
+        int ret = convert_file(job->path, queue.options, &stats);
+        record_result(ret);
+        if (report.enabled)
+            report_add(job->path, ret, &stats);
+#ifdef __linux__
+        if (watch.active)
+            watch_done(job->path);
+#endif
+        free(job);
+    }
+}
+#endif
+
+void queue_start(int workers, const ConvertOptions *options)
+{
+    queue.options = options;
+    queue.workers = workers;
+    queue.succeeded = 0;
+    queue.failed = 0;
+#ifndef _WIN32
+    queue.head = queue.tail = NULL;
+    queue.closed = 0;
+    queue.threads = calloc((size_t)workers, sizeof(pthread_t));
+    if (queue.threads == NULL)
+    {
+        queue.workers = 0;
+        return;
+    }
+    for (int i = 0; i < workers; ++i)
+    {
+        if (pthread_create(&queue.threads[i], NULL, worker_main, NULL) != 0)
+        {
+            perror("Worker thread creation failed");
+            queue.workers = i;
+            break;
+        }
+    }
+#endif
+}
+
+void queue_submit(const char *input_path)
+{
+#ifndef _WIN32
+    size_t len = strlen(input_path);
+    Job *job = queue.workers > 0 ? malloc(sizeof(Job) + len + 1) : NULL;
+    if (job != NULL)
+    {
+        memcpy(job->path, input_path, len + 1);
+        job->next = NULL;
+        job->queued_us = now_us();
+
+        pthread_mutex_lock(&queue.lock);
+        if (queue.tail)
+            queue.tail->next = job;
+        else
+            queue.head = job;
+        queue.tail = job;
+        pthread_cond_signal(&queue.has_job);
+        pthread_mutex_unlock(&queue.lock);
+        return;
+    }
+#endif
+    // 没有可用的工作线程（Windows 或线程创建失败）时退化为串行转换
+    JobStats stats = {0};
+    int ret = convert_file(input_path, queue.options, &stats);
+    record_result(ret);
+    if (report.enabled)
+        report_add(input_path, ret, &stats);
+#ifdef __linux__
+    if (watch.active)
+        watch_done(input_path);
+#endif
+}
+
+// 等待所有任务完成并打印汇总，返回失败的文件数
+int queue_finish(void)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&queue.lock);
+    queue.closed = 1;
+    pthread_cond_broadcast(&queue.has_job);
+    pthread_mutex_unlock(&queue.lock);
+
+    for (int i = 0; i < queue.workers; ++i)
+        pthread_join(queue.threads[i], NULL);
+    free(queue.threads);
+    queue.threads = NULL;
+#endif
+
+    printf("Done: %d succeeded, %d failed\n", queue.succeeded, queue.failed);
+    return queue.failed;
+}
+
+// ---- 监视模式 ----
+// --watch 先完整转换一遍，然后用 inotify 监听目录树，只重新转换发生变化的文件。
+// 同一文件的事件按路径合并，最后一次事件之后静默 debounce 毫秒才投入队列，
+// 编辑器保存时的一连串写入和改名只触发一次转换；正在转换的文件再次变化时
+// 记为 dirty，本次完成后再排一次，保证同一输出不会被两个任务同时写。
+
+#ifdef __linux__
+static void watch_stop(int sig)
+{
+    (void)sig;
+    watch.stop = 1;
+    ssize_t n = write(watch.wake[1], "", 1);
+    (void)n;
+}
+
+static WatchItem **watch_find(const char *path)
+{
+    WatchItem **slot = &watch.items[bucket_of(path, WATCH_BUCKETS)];
+    while (*slot && strcmp((*slot)->path, path) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+// 记录一次变化；delay 为 0 时（首轮全量扫描）不等待静默期
+static void watch_touch(const char *path, int delay)
+{
+    pthread_mutex_lock(&watch.lock);
+    WatchItem **slot = watch_find(path);
+    WatchItem *item = *slot;
+    if (!item)
+    {
+        item = calloc(1, sizeof(WatchItem) + strlen(path) + 1);
+        if (item)
+        {
+            strcpy(item->path, path);
+            *slot = item;
+            watch.waiting++;
+        }
+    }
+    else if (item->running)
+    {
+        item->dirty = 1;
+    }
+    if (item && !item->running)
+        item->due = now_ms() + delay;
+    pthread_mutex_unlock(&watch.lock);
+}
+
+// 工作线程转换完一个文件后调用
+static void watch_done(const char *path)
+{
+    pthread_mutex_lock(&watch.lock);
+    WatchItem **slot = watch_find(path);
+    WatchItem *item = *slot;
+    if (item)
+    {
+        watch.running--;
+        watch.finished++;
+        if (item->dirty)
+        {
+            item->running = 0;
+            item->dirty = 0;
+            item->due = now_ms() + watch.debounce;
+            watch.waiting++;
+        }
+        else
+        {
+            *slot = item->next;
+            free(item);
+        }
+    }
+    pthread_mutex_unlock(&watch.lock);
+    ssize_t n = write(watch.wake[1], "", 1);
+    (void)n;
+}
+
+// 把到期的文件投入转换队列，返回距下一个到期时间的毫秒数，没有等待项时返回 -1
+static int watch_flush(void)
+{
+    Job *due = NULL;
+    long long now = now_ms(), next = -1;
+    pthread_mutex_lock(&watch.lock);
+    for (unsigned b = 0; b < WATCH_BUCKETS && watch.waiting > 0; ++b)
+    {
+        for (WatchItem **slot = &watch.items[b]; *slot;)
+        {
+            WatchItem *item = *slot;
+            if (item->running)
+            {
+                slot = &item->next;
+                continue;
+            }
+            if (item->due > now)
+            {
+                if (next < 0 || item->due < next)
+                    next = item->due;
+                slot = &item->next;
+                continue;
+            }
+            if (access(item->path, F_OK) != 0)
+            {
+                // 静默期内被删除或随目录移走，新位置会另有事件
+                *slot = item->next;
+                free(item);
+                watch.waiting--;
+                continue;
+            }
+            slot = &item->next;
+            size_t len = strlen(item->path);
+            Job *job = malloc(sizeof(Job) + len + 1);
+            if (!job)
+                continue;
+            memcpy(job->path, item->path, len + 1);
+            job->next = due;
+            due = job;
+            item->running = 1;
+            watch.waiting--;
+            watch.running++;
+        }
+    }
+    pthread_mutex_unlock(&watch.lock);
+
+    if (due)
+    {
+        cache_refresh();
+        native_sweep();
+    }
+    // 在锁外提交：没有工作线程时 queue_submit 会同步转换并回调 watch_done
+    while (due)
+    {
+        Job *job = due;
+        due = job->next;
+        queue_submit(job->path);
+        free(job);
+    }
+    return next < 0 ? -1 : (int)(next - now);
+}
+
+static void watch_add_dir(const char *path)
+{
+    int wd = inotify_add_watch(watch.fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd < 0)
+    {
+        fprintf(stderr, "Watch error: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (wd >= watch.dir_cap)
+    {
+        int cap = watch.dir_cap ? watch.dir_cap : 256;
+        while (wd >= cap)
+            cap *= 2;
+        char **grown = realloc(watch.dirs, (size_t)cap * sizeof(char *));
+        if (!grown)
+            return;
+        memset(grown + watch.dir_cap, 0, (size_t)(cap - watch.dir_cap) * sizeof(char *));
+        watch.dirs = grown;
+        watch.dir_cap = cap;
+    }
+    // 目录被移动后重新加入时 wd 不变，更新为新路径
+    free(watch.dirs[wd]);
+    watch.dirs[wd] = strdup(path);
+}
+
+// 新出现的子目录：加监视并扫描其中已有的文件，只遍历这一棵子树
+static void watch_scan(const char *dir_path)
+{
+    PathBuf path = {NULL, 0, 0};
+    if (path_push(&path, dir_path, strlen(dir_path)) != 0)
+        return;
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+        walk_dir(fd, &path, watch.root_len);
+    free(path.buf);
+    free(walk.visited);
+    walk.visited = NULL;
+    walk.visited_cap = walk.visited_count = 0;
+}
+
+static void watch_event(const struct inotify_event *ev)
+{
+    if (ev->mask & IN_IGNORED)
+    {
+        if (ev->wd >= 0 && ev->wd < watch.dir_cap)
+        {
+            free(watch.dirs[ev->wd]);
+            watch.dirs[ev->wd] = NULL;
+        }
+        return;
+    }
+    if (ev->len == 0 || ev->wd < 0 || ev->wd >= watch.dir_cap || !watch.dirs[ev->wd])
+        return;
+
+    const char *name = ev->name;
+    size_t name_len = strlen(name);
+    if (!(ev->mask & IN_ISDIR) && (name_len <= 3 || memcmp(name + name_len - 3, ".md", 3) != 0))
+        return;
+
+    const char *dir = watch.dirs[ev->wd];
+    size_t dir_len = strlen(dir);
+    char *path = malloc(dir_len + name_len + 2);
+    if (!path)
+        return;
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+
+    struct stat st;
+    if (walk.exclude_count > 0 && is_excluded(path + watch.root_len + 1, name))
+    {
+        // 被排除的路径不处理
+    }
+    else if (ev->mask & IN_ISDIR)
+    {
+        if (walk.recursive && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+            watch_scan(path);
+    }
+    else if (ev->mask & IN_CREATE)
+    {
+        // 普通文件等写完 (IN_CLOSE_WRITE) 再转换；新建的符号链接没有写入事件
+        if (walk.symlinks != SYMLINKS_SKIP && lstat(path, &st) == 0 && S_ISLNK(st.st_mode))
+            watch_touch(path, watch.debounce);
+    }
+    else if (ev->mask & IN_MOVED_TO)
+    {
+        if (lstat(path, &st) == 0 && !(S_ISLNK(st.st_mode) && walk.symlinks == SYMLINKS_SKIP))
+            watch_touch(path, watch.debounce);
+    }
+    else
+    {
+        watch_touch(path, watch.debounce);
+    }
+    free(path);
+}
+
+// 运行监视模式直到收到 SIGINT/SIGTERM，调用前需已 queue_start
+int watch_run(const char *dir_path)
+{
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.fd < 0 || pipe2(watch.wake, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        perror("Watch setup failed");
+        return -1;
+    }
+    watch.root_len = strlen(dir_path);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // 首轮遍历同时给每个目录加上监视，找到的文件立即到期
+    watch.active = 1;
+    process_directory(dir_path);
+    printf("Watching %s for changes, press Ctrl+C to stop\n", dir_path);
+    fflush(stdout);
+
+    _Alignas(struct inotify_event) char events[65536];
+    while (!watch.stop)
+    {
+        int timeout = watch_flush();
+
+        // 一批转换全部完成后落盘缓存清单
+        pthread_mutex_lock(&watch.lock);
+        int settled = watch.finished > 0 && watch.running == 0 && watch.waiting == 0;
+        if (settled)
+            watch.finished = 0;
+        pthread_mutex_unlock(&watch.lock);
+        if (settled)
+        {
+            cache_save();
+            fflush(stdout);
+        }
+
+        struct pollfd fds[2] = {{watch.fd, POLLIN, 0}, {watch.wake[0], POLLIN, 0}};
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            while (read(watch.wake[0], events, sizeof(events)) > 0)
+                ;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        ssize_t n;
+        while ((n = read(watch.fd, events, sizeof(events))) > 0)
+        {
+            for (ssize_t offset = 0; offset < n;)
+            {
+                const struct inotify_event *ev = (const struct inotify_event *)(events + offset);
+                offset += (ssize_t)sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    // 事件队列溢出，丢失了哪些变化无从得知：整体重扫，缓存会跳过未变的文件
+                    fprintf(stderr, "Watch event queue overflowed, rescanning %s\n", dir_path);
+                    watch_scan(dir_path);
+                    continue;
+                }
+                watch_event(ev);
+            }
+        }
+    }
+
+    printf("Stopping watch\n");
+    int failed = queue_finish();
+    watch.active = 0;
+    cache_save();
+
+    for (int i = 0; i < watch.dir_cap; ++i)
+        free(watch.dirs[i]);
+    free(watch.dirs);
+    for (unsigned b = 0; b < WATCH_BUCKETS; ++b)
+    {
+        while (watch.items[b])
+        {
+            WatchItem *next = watch.items[b]->next;
+            free(watch.items[b]);
+            watch.items[b] = next;
+        }
+    }
+    close(watch.fd);
+    close(watch.wake[0]);
+    close(watch.wake[1]);
+    return failed;
+}
+#endif
+
+// ---- 进程启动 ----
+// 直接以 argv 启动 pandoc，不经过 /bin/sh，也没有命令行长度上限；
+// stderr 通过管道收集，整块输出避免并发任务的错误信息互相穿插。
+
+#ifdef _WIN32
+static void append_quoted(char **buf, size_t *len, size_t *cap, const char *arg)
+{
+    size_t need = *len + strlen(arg) * 2 + 4;
+    if (need > *cap)
+    {
+        size_t grown_cap = *cap ? *cap : 256;
+        while (grown_cap < need)
+            grown_cap *= 2;
+        char *grown = realloc(*buf, grown_cap);
+        if (!grown)
+            return;
+        *buf = grown;
+        *cap = grown_cap;
+    }
+    char *p = *buf + *len;
+    if (*len > 0)
+        *p++ = ' ';
+    *p++ = '"';
+    for (const char *s = arg; *s; ++s)
+    {
+        if (*s == '"')
+            *p++ = '\\';
+        *p++ = *s;
+    }
+    *p++ = '"';
+    *p = '\0';
+    *len = (size_t)(p - *buf);
+}
+
+int spawn_wait(char *const argv[], int timeout_sec, SpawnResult *result)
+{
+    (void)timeout_sec; // Windows 下暂不支持超时
+    memset(result, 0, sizeof(*result));
+
+    char *command = NULL;
+    size_t len = 0, cap = 0;
+    for (int i = 0; argv[i]; ++i)
+        append_quoted(&command, &len, &cap, argv[i]);
+    if (!command)
+        return -1;
+
+    // cmd.exe 会剥掉整条命令最外层的一对引号
+    size_t total = strlen(command) + 3;
+    char *wrapped = malloc(total);
+    if (!wrapped)
+    {
+        free(command);
+        return -1;
+    }
+    snprintf(wrapped, total, "\"%s\"", command);
+    result->status = system(wrapped);
+    free(wrapped);
+    free(command);
+    return 0;
+}
+#else
+// 为已派生的子进程打开 pidfd，子进程退出时变为可读，可以和管道一起 poll；
+// 内核或头文件不支持时返回 -1，调用方退回定时轮询
+static int child_pidfd(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+int spawn_wait(char *const argv[], int timeout_sec, SpawnResult *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->status = -1;
+
+    int err_pipe[2];
+    if (pipe2(err_pipe, O_CLOEXEC) != 0)
+        return -1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+
+    pid_t pid;
+    long long spawn_start = now_us();
+    int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    result->spawn_us = now_us() - spawn_start;
+    posix_spawn_file_actions_destroy(&actions);
+    close(err_pipe[1]);
+    if (err != 0)
+    {
+        close(err_pipe[0]);
+        errno = err;
+        return -1;
+    }
+
+    long long deadline = timeout_sec > 0 ? now_ms() + timeout_sec * 1000LL : 0;
+    int pidfd = deadline ? child_pidfd(pid) : -1;
+    char *captured = malloc(SPAWN_STDERR_MAX + 1);
+    size_t used = 0;
+    int status = 0, exited = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+
+    for (;;)
+    {
+        int wait_ms = -1;
+        if (deadline)
+        {
+            long long left = deadline - now_ms();
+            if (left <= 0)
+            {
+                kill(pid, SIGKILL);
+                result->timed_out = 1;
+                break;
+            }
+            wait_ms = (int)left;
+        }
+
+        if (err_pipe[0] >= 0)
+        {
+            struct pollfd pfd = {err_pipe[0], POLLIN, 0};
+            int ready = poll(&pfd, 1, wait_ms);
+            if (ready < 0 && errno != EINTR)
+                break;
+            if (ready <= 0)
+                continue;
+
+            char chunk[4096];
+            ssize_t n = read(err_pipe[0], chunk, sizeof(chunk));
+            if (n > 0)
+            {
+                // 超出上限的部分直接丢弃，但继续读以免子进程阻塞在写管道上
+                size_t keep = captured && used < SPAWN_STDERR_MAX ? (size_t)n : 0;
+                if (keep > SPAWN_STDERR_MAX - used)
+                    keep = SPAWN_STDERR_MAX - used;
+                if (keep)
+                    memcpy(captured + used, chunk, keep);
+                used += keep;
+            }
+            else if (n == 0 || errno != EINTR)
+            {
+                close(err_pipe[0]);
+                err_pipe[0] = -1;
+            }
+            continue;
+        }
+
+        // stderr 已关闭，剩下的只是等子进程退出
+        if (!deadline)
+            break;
+        if (pidfd >= 0)
+        {
+            // 子进程退出或到达期限时才醒来，随后由下面的阻塞 wait4 回收
+            struct pollfd pfd = {pidfd, POLLIN, 0};
+            int ready = poll(&pfd, 1, wait_ms);
+            if (ready > 0 || (ready < 0 && errno != EINTR))
+                break;
+            continue;
+        }
+        pid_t done = wait4(pid, &status, WNOHANG, &usage);
+        if (done == pid)
+        {
+            exited = 1;
+            break;
+        }
+        if (done < 0 && errno != EINTR)
+            break;
+        struct timespec pause = {0, 10 * 1000000L};
+        nanosleep(&pause, NULL);
+    }
+
+    if (err_pipe[0] >= 0)
+        close(err_pipe[0]);
+    if (pidfd >= 0)
+        close(pidfd);
+    while (!exited && wait4(pid, &status, 0, &usage) < 0 && errno == EINTR)
+        ;
+    result->cpu_us = (long long)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec +
+                     (long long)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+#ifdef __APPLE__
+    result->max_rss_kb = usage.ru_maxrss / 1024; // macOS 以字节为单位
+#else
+    result->max_rss_kb = usage.ru_maxrss;
+#endif
+
+    if (captured)
+    {
+        captured[used] = '\0';
+        result->errors = captured;
+        result->errors_len = used;
+    }
+    if (result->timed_out)
+        result->status = -1;
+    else if (WIFEXITED(status))
+        result->status = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+        result->signal = WTERMSIG(status);
+    return 0;
+}
+#endif
+
+long long now_ms(void)
+{
+#ifdef _WIN32
+    return (long long)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+#endif
+}
+
+long long now_us(void)
+{
+#ifdef _WIN32
+    return (long long)GetTickCount64() * 1000LL;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+// 当前线程消耗的 CPU 时间，用于统计内置引擎；不支持按线程统计的平台返回 0
+static long long thread_cpu_us(void)
+{
+#if defined(_WIN32) || !defined(CLOCK_THREAD_CPUTIME_ID)
+    return 0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+// ---- 运行报告 ----
+// --report=json 时收集每个文件的排队、启动、运行和资源占用数据，
+// 结束后连同汇总和分位数一起写入 JSON，供看板分析慢文档。
+
+static void report_add(const char *path, int ret, const JobStats *stats)
+{
+    MUTEX_LOCK(&queue.lock);
+    if (report.count == report.cap)
+    {
+        size_t cap = report.cap ? report.cap * 2 : 256;
+        JobRecord *grown = realloc(report.records, cap * sizeof(JobRecord));
+        if (!grown)
+        {
+            MUTEX_UNLOCK(&queue.lock);
+            return;
+        }
+        report.records = grown;
+        report.cap = cap;
+    }
+    JobRecord *r = &report.records[report.count];
+    r->path = strdup(path);
+    if (r->path)
+    {
+        r->stats = *stats;
+        if (!r->stats.engine)
+            r->stats.engine = "none"; // 选定引擎之前就失败了
+        r->ok = ret == 0;
+        report.count++;
+    }
+    MUTEX_UNLOCK(&queue.lock);
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; ++s)
+    {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+// 对实际转换过的文件（不含缓存跳过的）按最近秩计算 p50/p95/p99
+static void json_percentiles(FILE *fp, const char *name, size_t field, double scale, long long *values)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < report.count; ++i)
+        if (strcmp(report.records[i].stats.engine, "cached") != 0)
+            values[n++] = *(const long long *)((const char *)&report.records[i].stats + field);
+    qsort(values, n, sizeof(long long), compare_ll);
+
+    static const int ranks[] = {50, 95, 99};
+    fprintf(fp, "    \"%s\": {", name);
+    for (int k = 0; k < 3; ++k)
+    {
+        double v = 0;
+        if (n > 0)
+        {
+            size_t idx = (size_t)((ranks[k] * n + 99) / 100);
+            v = values[idx > 0 ? idx - 1 : 0] / scale;
+        }
+        fprintf(fp, "%s\"p%d\": %.3f", k ? ", " : "", ranks[k], v);
+    }
+    fprintf(fp, "}");
+}
+
+int report_write(int jobs)
+{
+    FILE *fp = fopen(report.out, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot write report %s: %s\n", report.out, strerror(errno));
+        return -1;
+    }
+
+    long long input_bytes = 0, output_bytes = 0, wall_us = 0, cpu_us = 0;
+    int succeeded = 0, failed = 0, cached = 0;
+    for (size_t i = 0; i < report.count; ++i)
+    {
+        const JobRecord *r = &report.records[i];
+        input_bytes += r->stats.input_bytes;
+        output_bytes += r->stats.output_bytes;
+        wall_us += r->stats.wall_us;
+        cpu_us += r->stats.cpu_us;
+        if (!r->ok)
+            failed++;
+        else if (strcmp(r->stats.engine, "cached") == 0)
+            cached++;
+        else
+            succeeded++;
+    }
+
+    fprintf(fp, "{\n  \"elapsed_ms\": %.3f,\n  \"jobs\": %d,\n", (now_us() - report.started) / 1000.0, jobs);
+    fprintf(fp, "  \"totals\": {\"files\": %zu, \"succeeded\": %d, \"failed\": %d, \"cached\": %d, "
+                "\"input_bytes\": %lld, \"output_bytes\": %lld, \"wall_ms\": %.3f, \"cpu_ms\": %.3f},\n",
+            report.count, succeeded, failed, cached, input_bytes, output_bytes, wall_us / 1000.0, cpu_us / 1000.0);
+
+    fprintf(fp, "  \"percentiles\": {\n");
+    long long *values = malloc((report.count + 1) * sizeof(long long));
+    if (values)
+    {
+        json_percentiles(fp, "queue_ms", offsetof(JobStats, queue_us), 1000.0, values);
+        fprintf(fp, ",\n");
+        json_percentiles(fp, "spawn_ms", offsetof(JobStats, spawn_us), 1000.0, values);
+        fprintf(fp, ",\n");
+        json_percentiles(fp, "wall_ms", offsetof(JobStats, wall_us), 1000.0, values);
+        fprintf(fp, ",\n");
+        json_percentiles(fp, "cpu_ms", offsetof(JobStats, cpu_us), 1000.0, values);
+        fprintf(fp, ",\n");
+        json_percentiles(fp, "max_rss_kb", offsetof(JobStats, max_rss_kb), 1.0, values);
+        fprintf(fp, "\n");
+        free(values);
+    }
+    fprintf(fp, "  },\n  \"files\": [");
+
+    for (size_t i = 0; i < report.count; ++i)
+    {
+        const JobRecord *r = &report.records[i];
+        fprintf(fp, "%s\n    {\"path\": ", i ? "," : "");
+        json_string(fp, r->path);
+        fprintf(fp, ", \"status\": \"%s\", \"engine\": \"%s\", \"queue_ms\": %.3f, \"spawn_ms\": %.3f, "
+                    "\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"max_rss_kb\": %lld, \"input_bytes\": %lld, \"output_bytes\": %lld}",
+                r->ok ? "ok" : "failed", r->stats.engine, r->stats.queue_us / 1000.0, r->stats.spawn_us / 1000.0,
+                r->stats.wall_us / 1000.0, r->stats.cpu_us / 1000.0, r->stats.max_rss_kb,
+                r->stats.input_bytes, r->stats.output_bytes);
+        free(r->path);
+    }
+    fprintf(fp, "%s]\n}\n", report.count ? "\n  " : "");
+    free(report.records);
+    report.records = NULL;
+    report.count = report.cap = 0;
+
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "Cannot write report %s: %s\n", report.out, strerror(errno));
+        return -1;
+    }
+    printf("Report written to %s\n", report.out);
+    return 0;
+}
+
+// ---- 增量缓存 ----
+// 每个输出目录下保存一个清单文件，记录输入内容哈希、pandoc 选项哈希以及引用资源
+// （图片、--reference-doc 等）的哈希；三者均未变化且输出存在时跳过转换。
+// 输入和资源先比较大小与修改时间，只有元数据变化时才重新计算内容哈希。
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static long long stat_mtime(const struct stat *st)
+{
+#ifdef _WIN32
+    return (long long)st->st_mtime * 1000000000LL;
+#else
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+static unsigned bucket_of(const char *key, unsigned buckets)
+{
+    return (unsigned)(hash_bytes(FNV_OFFSET, key, strlen(key)) % buckets);
+}
+
+// 读取整个文件到内存，调用者负责 free
+static char *read_whole_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+
+    size_t cap = 65536, used = 0;
+    char *buf = malloc(cap + 1);
+    while (buf)
+    {
+        size_t n = fread(buf + used, 1, cap - used, fp);
+        used += n;
+        if (used < cap)
+            break;
+        char *grown = realloc(buf, cap * 2 + 1);
+        if (!grown)
+        {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        buf = grown;
+        cap *= 2;
+    }
+    fclose(fp);
+    if (buf)
+    {
+        buf[used] = '\0';
+        *len = used;
+    }
+    return buf;
+}
+
+static int hash_file(const char *path, uint64_t *out)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+
+    char buf[65536];
+    size_t n;
+    uint64_t h = FNV_OFFSET;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        h = hash_bytes(h, buf, n);
+    fclose(fp);
+    *out = h;
+    return 0;
+}
+
+// 返回 path 所在目录的副本，调用者负责 free；内存不足时返回 NULL
+static char *split_dir(const char *path)
+{
+    size_t len = strlen(path);
+    char *dir = malloc(len + 2);
+    if (!dir)
+        return NULL;
+    memcpy(dir, path, len + 1);
+    char *last_slash = strrchr(dir, '/');
+#ifdef _WIN32
+    if (!last_slash)
+        last_slash = strrchr(dir, '\\');
+#endif
+    if (last_slash)
+        *last_slash = '\0';
+    else
+        strcpy(dir, ".");
+    return dir;
+}
+
+// 拼接 "目录/名称"，dir 为 NULL 时只复制名称；调用者负责 free
+static char *join_path(const char *dir, const char *name, size_t name_len)
+{
+    size_t dir_len = dir ? strlen(dir) + 1 : 0;
+    char *path = malloc(dir_len + name_len + 1);
+    if (!path)
+        return NULL;
+    if (dir)
+    {
+        memcpy(path, dir, dir_len - 1);
+        path[dir_len - 1] = PATH_SEP;
+    }
+    memcpy(path + dir_len, name, name_len);
+    path[dir_len + name_len] = '\0';
+    return path;
+}
+
+// 读取一整行（去掉换行符），行长不限，缓冲区按需扩大；到达文件末尾时返回 NULL
+static char *read_line(FILE *fp, char **buf, size_t *cap)
+{
+    size_t used = 0;
+    for (;;)
+    {
+        if (*cap - used < 2)
+        {
+            size_t grown_cap = *cap ? *cap * 2 : 4096;
+            char *grown = realloc(*buf, grown_cap);
+            if (!grown)
+                return NULL;
+            *buf = grown;
+            *cap = grown_cap;
+        }
+        if (!fgets(*buf + used, (int)(*cap - used), fp))
+            return used ? *buf : NULL;
+        used += strlen(*buf + used);
+        if (used > 0 && (*buf)[used - 1] == '\n')
+        {
+            (*buf)[used - 1] = '\0';
+            return *buf;
+        }
+    }
+}
+
+static Resource *resource_intern(const char *path)
+{
+    unsigned b = bucket_of(path, CACHE_BUCKETS);
+    for (Resource *r = cache.resources[b]; r; r = r->next)
+        if (strcmp(r->path, path) == 0)
+            return r;
+
+    Resource *r = calloc(1, sizeof(Resource) + strlen(path) + 1);
+    if (!r)
+        return NULL;
+#ifndef _WIN32
+    pthread_mutex_init(&r->lock, NULL);
+#endif
+    strcpy(r->path, path);
+    r->next = cache.resources[b];
+    cache.resources[b] = r;
+    return r;
+}
+
+// 本次运行内每个资源只校验一次，被多个文档引用的图片不会重复读取。
+// 调用者持有 r->lock 而不是 cache.lock，不同图片的读取可以并行；
+// 命中与重新哈希的次数累加到调用者的计数中
+static uint64_t resource_check(Resource *r, int *hits, int *misses)
+{
+    if (r->checked)
+    {
+        (*hits)++;
+        return r->hash;
+    }
+    r->checked = 1;
+
+    struct stat st;
+    if (stat(r->path, &st) != 0)
+    {
+        r->size = -1;
+        r->mtime = 0;
+        r->hash = 0;
+        return 0;
+    }
+    if (r->hash != 0 && r->size == (long long)st.st_size && r->mtime == stat_mtime(&st))
+    {
+        (*hits)++;
+        return r->hash;
+    }
+
+    (*misses)++;
+    r->size = (long long)st.st_size;
+    r->mtime = stat_mtime(&st);
+    if (hash_file(r->path, &r->hash) != 0)
+        r->hash = 0;
+    return r->hash;
+}
+
+static CacheEntry *entry_find(const char *input_path)
+{
+    for (CacheEntry *e = cache.entries[bucket_of(input_path, CACHE_ENTRY_BUCKETS)]; e; e = e->next)
+        if (strcmp(e->path, input_path) == 0)
+            return e;
+    return NULL;
+}
+
+static CacheEntry *entry_create(Manifest *m, const char *input_path)
+{
+    CacheEntry *e = calloc(1, sizeof(CacheEntry) + strlen(input_path) + 1);
+    if (!e)
+        return NULL;
+    strcpy(e->path, input_path);
+    e->manifest = m;
+    unsigned b = bucket_of(input_path, CACHE_ENTRY_BUCKETS);
+    e->next = cache.entries[b];
+    cache.entries[b] = e;
+    e->next_in_manifest = m->entries;
+    m->entries = e;
+    return e;
+}
+
+static int entry_add_resource(CacheEntry *e, Resource *r)
+{
+    Resource **grown = realloc(e->resource_list, (size_t)(e->resource_count + 1) * sizeof(Resource *));
+    if (!grown)
+        return -1;
+    e->resource_list = grown;
+    e->resource_list[e->resource_count++] = r;
+    return 0;
+}
+
+static void manifest_load(Manifest *m)
+{
+    char *path = join_path(m->dir, CACHE_FILE_NAME, strlen(CACHE_FILE_NAME));
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    free(path);
+    if (!fp)
+        return;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    if (!read_line(fp, &line, &line_cap) || strcmp(line, CACHE_MAGIC) != 0)
+    {
+        // 版本不符的清单直接丢弃，下次保存时覆盖
+        free(line);
+        fclose(fp);
+        return;
+    }
+
+    CacheEntry *current = NULL;
+    while (read_line(fp, &line, &line_cap))
+    {
+        long long size, mtime;
+        unsigned long long h1, h2, h3;
+        int offset = 0;
+
+        if (line[0] == 'R' && sscanf(line, "R %lld %lld %llx %n", &size, &mtime, &h1, &offset) == 3 && offset > 0)
+        {
+            Resource *r = resource_intern(line + offset);
+            if (r)
+            {
+                MUTEX_LOCK(&r->lock);
+                if (!r->checked)
+                {
+                    r->size = size;
+                    r->mtime = mtime;
+                    r->hash = h1;
+                }
+                MUTEX_UNLOCK(&r->lock);
+            }
+        }
+        else if (line[0] == 'D' && sscanf(line, "D %lld %lld %llx %llx %llx %n", &size, &mtime, &h1, &h2, &h3, &offset) == 5 && offset > 0)
+        {
+            char *input_path = join_path(m->dir, line + offset, strlen(line + offset));
+            current = input_path ? entry_find(input_path) : NULL;
+            if (!current && input_path)
+                current = entry_create(m, input_path);
+            free(input_path);
+            if (current)
+            {
+                current->size = size;
+                current->mtime = mtime;
+                current->content = h1;
+                current->options = h2;
+                current->resources = h3;
+                current->resource_count = 0;
+            }
+        }
+        else if (line[0] == 'r' && line[1] == ' ' && current)
+        {
+            Resource *r = resource_intern(line + 2);
+            if (r)
+                entry_add_resource(current, r);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+static Manifest *manifest_for(const char *dir)
+{
+    unsigned b = bucket_of(dir, CACHE_BUCKETS);
+    for (Manifest *m = cache.manifests[b]; m; m = m->next)
+        if (strcmp(m->dir, dir) == 0)
+            return m;
+
+    Manifest *m = calloc(1, sizeof(Manifest) + strlen(dir) + 1);
+    if (!m)
+        return NULL;
+    strcpy(m->dir, dir);
+    m->next = cache.manifests[b];
+    cache.manifests[b] = m;
+    manifest_load(m);
+    return m;
+}
+
+static int fingerprint_add(Fingerprint *fp, const char *path)
+{
+    char **grown = realloc(fp->resource_paths, (size_t)(fp->resource_count + 1) * sizeof(char *));
+    if (!grown)
+        return -1;
+    fp->resource_paths = grown;
+    fp->resource_paths[fp->resource_count] = strdup(path);
+    if (!fp->resource_paths[fp->resource_count])
+        return -1;
+    fp->resource_count++;
+    return 0;
+}
+
+void fingerprint_free(Fingerprint *fp)
+{
+    for (int i = 0; i < fp->resource_count; ++i)
+        free(fp->resource_paths[i]);
+    free(fp->resource_paths);
+    fp->resource_paths = NULL;
+    fp->resource_count = 0;
+}
+
+static void add_local_target(Fingerprint *fp, const char *dir, const char *target, size_t len)
+{
+    if (len == 0 || len >= MAX_PATH_LEN / 2 || target[0] == '#')
+        return;
+    if (memchr(target, ':', len) && (strncmp(target, "data:", 5) == 0 ||
+                                     (len > 3 && strstr(target, "://") && strstr(target, "://") < target + len)))
+        return;
+
+#ifdef _WIN32
+    int absolute = target[0] == '/' || target[0] == '\\' || (len > 1 && target[1] == ':');
+#else
+    int absolute = target[0] == '/';
+#endif
+    char *path = join_path(absolute ? NULL : dir, target, len);
+    if (path)
+        fingerprint_add(fp, path);
+    free(path);
+}
+
+// 提取 Markdown 中 ![alt](path) 与 <img src="path"> 引用的本地文件
+static void collect_images(Fingerprint *fp, const char *text, size_t len, const char *dir)
+{
+    const char *end = text + len;
+    for (const char *p = text; p < end; ++p)
+    {
+        if (p[0] == '!' && p + 1 < end && p[1] == '[')
+        {
+            const char *close = p + 2;
+            while (close < end && *close != ']' && *close != '\n')
+                close++;
+            if (close + 1 >= end || close[0] != ']' || close[1] != '(')
+                continue;
+            const char *target = close + 2;
+            while (target < end && *target == ' ')
+                target++;
+            const char *stop;
+            if (target < end && *target == '<')
+            {
+                target++;
+                stop = target;
+                while (stop < end && *stop != '>' && *stop != '\n')
+                    stop++;
+            }
+            else
+            {
+                stop = target;
+                while (stop < end && *stop != ')' && *stop != ' ' && *stop != '\n')
+                    stop++;
+            }
+            add_local_target(fp, dir, target, (size_t)(stop - target));
+            p = stop - 1;
+        }
+        else if (p[0] == '<' && end - p > 4 && strncmp(p, "<img", 4) == 0)
+        {
+            const char *tag_end = p;
+            while (tag_end < end && *tag_end != '>')
+                tag_end++;
+            for (const char *a = p; a + 5 < tag_end; ++a)
+            {
+                if (strncmp(a, "src=", 4) == 0 && (a[4] == '"' || a[4] == '\''))
+                {
+                    const char *target = a + 5;
+                    const char *stop = memchr(target, a[4], (size_t)(tag_end - target));
+                    if (stop)
+                        add_local_target(fp, dir, target, (size_t)(stop - target));
+                    break;
+                }
+            }
+            p = tag_end - 1;
+        }
+    }
+}
+
+// 计算输入的内容哈希并收集引用的图片。POSIX 下映射文件分段扫描，每段在空行处
+// 结束（图片语法不会跨越段落），扫描过的页随即归还，大文件不会整块读入内存
+static int scan_input(Fingerprint *fp, const char *path, const char *dir)
+{
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    char *map = MAP_FAILED;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size = (size_t)st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map != MAP_FAILED)
+    {
+        madvise(map, size, MADV_SEQUENTIAL);
+        long page = sysconf(_SC_PAGESIZE);
+        uint64_t h = FNV_OFFSET;
+        size_t start = 0, released = 0;
+        while (start < size)
+        {
+            size_t end = start + MMAP_RELEASE_SIZE < size ? start + MMAP_RELEASE_SIZE : size;
+            while (end < size)
+            {
+                const char *nl = memchr(map + end, '\n', size - end);
+                if (!nl)
+                {
+                    end = size;
+                    break;
+                }
+                end = (size_t)(nl - map) + 1;
+                size_t k = end;
+                while (k < size && (map[k] == ' ' || map[k] == '\t' || map[k] == '\r'))
+                    k++;
+                if (k < size && map[k] == '\n')
+                {
+                    end = k + 1;
+                    break;
+                }
+            }
+            h = hash_bytes(h, map + start, end - start);
+            collect_images(fp, map + start, end - start, dir);
+            size_t upto = end / (size_t)page * (size_t)page;
+            if (upto > released)
+            {
+                madvise(map + released, upto - released, MADV_DONTNEED);
+                released = upto;
+            }
+            start = end;
+        }
+        munmap(map, size);
+        fp->content = h;
+        return 0;
+    }
+#endif
+    size_t len = 0;
+    char *text = read_whole_file(path, &len);
+    if (!text)
+        return -1;
+    fp->content = hash_bytes(FNV_OFFSET, text, len);
+    collect_images(fp, text, len, dir);
+    free(text);
+    return 0;
+}
+
+// pandoc 选项中引用的数据文件同样影响输出
+static void collect_option_files(Fingerprint *fp, const char *options)
+{
+    static const char *file_options[] = {
+        "--reference-doc", "--template", "--lua-filter", "--bibliography",
+        "--csl", "--metadata-file", "--include-in-header", NULL};
+
+    const char *p = options;
+    while (*p)
+    {
+        while (*p == ' ')
+            p++;
+        const char *token = p;
+        while (*p && *p != ' ')
+            p++;
+        size_t token_len = (size_t)(p - token);
+
+        for (int i = 0; file_options[i]; ++i)
+        {
+            size_t name_len = strlen(file_options[i]);
+            if (token_len < name_len || strncmp(token, file_options[i], name_len) != 0)
+                continue;
+
+            const char *value = NULL;
+            size_t value_len = 0;
+            if (token_len > name_len && token[name_len] == '=')
+            {
+                value = token + name_len + 1;
+                value_len = token_len - name_len - 1;
+            }
+            else if (token_len == name_len)
+            {
+                while (*p == ' ')
+                    p++;
+                value = p;
+                while (*p && *p != ' ')
+                    p++;
+                value_len = (size_t)(p - value);
+            }
+
+            if (value && value_len > 0 && value_len < MAX_PATH_LEN)
+            {
+                char rel[MAX_PATH_LEN];
+                snprintf(rel, MAX_PATH_LEN, "%.*s", (int)value_len, value);
+                char *abs = realpath(rel, NULL);
+                fingerprint_add(fp, abs ? abs : rel);
+                free(abs);
+            }
+            break;
+        }
+    }
+}
+
+// 计算输入的指纹并与清单比较；返回 1 表示输出已是最新，可以跳过
+int cache_check(const char *input_path, const char *output_path, const char *options, Fingerprint *fp)
+{
+    memset(fp, 0, sizeof(*fp));
+    fp->options = hash_bytes(FNV_OFFSET, options, strlen(options));
+
+    struct stat st;
+    if (stat(input_path, &st) != 0)
+        return 0;
+    fp->size = (long long)st.st_size;
+    fp->mtime = stat_mtime(&st);
+
+    char *dir = split_dir(input_path);
+    if (!dir)
+        return 0;
+
+    int have_entry = 0, reuse = 0;
+    uint64_t old_content = 0, old_options = 0, old_resources = 0;
+
+    MUTEX_LOCK(&cache.lock);
+    Manifest *m = manifest_for(dir);
+    CacheEntry *e = m ? entry_find(input_path) : NULL;
+    if (e)
+    {
+        have_entry = 1;
+        old_content = e->content;
+        old_options = e->options;
+        old_resources = e->resources;
+        if (e->size == fp->size && e->mtime == fp->mtime && e->options == fp->options)
+        {
+            // 元数据和选项均未变化：沿用清单中的内容哈希和资源列表，不读取输入
+            reuse = 1;
+            fp->content = e->content;
+            for (int i = 0; i < e->resource_count; ++i)
+                fingerprint_add(fp, e->resource_list[i]->path);
+        }
+    }
+    MUTEX_UNLOCK(&cache.lock);
+
+    int scanned = reuse || scan_input(fp, input_path, dir) == 0;
+    free(dir);
+    if (!scanned)
+        return 0;
+    if (!reuse)
+        collect_option_files(fp, options);
+
+    // 在全局锁内只登记资源，读取和哈希图片放到锁外，各资源由自己的锁保证只校验一次
+    Resource **resources = NULL;
+    if (fp->resource_count > 0)
+        resources = calloc((size_t)fp->resource_count, sizeof(Resource *));
+    MUTEX_LOCK(&cache.lock);
+    for (int i = 0; resources && i < fp->resource_count; ++i)
+        resources[i] = resource_intern(fp->resource_paths[i]);
+    MUTEX_UNLOCK(&cache.lock);
+
+    uint64_t digest = FNV_OFFSET;
+    int hits = 0, misses = 0;
+    for (int i = 0; i < fp->resource_count; ++i)
+    {
+        Resource *r = resources ? resources[i] : NULL;
+        uint64_t h = 0;
+        if (r)
+        {
+            MUTEX_LOCK(&r->lock);
+            h = resource_check(r, &hits, &misses);
+            MUTEX_UNLOCK(&r->lock);
+        }
+        digest = hash_bytes(digest, fp->resource_paths[i], strlen(fp->resource_paths[i]) + 1);
+        digest = hash_bytes(digest, &h, sizeof(h));
+    }
+    fp->resources = digest;
+    free(resources);
+
+    MUTEX_LOCK(&cache.lock);
+    cache.hits += hits;
+    cache.misses += misses;
+    MUTEX_UNLOCK(&cache.lock);
+
+    if (cache.force || !have_entry)
+        return 0;
+    if (old_content != fp->content || old_options != fp->options || old_resources != fp->resources)
+        return 0;
+    if (stat(output_path, &st) != 0)
+        return 0;
+
+    if (!reuse)
+    {
+        // 仅修改时间变化（如 touch）：更新清单中的元数据，下次无需再读内容
+        cache_record(input_path, fp);
+    }
+    return 1;
+}
+
+// 转换成功后把转换前计算的指纹写入内存清单，程序结束时统一落盘
+void cache_record(const char *input_path, const Fingerprint *fp)
+{
+    char *dir = split_dir(input_path);
+    if (!dir)
+        return;
+
+    MUTEX_LOCK(&cache.lock);
+    Manifest *m = manifest_for(dir);
+    free(dir);
+    CacheEntry *e = m ? entry_find(input_path) : NULL;
+    if (m && !e)
+        e = entry_create(m, input_path);
+    if (e)
+    {
+        e->size = fp->size;
+        e->mtime = fp->mtime;
+        e->content = fp->content;
+        e->options = fp->options;
+        e->resources = fp->resources;
+        e->resource_count = 0;
+        for (int i = 0; i < fp->resource_count; ++i)
+        {
+            Resource *r = resource_intern(fp->resource_paths[i]);
+            if (r)
+                entry_add_resource(e, r);
+        }
+        m->dirty = 1;
+    }
+    MUTEX_UNLOCK(&cache.lock);
+}
+
+static void manifest_save(Manifest *m, unsigned stamp)
+{
+    char *path = join_path(m->dir, CACHE_FILE_NAME, strlen(CACHE_FILE_NAME));
+    char *tmp_path = join_path(m->dir, CACHE_FILE_NAME ".tmp", strlen(CACHE_FILE_NAME ".tmp"));
+    FILE *fp = path && tmp_path ? fopen(tmp_path, "w") : NULL;
+    if (!fp)
+    {
+        perror("Cache manifest write error");
+        free(path);
+        free(tmp_path);
+        return;
+    }
+    fprintf(fp, "%s\n", CACHE_MAGIC);
+
+    // 先写资源表，同一资源只写一次
+    for (CacheEntry *e = m->entries; e; e = e->next_in_manifest)
+    {
+        for (int i = 0; i < e->resource_count; ++i)
+        {
+            Resource *r = e->resource_list[i];
+            if (r->stamp == stamp)
+                continue;
+            r->stamp = stamp;
+            fprintf(fp, "R %lld %lld %016llx %s\n", r->size, r->mtime,
+                    (unsigned long long)r->hash, r->path);
+        }
+    }
+
+    struct stat st;
+    for (CacheEntry *e = m->entries; e; e = e->next_in_manifest)
+    {
+        // 输入已被删除的条目不再保留
+        if (stat(e->path, &st) != 0)
+            continue;
+        const char *name = e->path + strlen(m->dir) + 1;
+        fprintf(fp, "D %lld %lld %016llx %016llx %016llx %s\n", e->size, e->mtime,
+                (unsigned long long)e->content, (unsigned long long)e->options,
+                (unsigned long long)e->resources, name);
+        for (int i = 0; i < e->resource_count; ++i)
+            fprintf(fp, "r %s\n", e->resource_list[i]->path);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+    {
+        perror("Cache manifest write error");
+        remove(tmp_path);
+    }
+    free(path);
+    free(tmp_path);
+}
+
+void cache_save(void)
+{
+    unsigned stamp = 0;
+    for (unsigned b = 0; b < CACHE_BUCKETS; ++b)
+    {
+        for (Manifest *m = cache.manifests[b]; m; m = m->next)
+        {
+            if (!m->dirty)
+                continue;
+#ifdef _WIN32
+            // Windows 上 rename 不能覆盖已存在的文件
+            char *path = join_path(m->dir, CACHE_FILE_NAME, strlen(CACHE_FILE_NAME));
+            if (path)
+                remove(path);
+            free(path);
+#endif
+            manifest_save(m, ++stamp);
+            m->dirty = 0;
+        }
+    }
+}
+
+void cache_report(void)
+{
+    if (cache.hits + cache.misses > 0)
+        printf("Resource cache: %d hits, %d misses\n", cache.hits, cache.misses);
+}
+
+// 让引用的资源在下一次检查时重新 stat，供长时间运行的监视模式使用
+void cache_refresh(void)
+{
+    MUTEX_LOCK(&cache.lock);
+    for (unsigned b = 0; b < CACHE_BUCKETS; ++b)
+        for (Resource *r = cache.resources[b]; r; r = r->next)
+        {
+            MUTEX_LOCK(&r->lock);
+            r->checked = 0;
+            MUTEX_UNLOCK(&r->lock);
+        }
+    MUTEX_UNLOCK(&cache.lock);
+}
+
+// ---- 内置转换引擎 ----
+// --engine=native 时在进程内完成 Markdown -> DOCX：逐行解析 Markdown，直接生成
+// WordprocessingML 并写出 ZIP 容器，不启动任何子进程。支持标题、段落、强调、
+// 列表、代码块、表格和图片；遇到数学公式、HTML、脚注等不支持的语法时返回
+// NATIVE_FALLBACK，由调用者改用 pandoc。样式名与 pandoc 默认模板保持一致。
+// 输入经 mmap 逐行读取，document.xml 边生成边压缩写入 ZIP，行内节点来自线程
+// 内存池，转换大文件时内存占用保持平稳。
+
+static uint32_t crc_table[256];
+static uint16_t fixed_code[288]; // 定长 Huffman 码，已按位反转以便低位先出
+static unsigned char fixed_bits[288];
+static unsigned char length_symbol[DEFLATE_MAX_MATCH + 1];
+static unsigned char distance_symbol[DEFLATE_WINDOW + 1];
+
+static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                               3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                           193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                           6145, 8193, 12289, 16385, 24577};
+static const unsigned char distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                                 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static THREAD_LOCAL struct
+{
+    ArenaChunk *head;
+    ArenaChunk *cur;
+} arena;
+
+static unsigned reverse_bits(unsigned code, int bits)
+{
+    unsigned r = 0;
+    for (int i = 0; i < bits; ++i)
+        r = (r << 1) | ((code >> i) & 1);
+    return r;
+}
+
+void native_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+
+    // RFC 1951 3.2.6 的定长码表
+    for (unsigned v = 0; v < 288; ++v)
+    {
+        unsigned code, bits;
+        if (v < 144)
+            code = 0x30 + v, bits = 8;
+        else if (v < 256)
+            code = 0x190 + (v - 144), bits = 9;
+        else if (v < 280)
+            code = v - 256, bits = 7;
+        else
+            code = 0xC0 + (v - 280), bits = 8;
+        fixed_code[v] = (uint16_t)reverse_bits(code, (int)bits);
+        fixed_bits[v] = (unsigned char)bits;
+    }
+    for (int s = 0; s < 29; ++s)
+        for (unsigned len = length_base[s]; len < length_base[s] + (1u << length_extra[s]) && len <= DEFLATE_MAX_MATCH; ++len)
+            length_symbol[len] = (unsigned char)s;
+    for (int s = 0; s < 30; ++s)
+        for (unsigned d = distance_base[s]; d < distance_base[s] + (1u << distance_extra[s]) && d <= DEFLATE_WINDOW; ++d)
+            distance_symbol[d] = (unsigned char)s;
+}
+
+// ---- 线程内存池 ----
+
+static void *arena_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    ArenaChunk *c = arena.cur;
+    while (c && c->used + size > c->cap)
+    {
+        // 回退或重置后，后面的分块从头复用
+        c = c->next;
+        if (c)
+            c->used = 0;
+    }
+    if (!c)
+    {
+        size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        c = malloc(sizeof(ArenaChunk) + cap + 15);
+        if (!c)
+            return NULL;
+        c->next = NULL;
+        c->cap = cap;
+        c->used = 0;
+        if (arena.cur)
+        {
+            // 插在当前分块之后，保留后面尚未复用的分块
+            c->next = arena.cur->next;
+            arena.cur->next = c;
+        }
+        else
+        {
+            c->next = arena.head;
+            arena.head = c;
+        }
+    }
+    arena.cur = c;
+    unsigned char *base = (unsigned char *)(((uintptr_t)c->data + 15) & ~(uintptr_t)15);
+    void *p = base + c->used;
+    c->used += size;
+    return p;
+}
+
+static ArenaMark arena_mark(void)
+{
+    ArenaMark m = {arena.cur, arena.cur ? arena.cur->used : 0};
+    return m;
+}
+
+static void arena_release(ArenaMark m)
+{
+    arena.cur = m.chunk ? m.chunk : arena.head;
+    if (m.chunk)
+        m.chunk->used = m.used;
+    else if (arena.head)
+        arena.head->used = 0;
+}
+
+static void arena_reset(void)
+{
+    ArenaMark none = {NULL, 0};
+    arena_release(none);
+}
+
+// 释放当前线程的内存池，工作线程退出和程序结束时调用
+void native_release(void)
+{
+    while (arena.head)
+    {
+        ArenaChunk *next = arena.head->next;
+        free(arena.head);
+        arena.head = next;
+    }
+    arena.cur = NULL;
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i)
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int contains(const char *s, size_t len, const char *needle)
+{
+    size_t n = strlen(needle);
+    for (size_t i = 0; i + n <= len; ++i)
+        if (memcmp(s + i, needle, n) == 0)
+            return 1;
+    return 0;
+}
+
+static void zip_data(struct ZipWriter *z, const void *data, size_t len);
+
+static void buf_flush(Buffer *b)
+{
+    if (b->sink && b->len)
+    {
+        zip_data(b->sink, b->data, b->len);
+        b->len = 0;
+    }
+}
+
+static void buf_append(Buffer *b, const char *data, size_t len)
+{
+    if (b->failed)
+        return;
+    if (b->sink && b->len + len > SINK_FLUSH_SIZE)
+    {
+        buf_flush(b);
+        if (len >= SINK_FLUSH_SIZE)
+        {
+            zip_data(b->sink, data, len);
+            return;
+        }
+    }
+    if (b->len + len + 1 > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (b->len + len + 1 > cap)
+            cap *= 2;
+        char *grown = realloc(b->data, cap);
+        if (!grown)
+        {
+            b->failed = 1;
+            return;
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+static void buf_puts(Buffer *b, const char *s)
+{
+    buf_append(b, s, strlen(s));
+}
+
+static void buf_printf(Buffer *b, const char *fmt, ...)
+{
+    char tmp[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        buf_append(b, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+// 写入经过 XML 转义的文本；换行视为空格，制表符展开，非法控制字符丢弃
+static void buf_xml(Buffer *b, const char *text, size_t len)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned char c = (unsigned char)text[i];
+        const char *rep = NULL;
+        switch (c)
+        {
+        case '&': rep = "&amp;"; break;
+        case '<': rep = "&lt;"; break;
+        case '>': rep = "&gt;"; break;
+        case '"': rep = "&quot;"; break;
+        case '\n': rep = " "; break;
+        case '\t': rep = "    "; break;
+        default:
+            if (c < 0x20)
+                rep = "";
+            break;
+        }
+        if (rep)
+        {
+            buf_append(b, text + start, i - start);
+            buf_puts(b, rep);
+            start = i + 1;
+        }
+    }
+    buf_append(b, text + start, len - start);
+}
+
+static void buf_free(Buffer *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+// ZIP 容器：条目边写边算 CRC，XML 部件用 deflate 压缩，图片原样存储；
+// 结束条目时回填本地文件头中的 CRC 和长度。时间戳固定以保证输出可复现
+static void put_le16(unsigned char *p, unsigned v)
+{
+    p[0] = (unsigned char)(v & 0xFF);
+    p[1] = (unsigned char)((v >> 8) & 0xFF);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    put_le16(p, v & 0xFFFF);
+    put_le16(p + 2, v >> 16);
+}
+
+static void zip_write(ZipWriter *z, const void *data, size_t len)
+{
+    if (z->failed)
+        return;
+    if (fwrite(data, 1, len, z->fp) != len)
+        z->failed = 1;
+    z->offset += (uint32_t)len;
+}
+
+static void deflate_bits(ZipWriter *z, unsigned value, int bits)
+{
+    Deflater *d = z->deflater;
+    d->bits |= (uint32_t)value << d->bit_count;
+    d->bit_count += bits;
+    while (d->bit_count >= 8)
+    {
+        d->out[d->out_len++] = (unsigned char)(d->bits & 0xFF);
+        d->bits >>= 8;
+        d->bit_count -= 8;
+        if (d->out_len == DEFLATE_OUT_SIZE)
+        {
+            zip_write(z, d->out, d->out_len);
+            d->out_len = 0;
+        }
+    }
+}
+
+static void deflate_symbol(ZipWriter *z, unsigned sym)
+{
+    deflate_bits(z, fixed_code[sym], fixed_bits[sym]);
+}
+
+#define DEFLATE_HASH(p) ((((unsigned)(p)[0] << 10) ^ ((unsigned)(p)[1] << 5) ^ (p)[2]) & (DEFLATE_HASH_SIZE - 1))
+
+static void deflate_insert(Deflater *d, size_t pos)
+{
+    if (pos + 3 > d->end)
+        return;
+    unsigned h = DEFLATE_HASH(d->window + pos);
+    d->prev[pos & (DEFLATE_WINDOW - 1)] = d->head[h];
+    d->head[h] = (int32_t)pos;
+}
+
+// 编码窗口中 limit 之前的字节；匹配可以向后看到 end
+static void deflate_compress(ZipWriter *z, size_t limit)
+{
+    Deflater *d = z->deflater;
+    const unsigned char *w = d->window;
+    while (d->pos < limit)
+    {
+        size_t pos = d->pos;
+        size_t avail = d->end - pos;
+        size_t max = avail < DEFLATE_MAX_MATCH ? avail : DEFLATE_MAX_MATCH;
+        size_t best_len = 0, best_dist = 0;
+        if (max >= 3)
+        {
+            int32_t cand = d->head[DEFLATE_HASH(w + pos)];
+            int32_t last = (int32_t)pos;
+            for (int chain = DEFLATE_MAX_CHAIN; cand >= 0 && cand < last && chain > 0; --chain)
+            {
+                size_t dist = pos - (size_t)cand;
+                if (dist >= DEFLATE_WINDOW)
+                    break;
+                if (w[cand + best_len] == w[pos + best_len])
+                {
+                    size_t len = 0;
+                    while (len < max && w[cand + len] == w[pos + len])
+                        len++;
+                    if (len > best_len)
+                    {
+                        best_len = len;
+                        best_dist = dist;
+                        if (len == max)
+                            break;
+                    }
+                }
+                last = cand;
+                cand = d->prev[cand & (DEFLATE_WINDOW - 1)];
+            }
+        }
+
+        if (best_len >= 3)
+        {
+            unsigned ls = length_symbol[best_len];
+            deflate_symbol(z, 257 + ls);
+            if (length_extra[ls])
+                deflate_bits(z, (unsigned)(best_len - length_base[ls]), length_extra[ls]);
+            unsigned ds = distance_symbol[best_dist];
+            deflate_bits(z, reverse_bits(ds, 5), 5);
+            if (distance_extra[ds])
+                deflate_bits(z, (unsigned)(best_dist - distance_base[ds]), distance_extra[ds]);
+            for (size_t i = 0; i < best_len; ++i)
+                deflate_insert(d, pos + i);
+            d->pos += best_len;
+        }
+        else
+        {
+            deflate_symbol(z, w[pos]);
+            deflate_insert(d, pos);
+            d->pos++;
+        }
+    }
+}
+
+static void deflate_begin(ZipWriter *z)
+{
+    Deflater *d = z->deflater;
+    d->pos = d->end = 0;
+    d->bits = 0;
+    d->bit_count = 0;
+    d->out_len = 0;
+    memset(d->head, 0xFF, sizeof(d->head));
+    deflate_bits(z, 1, 1); // BFINAL：整个条目只有一个定长 Huffman 块
+    deflate_bits(z, 1, 2); // BTYPE = 01
+}
+
+static void deflate_feed(ZipWriter *z, const unsigned char *data, size_t len)
+{
+    Deflater *d = z->deflater;
+    while (len > 0)
+    {
+        if (d->end == sizeof(d->window))
+        {
+            // 窗口满时整体左移 32KB，哈希链中过旧的位置作废
+            memcpy(d->window, d->window + DEFLATE_WINDOW, DEFLATE_WINDOW);
+            d->pos -= DEFLATE_WINDOW;
+            d->end -= DEFLATE_WINDOW;
+            for (int i = 0; i < DEFLATE_HASH_SIZE; ++i)
+                d->head[i] = d->head[i] >= DEFLATE_WINDOW ? d->head[i] - DEFLATE_WINDOW : -1;
+            for (int i = 0; i < DEFLATE_WINDOW; ++i)
+                d->prev[i] = d->prev[i] >= DEFLATE_WINDOW ? d->prev[i] - DEFLATE_WINDOW : -1;
+        }
+        size_t n = sizeof(d->window) - d->end;
+        if (n > len)
+            n = len;
+        memcpy(d->window + d->end, data, n);
+        d->end += n;
+        data += n;
+        len -= n;
+        if (d->end > DEFLATE_MAX_MATCH)
+            deflate_compress(z, d->end - DEFLATE_MAX_MATCH);
+    }
+}
+
+static void deflate_finish(ZipWriter *z)
+{
+    Deflater *d = z->deflater;
+    deflate_compress(z, d->end);
+    deflate_symbol(z, 256);
+    if (d->bit_count > 0)
+        deflate_bits(z, 0, 8 - d->bit_count);
+    zip_write(z, d->out, d->out_len);
+    d->out_len = 0;
+}
+
+static void zip_begin(ZipWriter *z, const char *name, int method)
+{
+    if (z->failed)
+        return;
+    if (z->count == z->cap)
+    {
+        int cap = z->cap ? z->cap * 2 : 16;
+        ZipEntry *grown = realloc(z->entries, (size_t)cap * sizeof(ZipEntry));
+        if (!grown)
+        {
+            z->failed = 1;
+            return;
+        }
+        z->entries = grown;
+        z->cap = cap;
+    }
+
+    ZipEntry *e = &z->entries[z->count++];
+    memset(e, 0, sizeof(*e));
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->method = method == 8 && z->deflater ? 8 : 0;
+    e->offset = z->offset;
+
+    // CRC 与长度先填 0，zip_end 时回填
+    size_t name_len = strlen(e->name);
+    unsigned char h[30];
+    memset(h, 0, sizeof(h));
+    put_le32(h, 0x04034b50);
+    put_le16(h + 4, 20);
+    put_le16(h + 8, (unsigned)e->method);
+    put_le16(h + 10, 0);    // 00:00:00
+    put_le16(h + 12, 0x21); // 1980-01-01
+    put_le16(h + 26, (unsigned)name_len);
+    zip_write(z, h, sizeof(h));
+    zip_write(z, e->name, name_len);
+    z->open = 1;
+    if (e->method == 8)
+        deflate_begin(z);
+}
+
+static void zip_data(ZipWriter *z, const void *data, size_t len)
+{
+    if (z->failed || !z->open || len == 0)
+        return;
+    ZipEntry *e = &z->entries[z->count - 1];
+    e->crc = crc32_update(e->crc, data, len);
+    e->size += (uint32_t)len;
+    if (e->method == 8)
+        deflate_feed(z, data, len);
+    else
+        zip_write(z, data, len);
+}
+
+static void zip_end(ZipWriter *z)
+{
+    if (z->failed || !z->open)
+        return;
+    ZipEntry *e = &z->entries[z->count - 1];
+    if (e->method == 8)
+        deflate_finish(z);
+    z->open = 0;
+    if (z->failed)
+        return;
+    e->csize = z->offset - e->offset - 30 - (uint32_t)strlen(e->name);
+
+    unsigned char h[12];
+    put_le32(h, e->crc);
+    put_le32(h + 4, e->csize);
+    put_le32(h + 8, e->size);
+    if (fseek(z->fp, (long)e->offset + 14, SEEK_SET) != 0 || fwrite(h, 1, sizeof(h), z->fp) != sizeof(h) ||
+        fseek(z->fp, 0, SEEK_END) != 0)
+        z->failed = 1;
+}
+
+static void zip_add(ZipWriter *z, const char *name, const void *data, size_t len)
+{
+    zip_begin(z, name, 8);
+    zip_data(z, data, len);
+    zip_end(z);
+}
+
+// 写入 CRC 已知的原样条目，用于图片缓存中的数据
+static void zip_add_stored(ZipWriter *z, const char *name, const void *data, size_t len, uint32_t crc)
+{
+    zip_begin(z, name, 0);
+    if (z->failed)
+        return;
+    ZipEntry *e = &z->entries[z->count - 1];
+    e->crc = crc;
+    e->size = (uint32_t)len;
+    zip_write(z, data, len);
+    zip_end(z);
+}
+
+static int zip_finish(ZipWriter *z)
+{
+    uint32_t dir_start = z->offset;
+    for (int i = 0; i < z->count; ++i)
+    {
+        ZipEntry *e = &z->entries[i];
+        size_t name_len = strlen(e->name);
+        unsigned char h[46];
+        memset(h, 0, sizeof(h));
+        put_le32(h, 0x02014b50);
+        put_le16(h + 4, 20);
+        put_le16(h + 6, 20);
+        put_le16(h + 10, (unsigned)e->method);
+        put_le16(h + 14, 0x21);
+        put_le32(h + 16, e->crc);
+        put_le32(h + 20, e->csize);
+        put_le32(h + 24, e->size);
+        put_le16(h + 28, (unsigned)name_len);
+        put_le32(h + 42, e->offset);
+        zip_write(z, h, sizeof(h));
+        zip_write(z, e->name, name_len);
+    }
+
+    unsigned char end[22];
+    put_le32(end, 0x06054b50);
+    put_le16(end + 4, 0);
+    put_le16(end + 6, 0);
+    put_le16(end + 8, (unsigned)z->count);
+    put_le16(end + 10, (unsigned)z->count);
+    put_le32(end + 12, z->offset - dir_start);
+    put_le32(end + 16, dir_start);
+    put_le16(end + 20, 0);
+    zip_write(z, end, sizeof(end));
+    free(z->entries);
+    z->entries = NULL;
+    return z->failed ? -1 : 0;
+}
+
+// 从文件头读取图片像素尺寸，仅支持 Word 可直接嵌入的 PNG/JPEG/GIF
+static int image_probe(const unsigned char *d, size_t len, const char **ext, int *w, int *h)
+{
+    if (len >= 24 && memcmp(d, "\x89PNG\r\n\x1a\n", 8) == 0)
+    {
+        *ext = "png";
+        *w = (d[16] << 24) | (d[17] << 16) | (d[18] << 8) | d[19];
+        *h = (d[20] << 24) | (d[21] << 16) | (d[22] << 8) | d[23];
+        return *w > 0 && *h > 0 ? 0 : -1;
+    }
+    if (len >= 10 && (memcmp(d, "GIF87a", 6) == 0 || memcmp(d, "GIF89a", 6) == 0))
+    {
+        *ext = "gif";
+        *w = d[6] | (d[7] << 8);
+        *h = d[8] | (d[9] << 8);
+        return *w > 0 && *h > 0 ? 0 : -1;
+    }
+    if (len >= 4 && d[0] == 0xFF && d[1] == 0xD8)
+    {
+        size_t i = 2;
+        while (i + 9 < len)
+        {
+            if (d[i] != 0xFF)
+            {
+                i++;
+                continue;
+            }
+            unsigned char marker = d[i + 1];
+            size_t seg = (size_t)((d[i + 2] << 8) | d[i + 3]);
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+            {
+                *ext = "jpeg";
+                *h = (d[i + 5] << 8) | d[i + 6];
+                *w = (d[i + 7] << 8) | d[i + 8];
+                return *w > 0 && *h > 0 ? 0 : -1;
+            }
+            if (marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+                i += 2;
+            else
+                i += 2 + seg;
+        }
+    }
+    return -1;
+}
+
+// ---- 图片缓存 ----
+// 整个批次共享，按内容寻址：同一张图片无论被多少文档、以什么路径引用，只读取、
+// 识别尺寸和计算 CRC 一次，之后各文档直接把缓存的字节写入 ZIP。路径表记录
+// (size, mtime)，文件变化时重新加载；总量超过 MEDIA_CACHE_LIMIT 后只缓存元数据。
+
+static Media *media_intern(Media *fresh)
+{
+    unsigned b = (unsigned)(fresh->hash % MEDIA_BUCKETS);
+    for (Media *m = media.by_hash[b]; m; m = m->next)
+    {
+        if (m->hash == fresh->hash && m->size == fresh->size)
+        {
+            if (fresh->data)
+                media.bytes -= fresh->size;
+            free(fresh->data);
+            free(fresh);
+            return m;
+        }
+    }
+    fresh->next = media.by_hash[b];
+    media.by_hash[b] = fresh;
+    return fresh;
+}
+
+// 返回路径对应的图片；不存在或格式不支持时返回 NULL
+static Media *media_lookup(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return NULL;
+    long long mtime = stat_mtime(&st);
+
+    unsigned b = bucket_of(path, MEDIA_BUCKETS);
+    MUTEX_LOCK(&media.lock);
+    MediaPath *p = media.by_path[b];
+    while (p && strcmp(p->path, path) != 0)
+        p = p->next;
+    if (p && p->size == (long long)st.st_size && p->mtime == mtime)
+    {
+        media.hits++;
+        Media *m = p->media;
+        m->refs++;
+        m->batch = p->batch = media.batch;
+        MUTEX_UNLOCK(&media.lock);
+        return m;
+    }
+    media.misses++;
+    MUTEX_UNLOCK(&media.lock);
+
+    // 在锁外读取和解析，其他线程的命中不必等待
+    size_t len = 0;
+    unsigned char *data = (unsigned char *)read_whole_file(path, &len);
+    const char *ext = NULL;
+    int w = 0, h = 0;
+    if (!data || image_probe(data, len, &ext, &w, &h) != 0)
+    {
+        free(data);
+        return NULL;
+    }
+    Media *fresh = calloc(1, sizeof(Media) + strlen(path) + 1);
+    if (!fresh)
+    {
+        free(data);
+        return NULL;
+    }
+    fresh->hash = hash_bytes(FNV_OFFSET, data, len);
+    fresh->size = len;
+    fresh->crc = crc32_update(0, data, len);
+    fresh->width = w;
+    fresh->height = h;
+    snprintf(fresh->ext, sizeof(fresh->ext), "%s", ext);
+    strcpy(fresh->source, path);
+
+    MUTEX_LOCK(&media.lock);
+    if (media.bytes + len <= MEDIA_CACHE_LIMIT)
+    {
+        fresh->data = data;
+        media.bytes += len;
+        data = NULL;
+    }
+    Media *m = media_intern(fresh);
+    if (!p)
+    {
+        p = calloc(1, sizeof(MediaPath) + strlen(path) + 1);
+        if (p)
+        {
+            strcpy(p->path, path);
+            p->next = media.by_path[b];
+            media.by_path[b] = p;
+        }
+    }
+    if (p)
+    {
+        p->size = (long long)st.st_size;
+        p->mtime = mtime;
+        p->media = m;
+        p->batch = media.batch;
+    }
+    m->refs++;
+    m->batch = media.batch;
+    MUTEX_UNLOCK(&media.lock);
+    free(data);
+    return m;
+}
+
+// 文档写完后归还 media_lookup 取得的引用
+static void media_release(Media *m)
+{
+    MUTEX_LOCK(&media.lock);
+    m->refs--;
+    MUTEX_UNLOCK(&media.lock);
+}
+
+// 监视模式每批开始时调用：上一批和本批都没有引用、也没有文档正在使用的图片
+// 从缓存中移除，图片反复修改时旧内容不会一直留在内存里
+void native_sweep(void)
+{
+    MUTEX_LOCK(&media.lock);
+    for (unsigned b = 0; b < MEDIA_BUCKETS; ++b)
+    {
+        for (MediaPath **slot = &media.by_path[b]; *slot;)
+        {
+            MediaPath *p = *slot;
+            if (p->batch == media.batch)
+            {
+                slot = &p->next;
+                continue;
+            }
+            *slot = p->next;
+            free(p);
+        }
+        for (Media **slot = &media.by_hash[b]; *slot;)
+        {
+            Media *m = *slot;
+            if (m->batch == media.batch || m->refs > 0)
+            {
+                slot = &m->next;
+                continue;
+            }
+            *slot = m->next;
+            if (m->data)
+                media.bytes -= m->size;
+            free(m->data);
+            free(m);
+        }
+    }
+    media.batch++;
+    MUTEX_UNLOCK(&media.lock);
+}
+
+// 打印命中统计并释放缓存，批次结束时调用
+void native_report(void)
+{
+    if (media.hits + media.misses > 0)
+        printf("Image cache: %d hits, %d misses, %zu KB cached\n", media.hits, media.misses, media.bytes / 1024);
+    for (unsigned b = 0; b < MEDIA_BUCKETS; ++b)
+    {
+        while (media.by_path[b])
+        {
+            MediaPath *next = media.by_path[b]->next;
+            free(media.by_path[b]);
+            media.by_path[b] = next;
+        }
+        while (media.by_hash[b])
+        {
+            Media *next = media.by_hash[b]->next;
+            free(media.by_hash[b]->data);
+            free(media.by_hash[b]);
+            media.by_hash[b] = next;
+        }
+    }
+    media.bytes = 0;
+    media.hits = media.misses = 0;
+}
+
+static void doc_fallback(DocWriter *doc, const char *reason)
+{
+    if (!doc->fallback)
+    {
+        doc->fallback = 1;
+        snprintf(doc->reason, sizeof(doc->reason), "%s", reason);
+    }
+}
+
+static int doc_add_rel(DocWriter *doc, const char *type, const char *target, size_t target_len, int external)
+{
+    uint64_t key = hash_bytes(hash_bytes(FNV_OFFSET, type, strlen(type) + 1), target, target_len);
+    key |= 1;
+    if ((size_t)(doc->next_rel - 3 + 1) * 2 > doc->rel_cap)
+    {
+        size_t cap = doc->rel_cap ? doc->rel_cap * 2 : 256;
+        RelSlot *slots = calloc(cap, sizeof(RelSlot));
+        if (!slots)
+        {
+            doc_fallback(doc, "out of memory");
+            return 0;
+        }
+        for (size_t i = 0; i < doc->rel_cap; ++i)
+        {
+            if (!doc->rel_slots[i].key)
+                continue;
+            size_t j = doc->rel_slots[i].key & (cap - 1);
+            while (slots[j].key)
+                j = (j + 1) & (cap - 1);
+            slots[j] = doc->rel_slots[i];
+        }
+        free(doc->rel_slots);
+        doc->rel_slots = slots;
+        doc->rel_cap = cap;
+    }
+    size_t slot = key & (doc->rel_cap - 1);
+    while (doc->rel_slots[slot].key)
+    {
+        if (doc->rel_slots[slot].key == key)
+            return doc->rel_slots[slot].id;
+        slot = (slot + 1) & (doc->rel_cap - 1);
+    }
+
+    int id = doc->next_rel++;
+    doc->rel_slots[slot].key = key;
+    doc->rel_slots[slot].id = id;
+    buf_printf(&doc->rels, "<Relationship Id=\"rId%d\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/%s\" Target=\"", id, type);
+    buf_xml(&doc->rels, target, target_len);
+    buf_puts(&doc->rels, external ? "\" TargetMode=\"External\"/>" : "\"/>");
+    return id;
+}
+
+// 登记图片并返回其关系；文件内容等 document.xml 写完后再嵌入 word/media，
+// 同一文档内重复引用的图片只嵌入一次
+static DocImage *doc_image(DocWriter *doc, const char *src, size_t src_len)
+{
+    if (src_len == 0 || src_len >= MAX_PATH_LEN / 2 || contains(src, src_len, "://"))
+    {
+        doc_fallback(doc, "remote or empty image path");
+        return NULL;
+    }
+    char *path = join_path(src[0] == '/' ? NULL : doc->dir, src, src_len);
+    if (!path)
+    {
+        doc_fallback(doc, "out of memory");
+        return NULL;
+    }
+
+    for (int i = 0; i < doc->image_count; ++i)
+    {
+        if (strcmp(doc->images[i].path, path) == 0)
+        {
+            free(path);
+            return &doc->images[i];
+        }
+    }
+
+    Media *m = media_lookup(path);
+    if (!m)
+    {
+        free(path);
+        doc_fallback(doc, "unsupported or missing image");
+        return NULL;
+    }
+    // 不同路径指向相同内容时共用一个 word/media 条目
+    for (int i = 0; i < doc->image_count; ++i)
+    {
+        if (doc->images[i].media == m)
+        {
+            media_release(m);
+            free(path);
+            return &doc->images[i];
+        }
+    }
+
+    DocImage *grown = realloc(doc->images, (size_t)(doc->image_count + 1) * sizeof(DocImage));
+    if (!grown)
+    {
+        media_release(m);
+        free(path);
+        doc_fallback(doc, "out of memory");
+        return NULL;
+    }
+    doc->images = grown;
+    DocImage *img = &doc->images[doc->image_count++];
+    img->path = path;
+    img->media = m;
+
+    char target[48];
+    int target_len = snprintf(target, sizeof(target), "media/image%d.%s", doc->image_count, m->ext);
+    img->rel = doc_add_rel(doc, "image", target, (size_t)target_len, 0);
+
+    // 按 96 DPI 换算，超出正文宽度时等比缩小
+    img->cx = m->width * EMU_PER_PIXEL;
+    img->cy = m->height * EMU_PER_PIXEL;
+    if (img->cx > PAGE_WIDTH_EMU)
+    {
+        img->cy = img->cy * PAGE_WIDTH_EMU / img->cx;
+        img->cx = PAGE_WIDTH_EMU;
+    }
+    return img;
+}
+
+// ---- 行内解析 ----
+
+static Inline *inline_new(int kind, int format, const char *text, size_t len)
+{
+    Inline *in = arena_alloc(sizeof(Inline));
+    if (!in)
+        return NULL;
+    memset(in, 0, sizeof(*in));
+    in->kind = kind;
+    in->format = format;
+    in->text = text;
+    in->len = len;
+    return in;
+}
+
+static int is_punct(char c)
+{
+    return c > 0x20 && c < 0x7F && !((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'));
+}
+
+static int is_word(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (unsigned char)c >= 0x80;
+}
+
+// 跳过从 j 开始的行内代码，返回代码结束后的位置；没有配对的反引号时只跳过开头的反引号串
+static size_t skip_code_span(const char *s, size_t j, size_t len, size_t *run_out)
+{
+    size_t run = 0;
+    while (j + run < len && s[j + run] == '`')
+        run++;
+    if (run_out)
+        *run_out = run;
+    for (size_t k = j + run; k < len;)
+    {
+        if (s[k] != '`')
+        {
+            k++;
+            continue;
+        }
+        size_t r = 0;
+        while (k + r < len && s[k + r] == '`')
+            r++;
+        if (r == run)
+            return k + r;
+        k += r;
+    }
+    return j + run;
+}
+
+// 在 s[from, len) 中查找长度恰为 dlen 的强调结束符，结束符前不能是空白
+static size_t find_closer(const char *s, size_t from, size_t len, char c, size_t dlen)
+{
+    for (size_t j = from; j < len; ++j)
+    {
+        if (s[j] == '\\')
+        {
+            j++;
+            continue;
+        }
+        if (s[j] == '`')
+        {
+            j = skip_code_span(s, j, len, NULL) - 1;
+            continue;
+        }
+        if (s[j] != c)
+            continue;
+        size_t run = 0;
+        while (j + run < len && s[j + run] == c)
+            run++;
+        if (run == dlen && s[j - 1] != ' ' && s[j - 1] != '\n' &&
+            !(c == '_' && j + run < len && is_word(s[j + run])))
+            return j;
+        j += run - 1;
+    }
+    return (size_t)-1;
+}
+
+// 查找 "[...]" 的结束括号，支持嵌套和转义
+static size_t find_bracket(const char *s, size_t from, size_t len)
+{
+    int depth = 0;
+    for (size_t j = from; j < len; ++j)
+    {
+        if (s[j] == '\\')
+            j++;
+        else if (s[j] == '[')
+            depth++;
+        else if (s[j] == ']' && depth-- == 0)
+            return j;
+    }
+    return (size_t)-1;
+}
+
+static Inline *parse_inlines(DocWriter *doc, const char *s, size_t len, int format);
+
+// 追加节点，返回新的尾指针
+static Inline **inline_push(Inline **tail, Inline *in)
+{
+    if (!in)
+        return tail;
+    *tail = in;
+    while (in->next)
+        in = in->next;
+    return &in->next;
+}
+
+static Inline *parse_inlines(DocWriter *doc, const char *s, size_t len, int format)
+{
+    Inline *head = NULL, **tail = &head;
+    size_t text_start = 0;
+
+#define FLUSH_TEXT(end)                                                                       \
+    do                                                                                        \
+    {                                                                                         \
+        if ((end) > text_start)                                                               \
+            tail = inline_push(tail, inline_new(INLINE_TEXT, format, s + text_start, (end) - text_start)); \
+    } while (0)
+
+    size_t i = 0;
+    while (i < len && !doc->fallback)
+    {
+        char c = s[i];
+
+        if (c == '\\' && i + 1 < len && (is_punct(s[i + 1]) || s[i + 1] == '\n'))
+        {
+            FLUSH_TEXT(i);
+            if (s[i + 1] == '\n')
+            {
+                tail = inline_push(tail, inline_new(INLINE_BREAK, format, NULL, 0));
+                text_start = i + 2;
+            }
+            else
+            {
+                text_start = i + 1; // 保留被转义的字符
+            }
+            i += 2;
+            continue;
+        }
+
+        if (c == '\n')
+        {
+            // 行尾两个以上空格为硬换行
+            size_t sp = i;
+            while (sp > text_start && s[sp - 1] == ' ')
+                sp--;
+            if (i - sp >= 2)
+            {
+                FLUSH_TEXT(sp);
+                tail = inline_push(tail, inline_new(INLINE_BREAK, format, NULL, 0));
+                text_start = i + 1;
+            }
+            i++;
+            continue;
+        }
+
+        if (c == '`')
+        {
+            size_t run;
+            size_t end = skip_code_span(s, i, len, &run);
+            if (end == i + run)
+            {
+                i += run;
+                continue;
+            }
+            FLUSH_TEXT(i);
+            const char *code = s + i + run;
+            size_t code_len = end - run - i - run;
+            if (code_len >= 2 && code[0] == ' ' && code[code_len - 1] == ' ')
+            {
+                code++;
+                code_len -= 2;
+            }
+            tail = inline_push(tail, inline_new(INLINE_CODE, format, code, code_len));
+            i = end;
+            text_start = i;
+            continue;
+        }
+
+        if (c == '*' || c == '_' || (c == '~' && i + 1 < len && s[i + 1] == '~'))
+        {
+            size_t run = 0;
+            while (i + run < len && s[i + run] == c)
+                run++;
+            int opens = i + run < len && s[i + run] != ' ' && s[i + run] != '\n';
+            if (c == '_' && i > 0 && is_word(s[i - 1]))
+                opens = 0;
+            if (opens)
+            {
+                size_t dlen = c == '~' ? 2 : (run >= 3 ? 3 : run);
+                size_t close = find_closer(s, i + dlen, len, c, dlen);
+                if (close != (size_t)-1)
+                {
+                    int add = c == '~' ? FMT_STRIKE : dlen == 1 ? FMT_ITALIC : dlen == 2 ? FMT_BOLD : FMT_BOLD | FMT_ITALIC;
+                    FLUSH_TEXT(i);
+                    tail = inline_push(tail, parse_inlines(doc, s + i + dlen, close - i - dlen, format | add));
+                    i = close + dlen;
+                    text_start = i;
+                    continue;
+                }
+            }
+            i += run;
+            continue;
+        }
+
+        if (c == '!' && i + 1 < len && s[i + 1] == '[')
+        {
+            size_t close = find_bracket(s, i + 2, len);
+            if (close != (size_t)-1 && close + 1 < len && s[close + 1] == '(')
+            {
+                size_t end = close + 2;
+                while (end < len && s[end] != ')')
+                    end++;
+                if (end < len)
+                {
+                    const char *src = s + close + 2;
+                    size_t src_len = 0;
+                    while (src < s + end && *src == ' ')
+                        src++;
+                    if (*src == '<')
+                    {
+                        src++;
+                        while (src + src_len < s + end && src[src_len] != '>')
+                            src_len++;
+                    }
+                    else
+                    {
+                        while (src + src_len < s + end && src[src_len] != ' ')
+                            src_len++;
+                    }
+                    FLUSH_TEXT(i);
+                    Inline *img = inline_new(INLINE_IMAGE, format, s + i + 2, close - i - 2);
+                    if (img)
+                    {
+                        img->target = src;
+                        img->target_len = src_len;
+                    }
+                    tail = inline_push(tail, img);
+                    i = end + 1;
+                    text_start = i;
+                    continue;
+                }
+            }
+        }
+
+        if (c == '[')
+        {
+            if (i + 1 < len && s[i + 1] == '^')
+            {
+                doc_fallback(doc, "footnote");
+                break;
+            }
+            size_t close = find_bracket(s, i + 1, len);
+            if (close != (size_t)-1 && close + 1 < len && s[close + 1] == '[')
+            {
+                doc_fallback(doc, "reference link");
+                break;
+            }
+            if (close != (size_t)-1 && close + 1 < len && s[close + 1] == '(')
+            {
+                size_t end = close + 2;
+                while (end < len && s[end] != ')')
+                    end++;
+                if (end < len)
+                {
+                    const char *url = s + close + 2;
+                    size_t url_len = 0;
+                    while (url < s + end && *url == ' ')
+                        url++;
+                    while (url + url_len < s + end && url[url_len] != ' ')
+                        url_len++;
+                    FLUSH_TEXT(i);
+                    Inline *link = inline_new(INLINE_LINK, format, NULL, 0);
+                    if (link)
+                    {
+                        link->target = url;
+                        link->target_len = url_len;
+                        link->children = parse_inlines(doc, s + i + 1, close - i - 1, format);
+                    }
+                    tail = inline_push(tail, link);
+                    i = end + 1;
+                    text_start = i;
+                    continue;
+                }
+            }
+        }
+
+        if (c == '<')
+        {
+            size_t end = i + 1;
+            while (end < len && s[end] != '>' && s[end] != ' ' && s[end] != '\n')
+                end++;
+            if (end < len && s[end] == '>' && contains(s + i, end - i, "://"))
+            {
+                FLUSH_TEXT(i);
+                Inline *link = inline_new(INLINE_LINK, format, NULL, 0);
+                if (link)
+                {
+                    link->target = s + i + 1;
+                    link->target_len = end - i - 1;
+                    link->children = inline_new(INLINE_TEXT, format, s + i + 1, end - i - 1);
+                }
+                tail = inline_push(tail, link);
+                i = end + 1;
+                text_start = i;
+                continue;
+            }
+            if (i + 1 < len && (isalpha((unsigned char)s[i + 1]) || s[i + 1] == '/' || s[i + 1] == '!'))
+            {
+                doc_fallback(doc, "raw HTML");
+                break;
+            }
+        }
+
+        if (c == '$' && i + 1 < len && s[i + 1] != ' ')
+        {
+            // pandoc 的 $...$ 数学公式：结束符前非空白且后面不紧跟数字
+            for (size_t k = i + 1; k < len; ++k)
+            {
+                if (s[k] == '$' && s[k - 1] != ' ' && s[k - 1] != '\\' &&
+                    (k + 1 >= len || !isdigit((unsigned char)s[k + 1])))
+                {
+                    doc_fallback(doc, "TeX math");
+                    break;
+                }
+            }
+        }
+
+        i++;
+    }
+    FLUSH_TEXT(len);
+#undef FLUSH_TEXT
+    return head;
+}
+
+// ---- 文档输出 ----
+
+static void render_run_props(Buffer *b, int format, const char *style)
+{
+    if (!format && !style)
+        return;
+    buf_puts(b, "<w:rPr>");
+    if (style)
+        buf_printf(b, "<w:rStyle w:val=\"%s\"/>", style);
+    if (format & FMT_BOLD)
+        buf_puts(b, "<w:b/><w:bCs/>");
+    if (format & FMT_ITALIC)
+        buf_puts(b, "<w:i/><w:iCs/>");
+    if (format & FMT_STRIKE)
+        buf_puts(b, "<w:strike/>");
+    buf_puts(b, "</w:rPr>");
+}
+
+static void render_text_run(Buffer *b, int format, const char *style, const char *text, size_t len)
+{
+    buf_puts(b, "<w:r>");
+    render_run_props(b, format, style);
+    buf_puts(b, "<w:t xml:space=\"preserve\">");
+    buf_xml(b, text, len);
+    buf_puts(b, "</w:t></w:r>");
+}
+
+static void render_image(DocWriter *doc, const Inline *in)
+{
+    char src[MAX_PATH_LEN];
+    snprintf(src, sizeof(src), "%.*s", (int)in->target_len, in->target);
+    DocImage *img = doc_image(doc, src, strlen(src));
+    if (!img)
+        return;
+
+    Buffer *b = &doc->xml;
+    int id = ++doc->drawing_count;
+    buf_printf(b, "<w:r><w:drawing><wp:inline distT=\"0\" distB=\"0\" distL=\"0\" distR=\"0\">"
+                  "<wp:extent cx=\"%lld\" cy=\"%lld\"/><wp:docPr id=\"%d\" name=\"Picture %d\" descr=\"",
+               img->cx, img->cy, id, id);
+    buf_xml(b, in->text, in->len);
+    buf_printf(b, "\"/><a:graphic xmlns:a=\"http://schemas.openxmlformats.org/drawingml/2006/main\">"
+                  "<a:graphicData uri=\"http://schemas.openxmlformats.org/drawingml/2006/picture\">"
+                  "<pic:pic xmlns:pic=\"http://schemas.openxmlformats.org/drawingml/2006/picture\">"
+                  "<pic:nvPicPr><pic:cNvPr id=\"0\" name=\"image%d\"/><pic:cNvPicPr/></pic:nvPicPr>"
+                  "<pic:blipFill><a:blip r:embed=\"rId%d\"/><a:stretch><a:fillRect/></a:stretch></pic:blipFill>"
+                  "<pic:spPr><a:xfrm><a:off x=\"0\" y=\"0\"/><a:ext cx=\"%lld\" cy=\"%lld\"/></a:xfrm>"
+                  "<a:prstGeom prst=\"rect\"><a:avLst/></a:prstGeom></pic:spPr></pic:pic>"
+                  "</a:graphicData></a:graphic></wp:inline></w:drawing></w:r>",
+               id, img->rel, img->cx, img->cy);
+}
+
+static void render_inlines(DocWriter *doc, const Inline *in, const char *style)
+{
+    Buffer *b = &doc->xml;
+    for (; in && !doc->fallback; in = in->next)
+    {
+        switch (in->kind)
+        {
+        case INLINE_TEXT:
+            render_text_run(b, in->format, style, in->text, in->len);
+            break;
+        case INLINE_CODE:
+            render_text_run(b, in->format, "VerbatimChar", in->text, in->len);
+            break;
+        case INLINE_BREAK:
+            buf_puts(b, "<w:r><w:br/></w:r>");
+            break;
+        case INLINE_IMAGE:
+            render_image(doc, in);
+            break;
+        case INLINE_LINK:
+            if (in->target_len > 0 && in->target[0] != '#')
+            {
+                // 链接目标直接按长度登记，不经过定长缓冲区，过长的 URL 也不会被截断
+                buf_printf(b, "<w:hyperlink r:id=\"rId%d\">", doc_add_rel(doc, "hyperlink", in->target, in->target_len, 1));
+                render_inlines(doc, in->children, "Hyperlink");
+                buf_puts(b, "</w:hyperlink>");
+            }
+            else
+            {
+                render_inlines(doc, in->children, "Hyperlink");
+            }
+            break;
+        }
+    }
+}
+
+static void doc_paragraph(DocWriter *doc, const char *style, const char *extra_props, const Inline *inlines)
+{
+    Buffer *b = &doc->xml;
+    buf_printf(b, "<w:p><w:pPr><w:pStyle w:val=\"%s\"/>%s</w:pPr>", style, extra_props ? extra_props : "");
+    render_inlines(doc, inlines, NULL);
+    buf_puts(b, "</w:p>");
+}
+
+static int doc_new_list(DocWriter *doc, int level, int start)
+{
+    ListNum *grown = realloc(doc->lists, (size_t)(doc->list_count + 1) * sizeof(ListNum));
+    if (!grown)
+    {
+        doc_fallback(doc, "out of memory");
+        return 1;
+    }
+    doc->lists = grown;
+    doc->lists[doc->list_count].level = level;
+    doc->lists[doc->list_count].start = start;
+    // numId 1 保留给项目符号列表，编号列表从 2 开始各自独立计数
+    return 2 + doc->list_count++;
+}
+
+static void doc_code_begin(DocWriter *doc)
+{
+    buf_puts(&doc->xml, "<w:p><w:pPr><w:pStyle w:val=\"SourceCode\"/></w:pPr>");
+}
+
+static void doc_code_line(DocWriter *doc, const char *line, size_t len, int first)
+{
+    if (!first)
+        buf_puts(&doc->xml, "<w:r><w:br/></w:r>");
+    if (len > 0)
+        render_text_run(&doc->xml, 0, "VerbatimChar", line, len);
+}
+
+static void doc_code_end(DocWriter *doc)
+{
+    buf_puts(&doc->xml, "</w:p>");
+}
+
+static void doc_table_begin(DocWriter *doc, int cols)
+{
+    Buffer *b = &doc->xml;
+    buf_puts(b, "<w:tbl><w:tblPr><w:tblStyle w:val=\"Table\"/><w:tblW w:w=\"0\" w:type=\"auto\"/>"
+                "<w:tblLook w:firstRow=\"1\" w:lastRow=\"0\" w:firstColumn=\"0\" w:lastColumn=\"0\" w:noHBand=\"0\" w:noVBand=\"0\"/>"
+                "</w:tblPr><w:tblGrid>");
+    for (int i = 0; i < cols; ++i)
+        buf_puts(b, "<w:gridCol/>");
+    buf_puts(b, "</w:tblGrid>");
+}
+
+static void doc_table_row(DocWriter *doc, const Slice *cells, int count, int cols, const int *aligns, int header)
+{
+    static const char *jc[] = {"", "<w:jc w:val=\"left\"/>", "<w:jc w:val=\"center\"/>", "<w:jc w:val=\"right\"/>"};
+    Buffer *b = &doc->xml;
+    buf_puts(b, header ? "<w:tr><w:trPr><w:tblHeader/></w:trPr>" : "<w:tr>");
+    for (int c = 0; c < cols; ++c)
+    {
+        buf_puts(b, "<w:tc>");
+        ArenaMark mark = arena_mark();
+        Inline *inlines = c < count ? parse_inlines(doc, cells[c].text, cells[c].len, header ? FMT_BOLD : 0) : NULL;
+        doc_paragraph(doc, "Compact", jc[aligns[c]], inlines);
+        arena_release(mark);
+        buf_puts(b, "</w:tc>");
+    }
+    buf_puts(b, "</w:tr>");
+}
+
+static void doc_table_end(DocWriter *doc)
+{
+    buf_puts(&doc->xml, "</w:tbl>");
+}
+
+static const char DOCX_CONTENT_TYPES[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+    "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">"
+    "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>"
+    "<Default Extension=\"xml\" ContentType=\"application/xml\"/>"
+    "<Default Extension=\"png\" ContentType=\"image/png\"/>"
+    "<Default Extension=\"jpeg\" ContentType=\"image/jpeg\"/>"
+    "<Default Extension=\"gif\" ContentType=\"image/gif\"/>"
+    "<Override PartName=\"/word/document.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml\"/>"
+    "<Override PartName=\"/word/styles.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.styles+xml\"/>"
+    "<Override PartName=\"/word/numbering.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.numbering+xml\"/>"
+    "</Types>";
+
+static const char DOCX_PACKAGE_RELS[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+    "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
+    "<Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument\" Target=\"word/document.xml\"/>"
+    "</Relationships>";
+
+static const char DOCX_DOCUMENT_RELS_HEAD[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+    "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
+    "<Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/styles\" Target=\"styles.xml\"/>"
+    "<Relationship Id=\"rId2\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/numbering\" Target=\"numbering.xml\"/>";
+
+static const char DOCX_DOCUMENT_HEAD[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+    "<w:document xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\""
+    " xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\""
+    " xmlns:wp=\"http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing\"><w:body>";
+
+static const char DOCX_DOCUMENT_TAIL[] =
+    "<w:sectPr><w:pgSz w:w=\"12240\" w:h=\"15840\"/>"
+    "<w:pgMar w:top=\"1440\" w:right=\"1440\" w:bottom=\"1440\" w:left=\"1440\" w:header=\"720\" w:footer=\"720\" w:gutter=\"0\"/>"
+    "</w:sectPr></w:body></w:document>";
+
+#define STYLE_PARA(id, name, based, extra)                                                      \
+    "<w:style w:type=\"paragraph\" w:customStyle=\"1\" w:styleId=\"" id "\"><w:name w:val=\"" name \
+    "\"/><w:basedOn w:val=\"" based "\"/><w:qFormat/>" extra "</w:style>"
+#define STYLE_HEADING(n, level, size)                                                                            \
+    "<w:style w:type=\"paragraph\" w:styleId=\"Heading" #n "\"><w:name w:val=\"heading " #n "\"/>"               \
+    "<w:basedOn w:val=\"Normal\"/><w:next w:val=\"BodyText\"/><w:uiPriority w:val=\"9\"/><w:qFormat/>"           \
+    "<w:pPr><w:keepNext/><w:keepLines/><w:spacing w:before=\"240\" w:after=\"0\"/><w:outlineLvl w:val=\"" #level \
+    "\"/></w:pPr><w:rPr><w:rFonts w:asciiTheme=\"majorHAnsi\" w:hAnsiTheme=\"majorHAnsi\"/><w:b/><w:bCs/>"       \
+    "<w:color w:val=\"4F81BD\"/><w:sz w:val=\"" #size "\"/><w:szCs w:val=\"" #size "\"/></w:rPr></w:style>"
+
+static const char DOCX_STYLES[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+    "<w:styles xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\">"
+    "<w:docDefaults><w:rPrDefault><w:rPr><w:rFonts w:asciiTheme=\"minorHAnsi\" w:eastAsiaTheme=\"minorEastAsia\" w:hAnsiTheme=\"minorHAnsi\" w:cstheme=\"minorBidi\"/>"
+    "<w:sz w:val=\"24\"/><w:szCs w:val=\"24\"/><w:lang w:val=\"en-US\" w:eastAsia=\"zh-CN\"/></w:rPr></w:rPrDefault>"
+    "<w:pPrDefault><w:pPr><w:spacing w:after=\"200\"/></w:pPr></w:pPrDefault></w:docDefaults>"
+    "<w:style w:type=\"paragraph\" w:default=\"1\" w:styleId=\"Normal\"><w:name w:val=\"Normal\"/><w:qFormat/></w:style>"
+    "<w:style w:type=\"paragraph\" w:styleId=\"BodyText\"><w:name w:val=\"Body Text\"/><w:basedOn w:val=\"Normal\"/><w:qFormat/>"
+    "<w:pPr><w:spacing w:before=\"180\" w:after=\"180\"/></w:pPr></w:style>"
+    STYLE_PARA("FirstParagraph", "First Paragraph", "BodyText", "<w:next w:val=\"BodyText\"/>")
+    STYLE_PARA("Compact", "Compact", "BodyText", "<w:pPr><w:spacing w:before=\"36\" w:after=\"36\"/></w:pPr>")
+    STYLE_HEADING(1, 0, 32) STYLE_HEADING(2, 1, 28) STYLE_HEADING(3, 2, 24)
+    STYLE_HEADING(4, 3, 24) STYLE_HEADING(5, 4, 24) STYLE_HEADING(6, 5, 24)
+    "<w:style w:type=\"paragraph\" w:styleId=\"BlockText\"><w:name w:val=\"Block Text\"/><w:basedOn w:val=\"BodyText\"/><w:next w:val=\"BodyText\"/><w:qFormat/>"
+    "<w:pPr><w:spacing w:before=\"100\" w:after=\"100\"/><w:ind w:left=\"480\" w:right=\"480\"/></w:pPr></w:style>"
+    STYLE_PARA("SourceCode", "Source Code", "Normal", "<w:link w:val=\"VerbatimChar\"/><w:pPr><w:wordWrap w:val=\"off\"/></w:pPr>")
+    STYLE_PARA("CaptionedFigure", "Captioned Figure", "Normal", "<w:pPr><w:keepNext/></w:pPr>")
+    STYLE_PARA("ImageCaption", "Image Caption", "Normal", "<w:pPr><w:spacing w:before=\"0\" w:after=\"120\"/></w:pPr><w:rPr><w:i/></w:rPr>")
+    "<w:style w:type=\"character\" w:default=\"1\" w:styleId=\"DefaultParagraphFont\"><w:name w:val=\"Default Paragraph Font\"/><w:semiHidden/><w:unhideWhenUsed/></w:style>"
+    "<w:style w:type=\"character\" w:customStyle=\"1\" w:styleId=\"VerbatimChar\"><w:name w:val=\"Verbatim Char\"/><w:basedOn w:val=\"DefaultParagraphFont\"/>"
+    "<w:rPr><w:rFonts w:ascii=\"Consolas\" w:hAnsi=\"Consolas\"/><w:sz w:val=\"22\"/></w:rPr></w:style>"
+    "<w:style w:type=\"character\" w:styleId=\"Hyperlink\"><w:name w:val=\"Hyperlink\"/><w:basedOn w:val=\"DefaultParagraphFont\"/>"
+    "<w:rPr><w:color w:val=\"4F81BD\"/></w:rPr></w:style>"
+    "<w:style w:type=\"table\" w:default=\"1\" w:styleId=\"TableNormal\"><w:name w:val=\"Normal Table\"/><w:semiHidden/><w:unhideWhenUsed/>"
+    "<w:tblPr><w:tblInd w:w=\"0\" w:type=\"dxa\"/><w:tblCellMar><w:top w:w=\"0\" w:type=\"dxa\"/><w:left w:w=\"108\" w:type=\"dxa\"/>"
+    "<w:bottom w:w=\"0\" w:type=\"dxa\"/><w:right w:w=\"108\" w:type=\"dxa\"/></w:tblCellMar></w:tblPr></w:style>"
+    "<w:style w:type=\"table\" w:customStyle=\"1\" w:styleId=\"Table\"><w:name w:val=\"Table\"/><w:basedOn w:val=\"TableNormal\"/>"
+    "<w:tblPr><w:tblBorders><w:top w:val=\"single\" w:sz=\"8\" w:space=\"0\" w:color=\"auto\"/><w:bottom w:val=\"single\" w:sz=\"8\" w:space=\"0\" w:color=\"auto\"/></w:tblBorders></w:tblPr>"
+    "<w:tblStylePr w:type=\"firstRow\"><w:tblPr/><w:tcPr><w:tcBorders><w:bottom w:val=\"single\" w:sz=\"4\" w:space=\"0\" w:color=\"auto\"/></w:tcBorders></w:tcPr></w:tblStylePr></w:style>"
+    "</w:styles>";
+
+#define NUM_LEVEL(ilvl, fmt, text, left) \
+    "<w:lvl w:ilvl=\"" #ilvl "\"><w:start w:val=\"1\"/><w:numFmt w:val=\"" fmt "\"/><w:lvlText w:val=\"" text "\"/>" \
+    "<w:lvlJc w:val=\"left\"/><w:pPr><w:ind w:left=\"" #left "\" w:hanging=\"360\"/></w:pPr></w:lvl>"
+
+static const char DOCX_NUMBERING_HEAD[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+    "<w:numbering xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\">"
+    "<w:abstractNum w:abstractNumId=\"0\"><w:multiLevelType w:val=\"multilevel\"/>"
+    NUM_LEVEL(0, "bullet", "\xE2\x80\xA2", 720) NUM_LEVEL(1, "bullet", "\xE2\x97\xA6", 1440)
+    NUM_LEVEL(2, "bullet", "\xE2\x96\xAA", 2160) NUM_LEVEL(3, "bullet", "\xE2\x80\xA2", 2880)
+    NUM_LEVEL(4, "bullet", "\xE2\x97\xA6", 3600) NUM_LEVEL(5, "bullet", "\xE2\x96\xAA", 4320)
+    NUM_LEVEL(6, "bullet", "\xE2\x80\xA2", 5040) NUM_LEVEL(7, "bullet", "\xE2\x97\xA6", 5760)
+    NUM_LEVEL(8, "bullet", "\xE2\x96\xAA", 6480)
+    "</w:abstractNum>"
+    "<w:abstractNum w:abstractNumId=\"1\"><w:multiLevelType w:val=\"multilevel\"/>"
+    NUM_LEVEL(0, "decimal", "%1.", 720) NUM_LEVEL(1, "lowerLetter", "%2.", 1440)
+    NUM_LEVEL(2, "lowerRoman", "%3.", 2160) NUM_LEVEL(3, "decimal", "%4.", 2880)
+    NUM_LEVEL(4, "lowerLetter", "%5.", 3600) NUM_LEVEL(5, "lowerRoman", "%6.", 4320)
+    NUM_LEVEL(6, "decimal", "%7.", 5040) NUM_LEVEL(7, "lowerLetter", "%8.", 5760)
+    NUM_LEVEL(8, "lowerRoman", "%9.", 6480)
+    "</w:abstractNum>"
+    "<w:num w:numId=\"1\"><w:abstractNumId w:val=\"0\"/></w:num>";
+
+// ---- 块级解析 ----
+// 逐行喂入，段落文本在 para 中累积到块结束；代码块和表格逐行直接输出。
+
+static size_t line_indent(const char *line, size_t len, size_t *pos)
+{
+    size_t col = 0, i = 0;
+    while (i < len && (line[i] == ' ' || line[i] == '\t'))
+    {
+        col = line[i] == '\t' ? (col + 4) & ~(size_t)3 : col + 1;
+        i++;
+    }
+    *pos = i;
+    return col;
+}
+
+// 跳过行首至多 cols 列的空白，返回字节偏移
+static size_t skip_columns(const char *line, size_t len, size_t cols)
+{
+    size_t i = 0, col = 0;
+    while (i < len && col < cols && (line[i] == ' ' || line[i] == '\t'))
+    {
+        col = line[i] == '\t' ? (col + 4) & ~(size_t)3 : col + 1;
+        i++;
+    }
+    return i;
+}
+
+static int is_blank(const char *line, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        if (line[i] != ' ' && line[i] != '\t')
+            return 0;
+    return 1;
+}
+
+// 按未转义、不在行内代码中的 '|' 切分表格行
+static int split_row(const char *s, size_t len, Slice *cells, int max)
+{
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t'))
+        len--;
+    size_t i = 0;
+    while (i < len && (s[i] == ' ' || s[i] == '\t'))
+        i++;
+    if (i < len && s[i] == '|')
+        i++;
+    if (len > i && s[len - 1] == '|' && (len < 2 || s[len - 2] != '\\'))
+        len--;
+
+    int count = 0, in_code = 0;
+    size_t start = i;
+    for (; i <= len; ++i)
+    {
+        if (i < len && s[i] == '\\')
+        {
+            i++;
+            continue;
+        }
+        if (i < len && s[i] == '`')
+            in_code = !in_code;
+        if (i == len || (s[i] == '|' && !in_code))
+        {
+            size_t a = start, b = i;
+            while (a < b && (s[a] == ' ' || s[a] == '\t'))
+                a++;
+            while (b > a && (s[b - 1] == ' ' || s[b - 1] == '\t'))
+                b--;
+            if (count < max)
+            {
+                cells[count].text = s + a;
+                cells[count].len = b - a;
+                count++;
+            }
+            start = i + 1;
+        }
+    }
+    return count;
+}
+
+// 表格分隔行，例如 |:---|:---:|---:|，返回列数
+static int parse_delimiter_row(const char *s, size_t len, int *aligns)
+{
+    Slice cells[MAX_TABLE_COLS];
+    int count = split_row(s, len, cells, MAX_TABLE_COLS);
+    int piped = memchr(s, '|', len) != NULL;
+    if (count == 0 || (!piped && count < 2))
+        return 0;
+    for (int c = 0; c < count; ++c)
+    {
+        const char *p = cells[c].text;
+        size_t n = cells[c].len;
+        if (n == 0)
+            return 0;
+        int left = p[0] == ':', right = p[n - 1] == ':';
+        size_t dashes = 0;
+        for (size_t k = left; k < n - right; ++k)
+        {
+            if (p[k] != '-')
+                return 0;
+            dashes++;
+        }
+        if (dashes == 0)
+            return 0;
+        aligns[c] = left && right ? 2 : right ? 3 : left ? 1 : 0;
+    }
+    return count;
+}
+
+static void md_flush_para(MdParser *p)
+{
+    if (p->para_kind == PARA_NONE)
+        return;
+    DocWriter *doc = p->doc;
+    ArenaMark mark = arena_mark();
+    Inline *inlines = parse_inlines(doc, p->para.data, p->para.len, 0);
+
+    char props[128] = "";
+    const char *style = "BodyText";
+    switch (p->para_kind)
+    {
+    case PARA_TEXT:
+        if (inlines && !inlines->next && inlines->kind == INLINE_IMAGE && inlines->len > 0)
+        {
+            // 单独成段且带说明文字的图片按 pandoc 的方式输出为图 + 题注
+            doc_paragraph(doc, "CaptionedFigure", NULL, inlines);
+            Inline *caption = parse_inlines(doc, inlines->text, inlines->len, 0);
+            doc_paragraph(doc, "ImageCaption", NULL, caption);
+            style = NULL;
+        }
+        else if (p->first_para)
+            style = "FirstParagraph";
+        break;
+    case PARA_LIST_ITEM:
+        style = "Compact";
+        snprintf(props, sizeof(props), "<w:numPr><w:ilvl w:val=\"%d\"/><w:numId w:val=\"%d\"/></w:numPr>",
+                 p->para_level, p->para_num);
+        break;
+    case PARA_LIST_CONT:
+        snprintf(props, sizeof(props), "<w:ind w:left=\"%d\"/>", 720 * (p->para_level + 1));
+        break;
+    case PARA_QUOTE:
+        style = "BlockText";
+        break;
+    }
+    if (style)
+        doc_paragraph(doc, style, props, inlines);
+    arena_release(mark);
+
+    p->first_para = 0;
+    p->para_kind = PARA_NONE;
+    p->para.len = 0;
+    if (p->para.data)
+        p->para.data[0] = '\0';
+    p->para_lines = 0;
+}
+
+static void md_para_append(MdParser *p, int kind, const char *text, size_t len)
+{
+    if (p->para_kind != PARA_NONE && p->para_kind != kind && kind != PARA_TEXT)
+        md_flush_para(p);
+    if (p->para_kind == PARA_NONE)
+        p->para_kind = kind;
+    if (p->para_lines++ > 0)
+        buf_append(&p->para, "\n", 1);
+    buf_append(&p->para, text, len);
+}
+
+static void md_end_table(MdParser *p)
+{
+    if (p->table_cols)
+    {
+        doc_table_end(p->doc);
+        p->table_cols = 0;
+        p->first_para = 0;
+    }
+}
+
+// 判断列表标记：返回标记后内容的起始位置，0 表示不是列表项
+static size_t list_marker(const char *s, size_t len, int *ordered, int *number)
+{
+    if (len >= 2 && (s[0] == '-' || s[0] == '*' || s[0] == '+') && (s[1] == ' ' || s[1] == '\t'))
+    {
+        *ordered = 0;
+        return 2;
+    }
+    size_t i = 0;
+    int n = 0;
+    while (i < len && i < 9 && isdigit((unsigned char)s[i]))
+        n = n * 10 + (s[i++] - '0');
+    if (i > 0 && i + 1 < len && (s[i] == '.' || s[i] == ')') && (s[i + 1] == ' ' || s[i + 1] == '\t'))
+    {
+        *ordered = 1;
+        *number = n;
+        return i + 2;
+    }
+    return 0;
+}
+
+static void md_feed_line(MdParser *p, const char *line, size_t len)
+{
+    DocWriter *doc = p->doc;
+    if (doc->fallback)
+        return;
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+    p->line_no++;
+    if (p->line_no == 1 && len >= 3 && memcmp(line, "\xEF\xBB\xBF", 3) == 0)
+    {
+        line += 3;
+        len -= 3;
+    }
+    if (p->line_no == 1 && ((len == 3 && memcmp(line, "---", 3) == 0) || (len > 0 && line[0] == '%')))
+    {
+        doc_fallback(doc, "metadata block");
+        return;
+    }
+
+    size_t pos;
+    size_t indent = line_indent(line, len, &pos);
+    const char *s = line + pos;
+    size_t n = len - pos;
+
+    // 代码块内部
+    if (p->code_fence)
+    {
+        size_t k = 0;
+        while (k < n && s[k] == p->code_fence)
+            k++;
+        if (k >= p->code_fence_len && is_blank(s + k, n - k))
+        {
+            doc_code_end(doc);
+            p->code_fence = 0;
+            return;
+        }
+        size_t skip = skip_columns(line, len, p->code_indent);
+        doc_code_line(doc, line + skip, len - skip, p->code_lines++ == 0);
+        return;
+    }
+    if (p->code_indented)
+    {
+        if (indent >= 4)
+        {
+            size_t skip = skip_columns(line, len, 4);
+            doc_code_line(doc, line + skip, len - skip, p->code_lines++ == 0);
+            return;
+        }
+        doc_code_end(doc);
+        p->code_indented = 0;
+    }
+
+    // 表格行
+    if (p->table_cols)
+    {
+        if (n > 0 && memchr(s, '|', n))
+        {
+            Slice cells[MAX_TABLE_COLS];
+            int count = split_row(s, n, cells, MAX_TABLE_COLS);
+            doc_table_row(doc, cells, count, p->table_cols, p->table_aligns, 0);
+            return;
+        }
+        md_end_table(p);
+    }
+
+    if (n == 0)
+    {
+        md_flush_para(p);
+        p->blank = 1;
+        return;
+    }
+
+    int blank_before = p->blank;
+    p->blank = 0;
+    size_t content_indent = p->list_depth ? p->lists[p->list_depth - 1].content : 0;
+
+    // 围栏代码块
+    if (indent < content_indent + 4 && n >= 3 && (s[0] == '`' || s[0] == '~'))
+    {
+        size_t k = 0;
+        while (k < n && s[k] == s[0])
+            k++;
+        if (k >= 3 && (s[0] == '~' || !memchr(s + k, '`', n - k)))
+        {
+            md_flush_para(p);
+            p->code_fence = s[0];
+            p->code_fence_len = k;
+            p->code_indent = indent;
+            p->code_lines = 0;
+            p->first_para = 0;
+            doc_code_begin(doc);
+            return;
+        }
+    }
+
+    // 缩进代码块（不在段落和列表中）
+    if (indent >= 4 && p->para_kind == PARA_NONE && p->list_depth == 0)
+    {
+        size_t skip = skip_columns(line, len, 4);
+        p->code_indented = 1;
+        p->code_lines = 1;
+        p->first_para = 0;
+        doc_code_begin(doc);
+        doc_code_line(doc, line + skip, len - skip, 1);
+        return;
+    }
+
+    // ATX 标题
+    if (s[0] == '#' && indent < 4)
+    {
+        size_t level = 0;
+        while (level < n && s[level] == '#')
+            level++;
+        if (level <= 6 && (level == n || s[level] == ' ' || s[level] == '\t'))
+        {
+            md_flush_para(p);
+            p->list_depth = 0;
+            const char *text = s + level;
+            size_t text_len = n - level;
+            while (text_len > 0 && (*text == ' ' || *text == '\t'))
+            {
+                text++;
+                text_len--;
+            }
+            while (text_len > 0 && (text[text_len - 1] == ' ' || text[text_len - 1] == '#'))
+                text_len--;
+            ArenaMark mark = arena_mark();
+            Inline *inlines = parse_inlines(doc, text, text_len, 0);
+            char style[16];
+            snprintf(style, sizeof(style), "Heading%d", (int)level);
+            doc_paragraph(doc, style, NULL, inlines);
+            arena_release(mark);
+            p->first_para = 1;
+            return;
+        }
+    }
+
+    // Setext 标题下划线
+    if (p->para_kind == PARA_TEXT && indent < 4 && (s[0] == '=' || s[0] == '-'))
+    {
+        size_t k = 0;
+        while (k < n && s[k] == s[0])
+            k++;
+        if (is_blank(s + k, n - k))
+        {
+            ArenaMark mark = arena_mark();
+            Inline *inlines = parse_inlines(doc, p->para.data, p->para.len, 0);
+            doc_paragraph(doc, s[0] == '=' ? "Heading1" : "Heading2", NULL, inlines);
+            arena_release(mark);
+            p->para_kind = PARA_NONE;
+            p->para.len = 0;
+            p->para_lines = 0;
+            p->first_para = 1;
+            return;
+        }
+    }
+
+    // 表格：段落只有一行表头，当前行是分隔行
+    if (p->para_kind == PARA_TEXT && p->para_lines == 1 && indent < 4)
+    {
+        int aligns[MAX_TABLE_COLS];
+        int cols = parse_delimiter_row(s, n, aligns);
+        Slice cells[MAX_TABLE_COLS];
+        int count = cols ? split_row(p->para.data, p->para.len, cells, MAX_TABLE_COLS) : 0;
+        if (cols > 0 && count == cols && memchr(p->para.data, '|', p->para.len))
+        {
+            memcpy(p->table_aligns, aligns, sizeof(aligns));
+            p->table_cols = cols;
+            doc_table_begin(doc, cols);
+            doc_table_row(doc, cells, count, cols, aligns, 1);
+            p->para_kind = PARA_NONE;
+            p->para.len = 0;
+            p->para_lines = 0;
+            return;
+        }
+    }
+
+    // 分隔线
+    if (indent < 4 && p->para_kind == PARA_NONE && (s[0] == '-' || s[0] == '*' || s[0] == '_'))
+    {
+        size_t marks = 0, k;
+        for (k = 0; k < n; ++k)
+        {
+            if (s[k] == s[0])
+                marks++;
+            else if (s[k] != ' ' && s[k] != '\t')
+                break;
+        }
+        if (k == n && marks >= 3)
+        {
+            p->list_depth = 0;
+            buf_puts(&doc->xml, "<w:p><w:pPr><w:pBdr><w:bottom w:val=\"single\" w:sz=\"6\" w:space=\"1\" w:color=\"auto\"/></w:pBdr></w:pPr></w:p>");
+            p->first_para = 0;
+            return;
+        }
+    }
+
+    if (indent < 4 && s[0] == '<' && n > 1 && (isalpha((unsigned char)s[1]) || s[1] == '/' || s[1] == '!'))
+    {
+        doc_fallback(doc, "HTML block");
+        return;
+    }
+    if (indent < 4 && s[0] == '[')
+    {
+        size_t close = find_bracket(s, 1, n);
+        if (close != (size_t)-1 && close + 1 < n && s[close + 1] == ':')
+        {
+            doc_fallback(doc, "link reference definition");
+            return;
+        }
+    }
+
+    // 引用块
+    if (indent < 4 && s[0] == '>')
+    {
+        size_t k = 1;
+        if (k < n && s[k] == ' ')
+            k++;
+        if (p->para_kind != PARA_QUOTE)
+            md_flush_para(p);
+        p->list_depth = 0;
+        if (is_blank(s + k, n - k))
+            md_flush_para(p);
+        else
+            md_para_append(p, PARA_QUOTE, s + k, n - k);
+        return;
+    }
+
+    // 列表项
+    int ordered = 0, number = 1;
+    size_t marker = list_marker(s, n, &ordered, &number);
+    // 与 pandoc 一致，列表不能直接打断普通段落，前面需要空行
+    if (marker && p->para_kind != PARA_TEXT && p->para_kind != PARA_QUOTE)
+    {
+        md_flush_para(p);
+        while (p->list_depth > 0 && indent < p->lists[p->list_depth - 1].indent)
+            p->list_depth--;
+        ListLevel *top = p->list_depth ? &p->lists[p->list_depth - 1] : NULL;
+        if (top && indent < top->content && top->ordered == ordered)
+        {
+            // 同一层级的下一项
+        }
+        else if (top && indent < top->content)
+        {
+            // 同一层级换了列表类型，开始新列表
+            top->ordered = ordered;
+            top->num = ordered ? doc_new_list(doc, p->list_depth - 1, number) : 1;
+            top->content = indent + marker;
+        }
+        else if (p->list_depth < MAX_LIST_DEPTH)
+        {
+            ListLevel *lvl = &p->lists[p->list_depth++];
+            lvl->indent = indent;
+            lvl->content = indent + marker;
+            lvl->ordered = ordered;
+            lvl->num = ordered ? doc_new_list(doc, p->list_depth - 1, number) : 1;
+        }
+        top = &p->lists[p->list_depth - 1];
+        p->para_level = p->list_depth - 1;
+        p->para_num = top->num;
+        size_t k = marker;
+        while (k < n && (s[k] == ' ' || s[k] == '\t'))
+            k++;
+        md_para_append(p, PARA_LIST_ITEM, s + k, n - k);
+        p->first_para = 0;
+        return;
+    }
+
+    // 普通文本行
+    if (p->para_kind != PARA_NONE)
+    {
+        md_para_append(p, p->para_kind, s, n);
+        return;
+    }
+    if (p->list_depth > 0 && blank_before)
+    {
+        while (p->list_depth > 0 && indent < p->lists[p->list_depth - 1].content)
+            p->list_depth--;
+        if (p->list_depth > 0)
+        {
+            p->para_level = p->list_depth - 1;
+            md_para_append(p, PARA_LIST_CONT, s, n);
+            return;
+        }
+    }
+    p->list_depth = 0;
+    md_para_append(p, PARA_TEXT, s, n);
+}
+
+static void md_finish(MdParser *p)
+{
+    if (p->code_fence || p->code_indented)
+        doc_code_end(p->doc);
+    p->code_fence = 0;
+    p->code_indented = 0;
+    md_end_table(p);
+    md_flush_para(p);
+}
+
+// 按块读取输入并逐行交给解析器；跨块的行先拼进 carry
+static void native_feed_stream(MdParser *parser, FILE *in)
+{
+    char chunk[65536];
+    Buffer line = {0};
+    size_t n;
+    while (!parser->doc->fallback && (n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+    {
+        size_t start = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (chunk[i] != '\n')
+                continue;
+            if (line.len)
+            {
+                buf_append(&line, chunk + start, i - start);
+                md_feed_line(parser, line.data, line.len);
+                line.len = 0;
+            }
+            else
+            {
+                md_feed_line(parser, chunk + start, i - start);
+            }
+            start = i + 1;
+        }
+        buf_append(&line, chunk + start, n - start);
+    }
+    if (line.len)
+        md_feed_line(parser, line.data, line.len);
+    buf_free(&line);
+}
+
+#ifndef _WIN32
+// 映射整个输入文件，行直接指向映射区。解析器会把需要保留的文本拷进段落缓冲区，
+// 所以已经读过的页可以随时归还，大文件的常驻内存不随输入增长
+static int native_feed_mapped(MdParser *parser, FILE *in)
+{
+    struct stat st;
+    if (fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return -1;
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+    size_t start = 0;
+    while (start < size && !parser->doc->fallback)
+    {
+        const char *nl = memchr(map + start, '\n', size - start);
+        size_t end = nl ? (size_t)(nl - map) : size;
+        md_feed_line(parser, map + start, end - start);
+        start = end + 1;
+        if (start - released >= MMAP_RELEASE_SIZE && start < size)
+        {
+            size_t upto = start / (size_t)page * (size_t)page;
+            madvise(map + released, upto - released, MADV_DONTNEED);
+            released = upto;
+        }
+    }
+    munmap(map, size);
+    return 0;
+}
+#endif
+
+// 把图片文件原样拷入已打开的 ZIP 条目
+static int zip_copy_file(ZipWriter *z, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        zip_data(z, chunk, n);
+    int failed = ferror(fp);
+    fclose(fp);
+    return failed ? -1 : 0;
+}
+
+// 在进程内把 Markdown 转成 DOCX。先写临时文件，成功后改名，回退时不留下残缺输出。
+// document.xml 随解析流式压缩写出，图片、关系和编号等部件在其后追加
+static int native_convert_via(const char *input_path, const char *output_path, const char *tmp_path,
+                              const char *dir_path, char *reason, size_t reason_len)
+{
+    FILE *in = fopen(input_path, "rb");
+    if (!in)
+    {
+        snprintf(reason, reason_len, "%s", strerror(errno));
+        return -1;
+    }
+
+    // 每个文件开始时重置本线程的内存池，压缩器状态放在池里跨文件复用
+    arena_reset();
+    DocWriter doc;
+    memset(&doc, 0, sizeof(doc));
+    doc.dir = dir_path;
+    doc.next_rel = 3; // rId1 styles, rId2 numbering
+    doc.zip.deflater = arena_alloc(sizeof(Deflater));
+    doc.zip.fp = fopen(tmp_path, "wb");
+    if (!doc.zip.fp)
+    {
+        snprintf(reason, reason_len, "%s", strerror(errno));
+        fclose(in);
+        return -1;
+    }
+    zip_add(&doc.zip, "[Content_Types].xml", DOCX_CONTENT_TYPES, sizeof(DOCX_CONTENT_TYPES) - 1);
+    zip_add(&doc.zip, "_rels/.rels", DOCX_PACKAGE_RELS, sizeof(DOCX_PACKAGE_RELS) - 1);
+    zip_begin(&doc.zip, "word/document.xml", 8);
+    doc.xml.sink = &doc.zip;
+    buf_puts(&doc.xml, DOCX_DOCUMENT_HEAD);
+
+    MdParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.doc = &doc;
+    parser.first_para = 1;
+
+#ifndef _WIN32
+    if (native_feed_mapped(&parser, in) != 0)
+#endif
+        native_feed_stream(&parser, in);
+    md_finish(&parser);
+    fclose(in);
+    buf_free(&parser.para);
+
+    buf_puts(&doc.xml, DOCX_DOCUMENT_TAIL);
+    buf_flush(&doc.xml);
+    zip_end(&doc.zip);
+
+    for (int i = 0; i < doc.image_count && !doc.fallback; ++i)
+    {
+        char name[64];
+        const Media *m = doc.images[i].media;
+        snprintf(name, sizeof(name), "word/media/image%d.%s", i + 1, m->ext);
+        if (m->data)
+        {
+            zip_add_stored(&doc.zip, name, m->data, m->size, m->crc);
+            continue;
+        }
+        zip_begin(&doc.zip, name, 0);
+        if (zip_copy_file(&doc.zip, m->source) != 0)
+            doc_fallback(&doc, "unreadable image");
+        zip_end(&doc.zip);
+    }
+
+    if (doc.xml.failed || doc.rels.failed)
+        doc_fallback(&doc, "out of memory");
+    if (!doc.fallback)
+    {
+        zip_begin(&doc.zip, "word/_rels/document.xml.rels", 8);
+        zip_data(&doc.zip, DOCX_DOCUMENT_RELS_HEAD, sizeof(DOCX_DOCUMENT_RELS_HEAD) - 1);
+        zip_data(&doc.zip, doc.rels.data, doc.rels.len);
+        zip_data(&doc.zip, "</Relationships>", 16);
+        zip_end(&doc.zip);
+        zip_add(&doc.zip, "word/styles.xml", DOCX_STYLES, sizeof(DOCX_STYLES) - 1);
+
+        // 编号定义同样经由流式缓冲区写出，列表很多时也不整块拼接
+        Buffer numbering = {0};
+        numbering.sink = &doc.zip;
+        zip_begin(&doc.zip, "word/numbering.xml", 8);
+        buf_puts(&numbering, DOCX_NUMBERING_HEAD);
+        for (int i = 0; i < doc.list_count; ++i)
+            buf_printf(&numbering, "<w:num w:numId=\"%d\"><w:abstractNumId w:val=\"1\"/>"
+                                   "<w:lvlOverride w:ilvl=\"%d\"><w:startOverride w:val=\"%d\"/></w:lvlOverride></w:num>",
+                       2 + i, doc.lists[i].level, doc.lists[i].start);
+        buf_puts(&numbering, "</w:numbering>");
+        buf_flush(&numbering);
+        zip_end(&doc.zip);
+        if (numbering.failed)
+            doc_fallback(&doc, "out of memory");
+        buf_free(&numbering);
+    }
+    int zip_failed = zip_finish(&doc.zip) != 0;
+    if (fclose(doc.zip.fp) != 0)
+        zip_failed = 1;
+
+    buf_free(&doc.xml);
+    buf_free(&doc.rels);
+    free(doc.rel_slots);
+    for (int i = 0; i < doc.image_count; ++i)
+    {
+        media_release(doc.images[i].media);
+        free(doc.images[i].path);
+    }
+    free(doc.images);
+    free(doc.lists);
+
+    if (doc.fallback)
+    {
+        remove(tmp_path);
+        snprintf(reason, reason_len, "%s", doc.reason);
+        return NATIVE_FALLBACK;
+    }
+    if (zip_failed)
+    {
+        remove(tmp_path);
+        snprintf(reason, reason_len, "write error");
+        return -1;
+    }
+#ifdef _WIN32
+    remove(output_path);
+#endif
+    if (rename(tmp_path, output_path) != 0)
+    {
+        snprintf(reason, reason_len, "%s", strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int native_convert(const char *input_path, const char *output_path, const char *dir_path,
+                   char *reason, size_t reason_len)
+{
+    size_t tmp_len = strlen(output_path) + sizeof(".md2doc-tmp");
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path)
+    {
+        snprintf(reason, reason_len, "out of memory");
+        return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.md2doc-tmp", output_path);
+    int ret = native_convert_via(input_path, output_path, tmp_path, dir_path, reason, reason_len);
+    free(tmp_path);
+    return ret;
 }
 
 void print_help()
 {
     printf("Markdown to Word Converter\n");
-    printf("Usage: md2word <input_path> [pandoc_options...]\n\n");
+    printf("Usage: md2word [options] <input_path> [pandoc_options...]\n\n");
+    printf("Options:\n");
+    printf("  -j N            Run N pandoc jobs in parallel (default: number of online CPUs)\n");
+    printf("  -r, --recursive Also convert Markdown files in subdirectories\n");
+    printf("  --exclude=GLOB  Skip files/directories matching GLOB (repeatable)\n");
+    printf("  --symlinks=skip|files|follow\n");
+    printf("                  Symlink policy while walking directories (default: skip)\n");
+    printf("  --engine=native Convert in-process without pandoc (falls back to pandoc for\n");
+    printf("                  math, HTML, footnotes or when pandoc options are given)\n");
+    printf("  --timeout=SEC   Kill a pandoc job that runs longer than SEC seconds\n");
+    printf("  --force         Reconvert every file, ignoring the %s manifest\n", CACHE_FILE_NAME);
+    printf("  --report=json   Write per-file timings and run percentiles to %s\n", REPORT_FILE_NAME);
+    printf("  --report-out=FILE\n");
+    printf("                  Write the JSON report to FILE instead\n");
+    printf("  --watch         Keep running and reconvert files as they change (Linux only)\n");
+    printf("  --debounce=MS   Quiet period after the last change before converting (default: %d)\n", WATCH_DEBOUNCE_MS);
+    printf("  -h, --help      Show this help\n\n");
     printf("Arguments:\n");
     printf("  <input_path>    Absolute or relative path to a Markdown file/directory\n");
     printf("  [pandoc_options] Optional Pandoc options (e.g., --toc, -s, --reference-doc)\n\n");
     printf("Examples:\n");
     printf("  Convert a file: md2word ~/doc.md --toc\n");
     printf("  Convert a directory: md2word ./notes --reference-doc template.docx\n");
+    printf("  Use 4 workers: md2word -j 4 ./notes --toc\n");
+    printf("  Whole tree: md2word -r --exclude=node_modules --exclude='draft-*' ./notes\n");
+    printf("  Watch a tree: md2word --watch -r ./notes\n");
     printf("\nNote: Always uses absolute paths internally for reliability\n");
 }
\ No newline at end of file
@@ -0,0 +1,545 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+int main(void)
+{
+    fprintf(stderr, "md2doc_bench needs a POSIX system (fork/exec, symlinks)\n");
+    return EXIT_FAILURE;
+}
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// md2doc 基准测试：生成几种形态的合成 Markdown 语料，分别用可调延迟的假 pandoc
+// 和内置引擎运行 md2doc，报告各并发度下的 files/s、MB/s 以及相对 -j 1 的加速比。
+// 本程序同时充当假 pandoc：以 pandoc 为名（符号链接）启动时只把输入拷到 -o 指定
+// 的输出并按 MD2DOC_BENCH_LATENCY_MS 休眠，不需要机器上装有 pandoc。
+
+#define MAX_PATH_LEN 1024
+#define MAX_JOBS_STEPS 16
+#define LATENCY_ENV "MD2DOC_BENCH_LATENCY_MS"
+
+typedef struct
+{
+    const char *name;
+    int files;       // 生成的文件数
+    long long bytes; // 生成的总字节数
+} Corpus;
+
+static struct
+{
+    const char *md2doc;
+    int latency_ms;
+    double scale;
+    int jobs[MAX_JOBS_STEPS];
+    int job_count;
+    int native;
+    int stub;
+    int keep;
+    const char *shape;
+    char work[MAX_PATH_LEN / 2];
+} bench = {"./md2doc", 20, 1.0, {0}, 0, 1, 1, 0, "all", ""};
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64，固定种子保证每次生成的语料相同
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 16);
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// ---- 假 pandoc ----
+
+static int run_stub(int argc, char *argv[])
+{
+    const char *input = NULL, *output = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (argv[i][0] != '-' && !input)
+            input = argv[i];
+    }
+    if (!input || !output)
+    {
+        fprintf(stderr, "pandoc stub: missing input or -o\n");
+        return 2;
+    }
+
+    const char *latency = getenv(LATENCY_ENV);
+    int ms = latency ? atoi(latency) : 0;
+    if (ms > 0)
+    {
+        struct timespec pause = {ms / 1000, (ms % 1000) * 1000000L};
+        while (nanosleep(&pause, &pause) != 0 && errno == EINTR)
+            ;
+    }
+
+    FILE *in = fopen(input, "rb");
+    FILE *out = in ? fopen(output, "wb") : NULL;
+    if (!in || !out)
+    {
+        fprintf(stderr, "pandoc stub: %s\n", strerror(errno));
+        if (in)
+            fclose(in);
+        return 1;
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(in);
+    return fclose(out) == 0 ? 0 : 1;
+}
+
+// ---- 语料生成 ----
+
+static const char *words[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "theta", "kernel",
+                              "thread", "queue", "cache", "buffer", "stream", "latency", "scheduler", "page"};
+
+static long long write_words(FILE *fp, int count)
+{
+    long long n = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const char *w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+        switch (rng() % 16)
+        {
+        case 0: n += fprintf(fp, "**%s** ", w); break;
+        case 1: n += fprintf(fp, "*%s* ", w); break;
+        case 2: n += fprintf(fp, "`%s()` ", w); break;
+        case 3: n += fprintf(fp, "[%s](https://example.com/%s) ", w, w); break;
+        default: n += fprintf(fp, "%s ", w); break;
+        }
+    }
+    n += fprintf(fp, "\n\n");
+    return n;
+}
+
+// 生成约 target 字节的文档，混合标题、段落、列表、代码块和表格
+static long long write_document(const char *path, long long target)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    long long n = fprintf(fp, "# Document %u\n\n", rng() % 100000);
+    while (n < target)
+    {
+        switch (rng() % 10)
+        {
+        case 0:
+            n += fprintf(fp, "## Section %u\n\n", rng() % 1000);
+            break;
+        case 1:
+            for (int i = 0; i < 4; ++i)
+                n += fprintf(fp, "- item %d %s\n", i, words[rng() % 16]);
+            n += fprintf(fp, "\n");
+            break;
+        case 2:
+            n += fprintf(fp, "```c\nint %s(void)\n{\n    return %u;\n}\n```\n\n", words[rng() % 16], rng() % 100);
+            break;
+        case 3:
+            n += fprintf(fp, "| name | value |\n|:-----|------:|\n| %s | %u |\n| %s | %u |\n\n",
+                         words[rng() % 16], rng() % 1000, words[rng() % 16], rng() % 1000);
+            break;
+        default:
+            n += write_words(fp, 30 + (int)(rng() % 40));
+            break;
+        }
+    }
+    if (fclose(fp) != 0)
+        return -1;
+    return n;
+}
+
+static int make_dir(const char *path)
+{
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// 大量小文件：考察遍历、调度和每个任务的启动开销
+static int gen_tiny(Corpus *c, const char *dir)
+{
+    int count = (int)(2000 * bench.scale);
+    for (int i = 0; i < count; ++i)
+    {
+        char path[MAX_PATH_LEN + 32];
+        snprintf(path, sizeof(path), "%s/note%05d.md", dir, i);
+        long long n = write_document(path, 512 + rng() % 1536);
+        if (n < 0)
+            return -1;
+        c->files++;
+        c->bytes += n;
+    }
+    return 0;
+}
+
+// 少量大文件：考察单个转换的吞吐量和内存
+static int gen_huge(Corpus *c, const char *dir)
+{
+    long long size = (long long)(16LL * 1024 * 1024 * bench.scale);
+    for (int i = 0; i < 4; ++i)
+    {
+        char path[MAX_PATH_LEN + 32];
+        snprintf(path, sizeof(path), "%s/book%d.md", dir, i);
+        long long n = write_document(path, size);
+        if (n < 0)
+            return -1;
+        c->files++;
+        c->bytes += n;
+    }
+    return 0;
+}
+
+// 深层目录树：考察递归遍历
+static int gen_deep(Corpus *c, const char *dir, int depth)
+{
+    int files = bench.scale >= 1 ? (int)(4 * bench.scale) : 4;
+    for (int i = 0; i < files; ++i)
+    {
+        char path[MAX_PATH_LEN + 32];
+        snprintf(path, sizeof(path), "%s/page%d.md", dir, i);
+        long long n = write_document(path, 1024 + rng() % 4096);
+        if (n < 0)
+            return -1;
+        c->files++;
+        c->bytes += n;
+    }
+    if (depth == 0)
+        return 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        char sub[MAX_PATH_LEN];
+        if (snprintf(sub, sizeof(sub), "%s/d%d", dir, i) >= (int)sizeof(sub))
+            return -1;
+        if (make_dir(sub) != 0 || gen_deep(c, sub, depth - 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// ---- 运行 ----
+
+// 运行一次 md2doc，返回墙钟秒数，失败返回负数
+static double run_md2doc(const char *dir, int jobs, int native, int force)
+{
+    char jobs_arg[32];
+    snprintf(jobs_arg, sizeof(jobs_arg), "-j%d", jobs);
+    char *args[8];
+    int n = 0;
+    args[n++] = (char *)bench.md2doc;
+    args[n++] = "-r";
+    args[n++] = jobs_arg;
+    if (force)
+        args[n++] = "--force";
+    if (native)
+        args[n++] = "--engine=native";
+    args[n++] = (char *)dir;
+    args[n] = NULL;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+        execv(bench.md2doc, args);
+        fprintf(stderr, "Cannot run %s: %s\n", bench.md2doc, strerror(errno));
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return -1;
+    double seconds = elapsed_since(&start);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "md2doc exited with status %d on %s\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1, dir);
+        return -1;
+    }
+    return seconds;
+}
+
+static void print_row(const Corpus *c, const char *engine, int jobs, double seconds, double base)
+{
+    double mb = (double)c->bytes / (1024.0 * 1024.0);
+    printf("%-6s %-8s %4d %8d %9.1f %9.3f %10.1f %9.2f %8.2fx\n", c->name, engine, jobs, c->files, mb,
+           seconds, c->files / seconds, mb / seconds, base > 0 ? base / seconds : 1.0);
+    fflush(stdout);
+}
+
+static int bench_corpus(Corpus *c, const char *dir)
+{
+    if (bench.stub)
+    {
+        double base = 0;
+        for (int i = 0; i < bench.job_count; ++i)
+        {
+            double s = run_md2doc(dir, bench.jobs[i], 0, 1);
+            if (s < 0)
+                return -1;
+            if (i == 0)
+                base = s;
+            print_row(c, "stub", bench.jobs[i], s, base);
+        }
+    }
+    if (bench.native)
+    {
+        double base = 0;
+        for (int i = 0; i < bench.job_count; ++i)
+        {
+            double s = run_md2doc(dir, bench.jobs[i], 1, 1);
+            if (s < 0)
+                return -1;
+            if (i == 0)
+                base = s;
+            print_row(c, "native", bench.jobs[i], s, base);
+        }
+    }
+    // 全部命中缓存的空跑：只剩遍历和清单检查的开销。引擎是缓存键的一部分，
+    // 须与上一轮相同
+    int jobs = bench.jobs[bench.job_count - 1];
+    double s = run_md2doc(dir, jobs, bench.native, 0);
+    if (s < 0)
+        return -1;
+    print_row(c, "noop", jobs, s, 0);
+    return 0;
+}
+
+static void remove_tree(const char *path)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execlp("rm", "rm", "-rf", "--", path, (char *)NULL);
+        _exit(127);
+    }
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+// 在工作目录下放一个指向本程序的 pandoc 链接，并把它放到 PATH 最前面
+static int install_stub(const char *self)
+{
+    char exe[PATH_MAX];
+    if (!realpath(self, exe))
+    {
+        perror("Cannot resolve benchmark executable");
+        return -1;
+    }
+    char bin[MAX_PATH_LEN + 8], link_path[MAX_PATH_LEN + 16];
+    snprintf(bin, sizeof(bin), "%s/bin", bench.work);
+    snprintf(link_path, sizeof(link_path), "%s/pandoc", bin);
+    if (make_dir(bin) != 0 || symlink(exe, link_path) != 0)
+    {
+        perror("Cannot install pandoc stub");
+        return -1;
+    }
+
+    const char *old_path = getenv("PATH");
+    size_t len = strlen(bin) + (old_path ? strlen(old_path) : 0) + 2;
+    char *path = malloc(len);
+    if (!path)
+        return -1;
+    snprintf(path, len, "%s:%s", bin, old_path ? old_path : "");
+    setenv("PATH", path, 1);
+    free(path);
+
+    char latency[16];
+    snprintf(latency, sizeof(latency), "%d", bench.latency_ms);
+    setenv(LATENCY_ENV, latency, 1);
+    return 0;
+}
+
+static int parse_jobs(const char *list)
+{
+    bench.job_count = 0;
+    while (*list && bench.job_count < MAX_JOBS_STEPS)
+    {
+        char *end;
+        long j = strtol(list, &end, 10);
+        if (end == list || j < 1)
+            return -1;
+        bench.jobs[bench.job_count++] = (int)j;
+        list = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            return -1;
+    }
+    return bench.job_count > 0 ? 0 : -1;
+}
+
+static void print_help(void)
+{
+    printf("md2doc benchmark\n");
+    printf("Usage: md2doc_bench [options]\n\n");
+    printf("Options:\n");
+    printf("  --md2doc=PATH     md2doc binary to benchmark (default: ./md2doc)\n");
+    printf("  --shape=NAME      tiny, huge, deep or all (default: all)\n");
+    printf("  --scale=X         Multiply corpus sizes by X (default: 1.0)\n");
+    printf("  --latency=MS      Latency of the fake pandoc per file (default: 20)\n");
+    printf("  --jobs=LIST       Comma-separated -j values (default: 1,2,4,... up to CPUs)\n");
+    printf("  --engine=BOTH     stub, native or both (default: both)\n");
+    printf("  --keep            Keep the generated corpus and outputs\n");
+    printf("  -h, --help        Show this help\n\n");
+    printf("Columns: corpus, engine, -j, files, input MB, seconds, files/s, MB/s and speedup over\n");
+    printf("the first -j value. The noop row reruns without --force, so every file is a cache hit.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *base = strrchr(argv[0], '/');
+    if (strcmp(base ? base + 1 : argv[0], "pandoc") == 0)
+        return run_stub(argc, argv);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
+        {
+            print_help();
+            return EXIT_SUCCESS;
+        }
+        else if (strncmp(arg, "--md2doc=", 9) == 0)
+            bench.md2doc = arg + 9;
+        else if (strncmp(arg, "--shape=", 8) == 0)
+        {
+            bench.shape = arg + 8;
+            if (strcmp(bench.shape, "tiny") != 0 && strcmp(bench.shape, "huge") != 0 &&
+                strcmp(bench.shape, "deep") != 0 && strcmp(bench.shape, "all") != 0)
+            {
+                fprintf(stderr, "Unknown shape: %s\n\n", bench.shape);
+                print_help();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--scale=", 8) == 0)
+            bench.scale = atof(arg + 8);
+        else if (strncmp(arg, "--latency=", 10) == 0)
+            bench.latency_ms = atoi(arg + 10);
+        else if (strncmp(arg, "--jobs=", 7) == 0)
+        {
+            if (parse_jobs(arg + 7) != 0)
+            {
+                fprintf(stderr, "Invalid job list: %s\n", arg + 7);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--engine=", 9) == 0)
+        {
+            const char *e = arg + 9;
+            bench.stub = strcmp(e, "stub") == 0 || strcmp(e, "both") == 0;
+            bench.native = strcmp(e, "native") == 0 || strcmp(e, "both") == 0;
+            if (!bench.stub && !bench.native)
+            {
+                fprintf(stderr, "Unknown engine: %s\n", e);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(arg, "--keep") == 0)
+            bench.keep = 1;
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\nUse -h for help.\n", arg);
+            return EXIT_FAILURE;
+        }
+    }
+    if (bench.scale <= 0 || bench.latency_ms < 0)
+    {
+        fprintf(stderr, "Invalid --scale or --latency\n");
+        return EXIT_FAILURE;
+    }
+    if (access(bench.md2doc, X_OK) != 0)
+    {
+        fprintf(stderr, "md2doc binary not found: %s (use --md2doc=PATH)\n", bench.md2doc);
+        return EXIT_FAILURE;
+    }
+    if (bench.job_count == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int j = 1; bench.job_count < MAX_JOBS_STEPS; j *= 2)
+        {
+            bench.jobs[bench.job_count++] = j < cpus ? j : (int)(cpus > 0 ? cpus : 1);
+            if (j >= cpus)
+                break;
+        }
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    snprintf(bench.work, sizeof(bench.work), "%s/md2doc-bench-XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(bench.work))
+    {
+        perror("Cannot create work directory");
+        return EXIT_FAILURE;
+    }
+    if (bench.stub && install_stub(argv[0]) != 0)
+    {
+        remove_tree(bench.work);
+        return EXIT_FAILURE;
+    }
+
+    static const char *shapes[] = {"tiny", "huge", "deep"};
+    int ret = EXIT_SUCCESS;
+    printf("work dir %s, fake pandoc latency %d ms\n\n", bench.work, bench.latency_ms);
+    printf("%-6s %-8s %4s %8s %9s %9s %10s %9s %9s\n", "corpus", "engine", "-j", "files", "MB", "seconds",
+           "files/s", "MB/s", "speedup");
+    for (int s = 0; s < 3 && ret == EXIT_SUCCESS; ++s)
+    {
+        if (strcmp(bench.shape, "all") != 0 && strcmp(bench.shape, shapes[s]) != 0)
+            continue;
+        Corpus c = {shapes[s], 0, 0};
+        char dir[MAX_PATH_LEN];
+        snprintf(dir, sizeof(dir), "%s/%s", bench.work, shapes[s]);
+        int gen = make_dir(dir);
+        if (gen == 0)
+        {
+            if (s == 0)
+                gen = gen_tiny(&c, dir);
+            else if (s == 1)
+                gen = gen_huge(&c, dir);
+            else
+                gen = gen_deep(&c, dir, 5);
+        }
+        if (gen != 0 || bench_corpus(&c, dir) != 0)
+            ret = EXIT_FAILURE;
+    }
+
+    if (bench.keep)
+        printf("\nKept %s\n", bench.work);
+    else
+        remove_tree(bench.work);
+    return ret;
+}
+#endif
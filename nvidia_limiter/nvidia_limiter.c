@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // struct ucred
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,39 +12,156 @@
     #define NVIDIA_SMI "nvidia-smi.exe"
     #define POPEN _popen
     #define PCLOSE _pclose
+    #include <windows.h>
 #else
     #define NVIDIA_SMI "sudo nvidia-smi"
     #define POPEN popen
     #define PCLOSE pclose
+    #define SOCKET_NAME "nvidia_limiter.sock"  // 守护进程监听的本地套接字，位于 $XDG_RUNTIME_DIR
+    #define SOCKET_DIR "/run/nvidia_limiter"   // 没有 $XDG_RUNTIME_DIR 时使用的私有目录
+    #include <unistd.h>
+    #include <strings.h>
+    #include <errno.h>
+    #include <signal.h>
+    #include <time.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <pthread.h>
 #endif
 
+#define CMD_SIZE 512       // 单条 nvidia-smi 命令的最大长度
+#define MAX_BATCH 8        // 一次批量执行的命令上限
+#define REQUEST_SIZE 256   // 套接字请求的最大长度
+#define REPLY_SIZE 1024
+#define STREAM_BUF_SIZE 16384  // 流式解析的读缓冲区，输出再长也只占这么多
+#define MAX_GPUS 64
+#define DEFAULT_MAX_CORE_CLOCK 1770  // 查不到支持频率时的估计值
+#define DEFAULT_MAX_MEM_CLOCK 1750
+
+// 调速器参数
+#define GOVERN_SAMPLE_MS 500     // 默认采样间隔
+#define GOVERN_MIN_SAMPLE_MS 50
+#define GOVERN_MIN_RATE 30       // 调速器允许压到的最低档位
+#define GOVERN_IDLE_UTIL 10      // 利用率低于此值视为空闲，保持输出不变，避免空闲时积分推到满档
+#define GOVERN_TEMP_W_PER_C 5.0  // 温度误差折算成功耗误差的系数（W/°C）
+#define GOVERN_DEADBAND 2.0      // 低于预算不到这么多档位的余量视为已到位，不再上调
+#define GOVERN_MIN_STEP 2        // 向上调整至少这么多档才下发，避免在相邻档位间来回切换
+#define GOVERN_KP 0.1
+#define GOVERN_KI 0.4            // 每秒
+#define GOVERN_KD 0.002          // 秒
+#define SIM_GPUS 2               // 模拟后端的设备数
+
+// 受支持的显存/核心频率组合（MHz）
+typedef struct {
+    int mem;
+    int graphics;
+} ClockPair;
+
 // 结构体存储显卡信息
 typedef struct {
+    char bus_id[32];    // PCI 总线号，例如 00000000:01:00.0
     int default_power;  // 默认功耗（W）
     int min_power;      // 最小允许功耗
     int max_power;      // 最大允许功耗
-    
+    int power_limit;    // 当前功耗限制
+
     int core_clock;     // 当前核心频率（MHz）
     int max_core_clock; // 最大核心频率
-    
+
     int mem_clock;      // 当前显存频率（MHz）
     int max_mem_clock;  // 最大显存频率
+
+    ClockPair* clocks;  // SUPPORTED_CLOCKS 中的全部组合
+    int clock_count;
+    int clock_cap;
 } GPUInfo;
 
+typedef void (*LineHandler)(const char* line, size_t len, void* ctx);
+
+// 设备的已知状态：守护进程常驻缓存，切换档位时只下发有变化的设置
+typedef struct {
+    GPUInfo info;
+    int power;          // 当前功耗限制（W），-1 表示未知
+    int core;           // 锁定的核心频率，0 表示未锁定，-1 表示未知
+    int mem;            // 锁定的显存频率，0 表示未锁定，-1 表示未知
+    int rate;           // 当前档位，0 表示默认设置，-1 表示未知
+} GPUState;
+
+// 本机全部设备，下标即 nvidia-smi 的设备序号
+typedef struct {
+    GPUState gpus[MAX_GPUS];
+    int count;
+} Fleet;
+
+// 调速器的配置，预算为 0 表示不限制该项
+typedef struct {
+    double power_budget;  // 每个设备的功耗预算（W）
+    double temp_budget;   // 温度预算（°C）
+    int sample_ms;
+    int duration_s;       // 运行时长，0 表示直到收到 SIGINT/SIGTERM
+    int simulate;         // 使用模拟的设备模型代替 nvidia-smi
+} GovernorConfig;
+
+// 一次采样：哪个设备、何时采的、功耗、温度、利用率
+typedef struct {
+    int gpu;
+    double ms;          // 采样时刻（CLOCK_REALTIME 毫秒），由后端给出
+    double power;
+    double temp;
+    double util;
+} Sample;
+
+// 调速器的后端：真实设备通过 nvidia-smi，测试时换成模拟模型
+typedef struct {
+    int (*start)(void* ctx, Fleet* fleet, int sample_ms);
+    int (*sample)(void* ctx, Sample* sample);  // 阻塞到下一条采样，返回 1；结束或被中断返回 0
+    int (*apply)(void* ctx, GPUState* state, int rate, char* report, size_t report_size);
+    void (*stop)(void* ctx);
+} GovernorOps;
+
+// nvidia-smi 的调用方式，-backend 可替换为测试用的替身脚本
+static const char* nvidia_smi = NVIDIA_SMI;
+#ifndef _WIN32
+static const char* socket_path = NULL;  // 未指定 -socket 时由 default_socket_path 决定
+static char socket_path_buf[108];       // sun_path 的长度
+static volatile sig_atomic_t daemon_stop = 0;
+#endif
+
 // 函数声明
 void show_help();
-int execute_command(const char* cmd, char* buf, size_t buf_size);
-int parse_gpu_info(GPUInfo* info);
-int set_power_limit(int target_watt);
-int set_clocks(int core_mhz, int mem_mhz);
-int reset_settings();
+int stream_command(const char* cmd, LineHandler handler, void* ctx);
+int query_gpus(GPUInfo* gpus, int max_gpus);
+int load_fleet(Fleet* fleet);
+void free_fleet(Fleet* fleet);
+void free_gpu_info(GPUInfo* info);
+int select_devices(const char* spec, int count, int* selected);
+void snap_clocks(const GPUInfo* info, int* core, int* mem);
+void compute_targets(const GPUInfo* info, int rate, int* power, int* core, int* mem);
+int run_batch(char cmds[][CMD_SIZE], int count, int* results);
+int apply_rate(GPUState* state, int rate, char* report, size_t report_size);
+int apply_devices(Fleet* fleet, const int* selected, int count, int rate, char* report, size_t report_size);
+#ifndef _WIN32
+const char* default_socket_path();
+int socket_peer_trusted(int fd);
+int daemon_run();
+int client_request(const char* request);
+int governor_run(const GovernorConfig* config, const char* devices);
+#endif
 
 int main(int argc, char *argv[]) {
     int rate = -1;
     int reset_flag = 0;
+    int status_flag = 0;
+    int daemon_flag = 0;
+    const char* devices = "all";  // -i 指定的设备，默认全部
+    int govern_flag = 0;
+    GovernorConfig govern = {0, 0, GOVERN_SAMPLE_MS, 0, 0};
 
     // 参数解析
-    if (argc == 1 || argc > 3) {
+    if (argc == 1) {
         show_help();
         return 1;
     }
@@ -52,6 +172,66 @@ int main(int argc, char *argv[]) {
             return 0;
         } else if (strcmp(argv[i], "-reset") == 0) {
             reset_flag = 1;
+        } else if (strcmp(argv[i], "-status") == 0) {
+            status_flag = 1;
+        } else if (strcmp(argv[i], "-daemon") == 0) {
+            daemon_flag = 1;
+        } else if (strcmp(argv[i], "-govern") == 0) {
+            govern_flag = 1;
+        } else if (strcmp(argv[i], "-simulate") == 0) {
+            govern.simulate = 1;
+        } else if (strcmp(argv[i], "-power-budget") == 0 || strcmp(argv[i], "-temp-budget") == 0) {
+            if (i+1 >= argc || !isdigit(*argv[i+1])) {
+                fprintf(stderr, "错误：需要指定%s参数值\n", argv[i]);
+                return 1;
+            }
+            double value = atof(argv[i+1]);
+            if (argv[i][1] == 'p') govern.power_budget = value;
+            else govern.temp_budget = value;
+            i++;
+        } else if (strcmp(argv[i], "-sample-ms") == 0 || strcmp(argv[i], "-duration") == 0) {
+            if (i+1 >= argc || !isdigit(*argv[i+1])) {
+                fprintf(stderr, "错误：需要指定%s参数值\n", argv[i]);
+                return 1;
+            }
+            int value = atoi(argv[i+1]);
+            if (argv[i][1] == 's') {
+                if (value < GOVERN_MIN_SAMPLE_MS) {
+                    fprintf(stderr, "错误：-sample-ms 不能小于 %d\n", GOVERN_MIN_SAMPLE_MS);
+                    return 1;
+                }
+                govern.sample_ms = value;
+            } else {
+                govern.duration_s = value;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "错误：需要指定-i参数值\n");
+                return 1;
+            }
+            devices = argv[++i];
+            int probe[MAX_GPUS];
+            if (select_devices(devices, MAX_GPUS, probe) < 0) {
+                fprintf(stderr, "错误：-i 参数应为 all 或以逗号分隔的设备序号\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-backend") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "错误：需要指定-backend参数值\n");
+                return 1;
+            }
+            nvidia_smi = argv[++i];
+        } else if (strcmp(argv[i], "-socket") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "错误：需要指定-socket参数值\n");
+                return 1;
+            }
+#ifndef _WIN32
+            socket_path = argv[++i];
+#else
+            i++;
+#endif
         } else if (strcmp(argv[i], "-rate") == 0) {
             if (i+1 >= argc || !isdigit(*argv[i+1])) {
                 fprintf(stderr, "错误：需要指定-rate参数值\n");
@@ -62,123 +242,1107 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "错误：rate参数范围需在50-100之间\n");
                 return 1;
             }
+        } else {
+            fprintf(stderr, "错误：未知参数 %s\n", argv[i]);
+            show_help();
+            return 1;
         }
     }
 
-    // 执行核心逻辑
-    if (reset_flag) {
-        return reset_settings();
-    } else if (rate != -1) {
-        GPUInfo info;
-        if (!parse_gpu_info(&info)) {
-            fprintf(stderr, "错误：无法获取GPU信息\n");
+    if (daemon_flag) {
+#ifdef _WIN32
+        fprintf(stderr, "错误：Windows 暂不支持守护进程模式\n");
+        return 1;
+#else
+        if (!socket_path) socket_path = default_socket_path();
+        return daemon_run();
+#endif
+    }
+
+    if (govern_flag) {
+#ifdef _WIN32
+        fprintf(stderr, "错误：Windows 暂不支持调速器模式\n");
+        return 1;
+#else
+        if (govern.power_budget <= 0 && govern.temp_budget <= 0) {
+            fprintf(stderr, "错误：调速器需要 -power-budget 或 -temp-budget\n");
             return 1;
         }
+        return governor_run(&govern, devices);
+#endif
+    }
 
-        // 计算目标值
-        int target_power = (int)ceil(info.min_power + (info.max_power - info.min_power) * rate / 100.0);
-        int target_core = info.max_core_clock * rate / 100;
-        int target_mem = info.max_mem_clock * rate / 100;
+    // 有守护进程在运行时把请求交给它，省去每次重新查询设备
+    char request[REQUEST_SIZE] = "";
+    if (reset_flag) {
+        snprintf(request, sizeof(request), "reset %s", devices);
+    } else if (rate != -1) {
+        snprintf(request, sizeof(request), "rate %d %s", rate, devices);
+    } else if (status_flag) {
+        snprintf(request, sizeof(request), "status %s", devices);
+    }
+#ifndef _WIN32
+    if (!socket_path) socket_path = default_socket_path();
+    if (request[0]) {
+        int ret = client_request(request);
+        if (ret >= 0) return ret;
+    }
+#endif
+    if (status_flag && !reset_flag && rate == -1) {
+        fprintf(stderr, "错误：守护进程未运行\n");
+        return 1;
+    }
 
-        // 确保目标功耗不低于最小允许功耗
-        if (target_power < info.min_power) {
-            target_power = info.min_power;
+    // 执行核心逻辑
+    if (reset_flag || rate != -1) {
+        static Fleet fleet;
+        if (!load_fleet(&fleet)) {
+            fprintf(stderr, "错误：无法获取GPU信息\n");
+            return 1;
         }
-
-        printf("正在设置：\n  功耗:%dW\n  核心频率:%dMHz\n  显存频率:%dMHz\n",
-               target_power, target_core, target_mem);
-
-        // 应用设置
-        if (set_power_limit(target_power) ||
-            set_clocks(target_core, target_mem)) {
-            // fprintf(stderr, "错误：设置失败\n");
+        int selected[MAX_GPUS];
+        int count = select_devices(devices, fleet.count, selected);
+        if (count <= 0) {
+            fprintf(stderr, "错误：没有符合 -i %s 的设备（共 %d 个）\n", devices, fleet.count);
+            free_fleet(&fleet);
             return 1;
         }
-        return 0;
+
+        static char report[REPLY_SIZE * MAX_GPUS];
+        int failed = apply_devices(&fleet, selected, count, reset_flag ? 0 : rate, report, sizeof(report));
+        printf("%s", report);
+        free_fleet(&fleet);
+        return failed ? 1 : 0;
     }
 
     show_help();
     return 0;
 }
 
-// 执行shell命令并捕获输出
-int execute_command(const char* cmd, char* buf, size_t buf_size) {
+// 逐行流式读取命令输出：固定大小的缓冲区，每行以指针加长度原地交给 handler，
+// 不完整的行挪到缓冲区开头等待下一次读取，输出再大也不会截断
+int stream_command(const char* cmd, LineHandler handler, void* ctx) {
     FILE* fp = POPEN(cmd, "r");
     if (!fp) return -1;
 
-    size_t len = fread(buf, 1, buf_size-1, fp);
-    buf[len] = '\0';
+    char buf[STREAM_BUF_SIZE];
+    size_t have = 0;
+    int skipping = 0;  // 正在丢弃超长行的剩余部分
+    for (;;) {
+        size_t n = fread(buf + have, 1, sizeof(buf) - have, fp);
+        have += n;
+
+        size_t start = 0;
+        char* nl;
+        while ((nl = memchr(buf + start, '\n', have - start)) != NULL) {
+            if (!skipping) handler(buf + start, nl - (buf + start), ctx);
+            skipping = 0;
+            start = nl - buf + 1;
+        }
+        if (n == 0) {
+            if (start < have && !skipping) handler(buf + start, have - start, ctx);
+            break;
+        }
+        if (start == 0 && have == sizeof(buf)) {
+            // 超长的行只处理开头一段，剩余部分直到换行都丢弃，不会被当成新的一行解析
+            if (!skipping) handler(buf, have, ctx);
+            skipping = 1;
+            have = 0;
+            continue;
+        }
+        memmove(buf, buf + start, have - start);
+        have -= start;
+    }
     return PCLOSE(fp);
 }
 
-// 解析nvidia-smi输出获取关键参数
-int parse_gpu_info(GPUInfo* info) {
-    char buf[4096];
-    
+// 解析状态：当前设备、当前小节和当前显存频率
+typedef struct {
+    GPUInfo* gpus;
+    int max_gpus;
+    int count;
+    int current;        // 当前行所属设备，-1 表示还没遇到 "GPU xxxx" 行
+    int section;
+    int mem;            // SUPPORTED_CLOCKS 中最近一个 Memory 行的频率
+} ParseState;
+
+enum { SECTION_OTHER, SECTION_POWER, SECTION_CLOCKS };
+
+// 行的键（去掉缩进和尾部空格）是否等于 key；value 返回冒号后的内容
+static int line_key(const char* line, size_t len, const char* key, const char** value) {
+    const char* colon = memchr(line, ':', len);
+    if (!colon) return 0;
+    const char* p = line;
+    while (p < colon && *p == ' ') p++;
+    const char* end = colon;
+    while (end > p && end[-1] == ' ') end--;
+    size_t key_len = strlen(key);
+    if ((size_t)(end - p) != key_len || memcmp(p, key, key_len) != 0) return 0;
+    *value = colon + 1;
+    return 1;
+}
+
+// 取 "250.00 W"、"1770 MHz" 这类值的整数部分（四舍五入），"N/A" 等返回 -1
+static int line_number(const char* value, const char* line_end) {
+    while (value < line_end && *value == ' ') value++;
+    if (value >= line_end || !isdigit((unsigned char)*value)) return -1;
+    return (int)(strtod(value, NULL) + 0.5);
+}
+
+static void add_clock(GPUInfo* info, int mem, int graphics) {
+    if (info->clock_count == info->clock_cap) {
+        int cap = info->clock_cap ? info->clock_cap * 2 : 64;
+        ClockPair* clocks = realloc(info->clocks, cap * sizeof(ClockPair));
+        if (!clocks) return;
+        info->clocks = clocks;
+        info->clock_cap = cap;
+    }
+    info->clocks[info->clock_count].mem = mem;
+    info->clocks[info->clock_count].graphics = graphics;
+    info->clock_count++;
+    if (mem > info->max_mem_clock) info->max_mem_clock = mem;
+    if (graphics > info->max_core_clock) info->max_core_clock = graphics;
+}
+
+static void parse_line(const char* line, size_t len, void* ctx) {
+    ParseState* ps = ctx;
+    const char* end = line + len;
+    const char* value;
+    size_t indent = 0;
+    while (indent < len && line[indent] == ' ') indent++;
+    if (indent == len) return;
+
+    // 设备行："GPU 00000000:01:00.0"，按总线号找到或新建表项
+    if (indent == 0 && len > 4 && memcmp(line, "GPU ", 4) == 0) {
+        char bus_id[sizeof(ps->gpus[0].bus_id)];
+        size_t n = len - 4 < sizeof(bus_id) - 1 ? len - 4 : sizeof(bus_id) - 1;
+        memcpy(bus_id, line + 4, n);
+        bus_id[n] = '\0';
+        ps->current = -1;
+        for (int i = 0; i < ps->count; i++) {
+            if (strcmp(ps->gpus[i].bus_id, bus_id) == 0) ps->current = i;
+        }
+        if (ps->current < 0 && ps->count < ps->max_gpus) {
+            ps->current = ps->count++;
+            memset(&ps->gpus[ps->current], 0, sizeof(GPUInfo));
+            strcpy(ps->gpus[ps->current].bus_id, bus_id);
+        }
+        ps->section = SECTION_OTHER;
+        return;
+    }
+    if (ps->current < 0) return;
+    GPUInfo* info = &ps->gpus[ps->current];
+
+    // 小节标题：没有冒号的 4 格缩进行。新驱动叫 "GPU Power Readings"，旧驱动叫 "Power Readings"
+    if (indent == 4 && !memchr(line, ':', len)) {
+        const char* title = line + indent;
+        size_t n = len - indent;
+        while (n > 0 && title[n - 1] == ' ') n--;
+        if ((n == 18 && memcmp(title, "GPU Power Readings", 18) == 0) ||
+            (n == 14 && memcmp(title, "Power Readings", 14) == 0)) {
+            ps->section = SECTION_POWER;
+        } else if (n == 16 && memcmp(title, "Supported Clocks", 16) == 0) {
+            ps->section = SECTION_CLOCKS;
+            ps->mem = -1;
+        } else {
+            ps->section = SECTION_OTHER;
+        }
+        return;
+    }
+
+    if (ps->section == SECTION_POWER) {
+        if (line_key(line, len, "Min Power Limit", &value)) info->min_power = line_number(value, end);
+        else if (line_key(line, len, "Max Power Limit", &value)) info->max_power = line_number(value, end);
+        else if (line_key(line, len, "Default Power Limit", &value)) info->default_power = line_number(value, end);
+        else if (line_key(line, len, "Current Power Limit", &value) || line_key(line, len, "Power Limit", &value)) {
+            info->power_limit = line_number(value, end);
+        }
+    } else if (ps->section == SECTION_CLOCKS) {
+        if (line_key(line, len, "Memory", &value)) {
+            ps->mem = line_number(value, end);
+        } else if (line_key(line, len, "Graphics", &value) && ps->mem > 0) {
+            int graphics = line_number(value, end);
+            if (graphics > 0) add_clock(info, ps->mem, graphics);
+        }
+    }
+}
+
+void free_gpu_info(GPUInfo* info) {
+    free(info->clocks);
+    info->clocks = NULL;
+    info->clock_count = info->clock_cap = 0;
+}
+
+// 查询所有设备的功耗范围和受支持的频率组合，返回设备数，失败返回 0
+int query_gpus(GPUInfo* gpus, int max_gpus) {
+    ParseState ps = {gpus, max_gpus, 0, -1, SECTION_OTHER, -1};
+    char cmd[CMD_SIZE];
+
     // 获取功耗信息
-    if (execute_command(NVIDIA_SMI " -q -d POWER", buf, sizeof(buf))) {
+    snprintf(cmd, sizeof(cmd), "%s -q -d POWER", nvidia_smi);
+    if (stream_command(cmd, parse_line, &ps) != 0 || ps.count == 0) {
         return 0;
     }
-    
-    // 解析功耗值（示例正则匹配逻辑）
-    sscanf(buf, "    Min Power Limit : %d W", &info->min_power);
-    sscanf(buf, "    Max Power Limit : %d W", &info->max_power);
-    sscanf(buf, "    Power Limit : %d W", &info->default_power);
 
-    // 获取时钟信息
-    execute_command(NVIDIA_SMI " -q -d SUPPORTED_CLOCKS", buf, sizeof(buf));
-    // 解析最大值（需要实际解析逻辑）
-    info->max_core_clock = 1770;  // 根据实际输出解析
-    info->max_mem_clock = 1750;
+    // 获取时钟信息，按总线号对应到同一设备
+    ps.current = -1;
+    ps.section = SECTION_OTHER;
+    snprintf(cmd, sizeof(cmd), "%s -q -d SUPPORTED_CLOCKS", nvidia_smi);
+    stream_command(cmd, parse_line, &ps);
+
+    for (int i = 0; i < ps.count; i++) {
+        GPUInfo* info = &gpus[i];
+        // 旧驱动没有 Default Power Limit 时，以当前限制作为默认值
+        if (info->default_power <= 0) info->default_power = info->power_limit;
+        // 查不到支持的频率时沿用原来的估计值
+        if (info->max_core_clock <= 0) info->max_core_clock = DEFAULT_MAX_CORE_CLOCK;
+        if (info->max_mem_clock <= 0) info->max_mem_clock = DEFAULT_MAX_MEM_CLOCK;
+    }
+    return ps.count;
+}
+
+// 查询全部设备并以当前功耗限制初始化缓存状态，失败返回 0
+int load_fleet(Fleet* fleet) {
+    GPUInfo infos[MAX_GPUS];
+    fleet->count = query_gpus(infos, MAX_GPUS);
+    for (int i = 0; i < fleet->count; i++) {
+        GPUState* state = &fleet->gpus[i];
+        state->info = infos[i];
+        state->power = infos[i].power_limit;
+        state->core = state->mem = state->rate = -1;
+    }
+    return fleet->count > 0;
+}
+
+void free_fleet(Fleet* fleet) {
+    for (int i = 0; i < fleet->count; i++) free_gpu_info(&fleet->gpus[i].info);
+    fleet->count = 0;
+}
+
+// 解析设备选择："all" 或 "0,2,5" 这样的序号列表，重复的序号只算一次。
+// 返回选中的设备数，格式错误返回 -1，序号超出 count 的不计入
+int select_devices(const char* spec, int count, int* selected) {
+    int n = 0;
+    if (strcmp(spec, "all") == 0) {
+        for (int i = 0; i < count && i < MAX_GPUS; i++) selected[n++] = i;
+        return n;
+    }
+
+    char seen[MAX_GPUS] = {0};
+    const char* p = spec;
+    while (*p) {
+        if (!isdigit((unsigned char)*p)) return -1;
+        char* end;
+        long index = strtol(p, &end, 10);
+        if (*end != ',' && *end != '\0') return -1;
+        if (index >= MAX_GPUS) return -1;
+        if (index < count && !seen[index]) {
+            seen[index] = 1;
+            selected[n++] = (int)index;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+// 把目标频率吸附到设备支持的组合：显存取不低于目标的最低档（没有则取最高档），
+// 核心取该显存档下不低于目标的最低频率（没有则取该档最高频率）。
+// 只向上吸附，实际频率不会低于按比例算出的目标，避免中等档位落到空闲频率
+void snap_clocks(const GPUInfo* info, int* core, int* mem) {
+    if (info->clock_count == 0) return;
+
+    int best_mem = -1, highest_mem = -1;
+    for (int i = 0; i < info->clock_count; i++) {
+        int m = info->clocks[i].mem;
+        if (m >= *mem && (best_mem < 0 || m < best_mem)) best_mem = m;
+        if (m > highest_mem) highest_mem = m;
+    }
+    if (best_mem < 0) best_mem = highest_mem;
+
+    int best_core = -1, highest_core = -1;
+    for (int i = 0; i < info->clock_count; i++) {
+        if (info->clocks[i].mem != best_mem) continue;
+        int g = info->clocks[i].graphics;
+        if (g >= *core && (best_core < 0 || g < best_core)) best_core = g;
+        if (g > highest_core) highest_core = g;
+    }
+    *mem = best_mem;
+    *core = best_core >= 0 ? best_core : highest_core;
+}
+
+// 按性能百分比计算目标功耗和频率
+void compute_targets(const GPUInfo* info, int rate, int* power, int* core, int* mem) {
+    *power = (int)ceil(info->min_power + (info->max_power - info->min_power) * rate / 100.0);
+    *core = info->max_core_clock * rate / 100;
+    *mem = info->max_mem_clock * rate / 100;
+    snap_clocks(info, core, mem);
+
+    // 确保目标功耗不低于最小允许功耗
+    if (*power < info->min_power) {
+        *power = info->min_power;
+    }
+}
+
+double now_ms() {
+#ifdef _WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+// 同时执行一批命令并等待全部结束，results 记录每条命令的退出码，返回失败条数。
+// 各条设置互不依赖，并发执行的总耗时约等于最慢的一条
+int run_batch(char cmds[][CMD_SIZE], int count, int* results) {
+    int failed = 0;
+#ifdef _WIN32
+    for (int i = 0; i < count; i++) {
+        results[i] = system(cmds[i]);
+        if (results[i] != 0) failed++;
+    }
+#else
+    pid_t pids[MAX_BATCH];
+    for (int i = 0; i < count; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            execl("/bin/sh", "sh", "-c", cmds[i], (char*)NULL);
+            _exit(127);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int status = 0;
+        if (pids[i] < 0 || waitpid(pids[i], &status, 0) < 0) {
+            results[i] = -1;
+        } else {
+            results[i] = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        }
+        if (results[i] != 0) failed++;
+    }
+#endif
+    return failed;
+}
+
+// 把设备切换到指定档位（rate 为 0 表示恢复默认），只下发与缓存状态不同的设置，
+// 所有命令作为一批并发执行；结果说明写入 report，返回失败条数
+int apply_rate(GPUState* state, int rate, char* report, size_t report_size) {
+    char cmds[MAX_BATCH][CMD_SIZE];
+    int results[MAX_BATCH];
+    int kinds[MAX_BATCH];   // 0 功耗，1 核心频率，2 显存频率
+    int values[MAX_BATCH];
+    int count = 0;
+    int power, core, mem;
+    const char* bus = state->info.bus_id;  // 按总线号寻址，不受设备序号变化影响
+
+    if (rate > 0) {
+        compute_targets(&state->info, rate, &power, &core, &mem);
+    } else {
+        power = state->info.default_power;
+        core = 0;
+        mem = 0;
+    }
+
+    if (state->power != power) {
+        snprintf(cmds[count], CMD_SIZE, "%s -i %s -pl %d", nvidia_smi, bus, power);
+        kinds[count] = 0;
+        values[count++] = power;
+    }
+    if (state->core != core) {
+        if (core > 0) snprintf(cmds[count], CMD_SIZE, "%s -i %s -lgc %d,%d", nvidia_smi, bus, core, core);
+        else snprintf(cmds[count], CMD_SIZE, "%s -i %s -rgc", nvidia_smi, bus); // 重置核心时钟
+        kinds[count] = 1;
+        values[count++] = core;
+    }
+    if (state->mem != mem) {
+        if (mem > 0) snprintf(cmds[count], CMD_SIZE, "%s -i %s -lmc %d,%d", nvidia_smi, bus, mem, mem);
+        else snprintf(cmds[count], CMD_SIZE, "%s -i %s -rmc", nvidia_smi, bus); // 重置显存时钟
+        kinds[count] = 2;
+        values[count++] = mem;
+    }
+
+    double started = now_ms();
+    int failed = run_batch(cmds, count, results);
+    double elapsed = now_ms() - started;
 
+    size_t used = 0;
+    if (rate > 0) {
+        used += snprintf(report + used, report_size - used, "正在设置：\n  功耗:%dW\n  核心频率:%dMHz\n  显存频率:%dMHz\n",
+                         power, core, mem);
+    } else {
+        used += snprintf(report + used, report_size - used, "正在恢复默认设置：\n  功耗:%dW\n", power);
+    }
+    for (int i = 0; i < count; i++) {
+        if (results[i] == 0) {
+            if (kinds[i] == 0) state->power = values[i];
+            else if (kinds[i] == 1) state->core = values[i];
+            else state->mem = values[i];
+        } else if (used < report_size) {
+            if (kinds[i] == 0) {
+                used += snprintf(report + used, report_size - used, "警告：当前GPU不支持修改功耗限制\n");
+            } else {
+                used += snprintf(report + used, report_size - used, "警告：命令执行失败（%d）：%s\n", results[i], cmds[i]);
+            }
+        }
+    }
+    if (!failed) state->rate = rate;
+    if (used < report_size) {
+        snprintf(report + used, report_size - used, "%s：%d 条命令，耗时 %.0f ms\n",
+                 failed ? "部分失败" : "完成", count, elapsed);
+    }
+    return failed;
+}
+
+typedef struct {
+    GPUState* state;
+    int rate;
+    int failed;
+    char report[REPLY_SIZE];
+} DeviceJob;
+
+#ifndef _WIN32
+static void* device_worker(void* arg) {
+    DeviceJob* job = arg;
+    job->failed = apply_rate(job->state, job->rate, job->report, sizeof(job->report));
+    return NULL;
+}
+#endif
+
+// 对选中的设备同时下发档位，每个设备一个工作线程，总耗时取决于最慢的设备；
+// 各设备的结果按序号依次写入 report，返回失败的设备数
+int apply_devices(Fleet* fleet, const int* selected, int count, int rate, char* report, size_t report_size) {
+    static DeviceJob jobs[MAX_GPUS];
+    double started = now_ms();
+
+    for (int i = 0; i < count; i++) {
+        jobs[i].state = &fleet->gpus[selected[i]];
+        jobs[i].rate = rate;
+        jobs[i].failed = 0;
+        jobs[i].report[0] = '\0';
+    }
+#ifdef _WIN32
+    for (int i = 0; i < count; i++) {
+        jobs[i].failed = apply_rate(jobs[i].state, rate, jobs[i].report, sizeof(jobs[i].report));
+    }
+#else
+    pthread_t threads[MAX_GPUS];
+    int started_ok[MAX_GPUS];
+    for (int i = 0; i < count; i++) {
+        started_ok[i] = pthread_create(&threads[i], NULL, device_worker, &jobs[i]) == 0;
+        if (!started_ok[i]) device_worker(&jobs[i]);  // 线程创建失败就地执行
+    }
+    for (int i = 0; i < count; i++) {
+        if (started_ok[i]) pthread_join(threads[i], NULL);
+    }
+#endif
+    double elapsed = now_ms() - started;
+
+    int failed = 0;
+    size_t used = 0;
+    for (int i = 0; i < count && used < report_size; i++) {
+        if (jobs[i].failed) failed++;
+        used += snprintf(report + used, report_size - used, "GPU %d（%s）：\n%s",
+                         selected[i], jobs[i].state->info.bus_id, jobs[i].report);
+    }
+    if (used < report_size && count > 1) {
+        snprintf(report + used, report_size - used, "共 %d 个设备，失败 %d 个，总耗时 %.0f ms\n",
+                 count, failed, elapsed);
+    }
+    return failed;
+}
+
+#ifndef _WIN32
+void handle_stop(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+// 处理一条请求，回复以 "OK" 或 "ERR" 开头的一行结束。
+// 请求格式为 "命令 [参数] [设备]"，设备为 all 或序号列表，省略时为全部设备
+void handle_request(Fleet* fleet, char* request, char* reply, size_t reply_size) {
+    request[strcspn(request, "\r\n")] = '\0';
+    static char report[REPLY_SIZE * MAX_GPUS];
+
+    char command[16] = "";
+    char arg[REQUEST_SIZE] = "";
+    char spec[REQUEST_SIZE] = "all";
+    int rate = 0;
+    if (strncmp(request, "rate ", 5) == 0) {
+        sscanf(request, "%15s %255s %255s", command, arg, spec);
+        rate = atoi(arg);
+        if (rate < 50 || rate > 100) {
+            snprintf(reply, reply_size, "ERR 错误：rate参数范围需在50-100之间\n");
+            return;
+        }
+    } else {
+        sscanf(request, "%15s %255s", command, spec);
+    }
+
+    if (strcmp(command, "refresh") == 0) {
+        // 设备可能被其他程序改过，重新查询并清空缓存的设置
+        static Fleet fresh;
+        if (!load_fleet(&fresh)) {
+            snprintf(reply, reply_size, "ERR 错误：无法获取GPU信息\n");
+            return;
+        }
+        free_fleet(fleet);
+        *fleet = fresh;
+        snprintf(reply, reply_size, "%d 个设备\nOK\n", fleet->count);
+        return;
+    }
+
+    int selected[MAX_GPUS];
+    int count = select_devices(spec, fleet->count, selected);
+    if (count <= 0) {
+        snprintf(reply, reply_size, "ERR 没有符合 %s 的设备（共 %d 个）\n", spec, fleet->count);
+        return;
+    }
+
+    if (strcmp(command, "rate") == 0 || strcmp(command, "reset") == 0) {
+        int failed = apply_devices(fleet, selected, count, rate, report, sizeof(report));
+        snprintf(reply, reply_size, "%s%s\n", report, failed ? "ERR" : "OK");
+    } else if (strcmp(command, "status") == 0) {
+        size_t used = 0;
+        for (int i = 0; i < count && used < reply_size; i++) {
+            GPUState* state = &fleet->gpus[selected[i]];
+            used += snprintf(reply + used, reply_size - used,
+                             "GPU %d（%s）\n档位：%d\n功耗限制：%dW（范围 %d-%dW，默认 %dW）\n核心频率：%d MHz（最大 %d）\n"
+                             "显存频率：%d MHz（最大 %d）\n支持的频率组合：%d 个\n",
+                             selected[i], state->info.bus_id, state->rate, state->power,
+                             state->info.min_power, state->info.max_power, state->info.default_power,
+                             state->core, state->info.max_core_clock, state->mem, state->info.max_mem_clock,
+                             state->info.clock_count);
+        }
+        if (used < reply_size) snprintf(reply + used, reply_size - used, "OK\n");
+    } else {
+        snprintf(reply, reply_size, "ERR 未知请求：%s\n", request);
+    }
+}
+
+// 默认套接字放在只有本用户可写的目录里：优先 $XDG_RUNTIME_DIR，否则 /run/nvidia_limiter。
+// 不用 /tmp，其他用户无法抢先占用同名套接字
+const char* default_socket_path() {
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && runtime[0] == '/' &&
+        snprintf(socket_path_buf, sizeof(socket_path_buf), "%s/%s", runtime, SOCKET_NAME) < (int)sizeof(socket_path_buf)) {
+        return socket_path_buf;
+    }
+    snprintf(socket_path_buf, sizeof(socket_path_buf), "%s/%s", SOCKET_DIR, SOCKET_NAME);
+    return socket_path_buf;
+}
+
+// 对端必须是本用户或 root，否则不接受它的请求，也不信任它的回复
+int socket_peer_trusted(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return 0;
+    return cred.uid == geteuid() || cred.uid == 0;
+}
+
+// 套接字所在目录必须属于本用户或 root，且其他用户不可写；默认目录不存在时以 0700 创建
+static int prepare_socket_dir() {
+    char dir[sizeof(socket_path_buf)];
+    snprintf(dir, sizeof(dir), "%s", socket_path);
+    char* slash = strrchr(dir, '/');
+    if (!slash) return 1;  // 相对路径，位于当前目录
+    if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+
+    if (strcmp(dir, SOCKET_DIR) == 0 && mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "错误：无法创建 %s：%s\n", dir, strerror(errno));
+        return 0;
+    }
+    struct stat st;
+    if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "错误：%s 不是目录\n", dir);
+        return 0;
+    }
+    if ((st.st_uid != geteuid() && st.st_uid != 0) ||
+        ((st.st_mode & (S_IWGRP | S_IWOTH)) && !(st.st_mode & S_ISVTX))) {
+        fprintf(stderr, "错误：%s 可被其他用户修改，拒绝在其中创建套接字\n", dir);
+        return 0;
+    }
     return 1;
 }
 
+// 守护进程：启动时查询一次设备信息，之后在本地套接字上逐个处理请求
+int daemon_run() {
+    static Fleet fleet;
+    if (!load_fleet(&fleet)) {
+        fprintf(stderr, "错误：无法获取GPU信息\n");
+        return 1;
+    }
 
-// 设置功耗限制
-int set_power_limit(int target_watt) {
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "%s -pl %d", NVIDIA_SMI, target_watt);
-    int result = system(cmd);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "错误：无法创建套接字 %s\n", socket_path);
+        return 1;
+    }
+    if (!prepare_socket_dir()) {
+        close(fd);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
 
-    if (result != 0) {
-        fprintf(stderr, "警告：当前GPU不支持修改功耗限制\n");
+    // 只清理自己留下的旧套接字，别人的文件原样保留并报错
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+            fprintf(stderr, "错误：%s 已存在且不属于本用户\n", socket_path);
+            close(fd);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+    // 套接字创建时即为 0600，不存在其他用户能连接的窗口
+    mode_t old_mask = umask(0177);
+    int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || chmod(socket_path, 0600) < 0 || listen(fd, 8) < 0) {
+        fprintf(stderr, "错误：无法监听 %s：%s\n", socket_path, strerror(errno));
+        close(fd);
         return 1;
     }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    printf("守护进程已启动，%d 个设备，监听 %s\n", fleet.count, socket_path);
+    fflush(stdout);
+
+    while (!daemon_stop) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) <= 0) continue;
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) continue;
+        if (!socket_peer_trusted(client)) {
+            const char* denied = "ERR 拒绝其他用户的请求\n";
+            (void)!write(client, denied, strlen(denied));
+            close(client);
+            continue;
+        }
+
+        // 读一行请求，客户端卡住时最多等一秒
+        char request[REQUEST_SIZE];
+        size_t len = 0;
+        struct pollfd cfd = {client, POLLIN, 0};
+        while (len < sizeof(request) - 1 && poll(&cfd, 1, 1000) > 0) {
+            ssize_t n = read(client, request + len, sizeof(request) - 1 - len);
+            if (n <= 0) break;
+            len += n;
+            if (memchr(request, '\n', len)) break;
+        }
+        request[len] = '\0';
+
+        static char reply[REPLY_SIZE * MAX_GPUS];
+        handle_request(&fleet, request, reply, sizeof(reply));
+        (void)!write(client, reply, strlen(reply));
+        close(client);
+    }
+
+    close(fd);
+    unlink(socket_path);
+    free_fleet(&fleet);
+    printf("守护进程已退出\n");
+    return 0;
+}
+
+// 把请求发给守护进程并打印回复；守护进程未运行时返回 -1，否则返回 0 成功、1 失败
+int client_request(const char* request) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // 套接字必须是本用户或 root 创建的；连上后再核对对端，防止检查后被替换
+    struct stat st;
+    if (lstat(socket_path, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!S_ISSOCK(st.st_mode) || (st.st_uid != geteuid() && st.st_uid != 0)) {
+        fprintf(stderr, "警告：%s 不属于本用户或 root，忽略该守护进程\n", socket_path);
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!socket_peer_trusted(fd)) {
+        fprintf(stderr, "警告：%s 的监听进程不属于本用户或 root，忽略该守护进程\n", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    char line[REQUEST_SIZE + 1];
+    snprintf(line, sizeof(line), "%s\n", request);
+    (void)!write(fd, line, strlen(line));
+
+    // 回复的最后一行是 OK 或 ERR
+    static char reply[REPLY_SIZE * MAX_GPUS];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(reply) - 1 && (n = read(fd, reply + len, sizeof(reply) - 1 - len)) > 0) {
+        len += n;
+    }
+    reply[len] = '\0';
+    close(fd);
+
+    while (len > 0 && reply[len - 1] == '\n') reply[--len] = '\0';
+    char* last = strrchr(reply, '\n');
+    last = last ? last + 1 : reply;
+    int ok = strncmp(last, "OK", 2) == 0;
+    *last = '\0';
+    printf("%s", reply);
+    if (!ok) fprintf(stderr, "%s\n", last[0] ? last : "错误：守护进程没有回复");
+    return ok ? 0 : 1;
+}
+// ---- 调速器 ----
+
+// 调速器使用的时钟：与 nvidia-smi 输出的时间戳同为墙上时间
+static double wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// nvidia-smi 后端：常驻一个 "--query-gpu ... -lms" 进程按间隔输出 CSV，
+// 每次采样只读一行，不必每次重新启动 nvidia-smi
+typedef struct {
+    Fleet* fleet;
+    pid_t pid;
+    int fd;
+    char buf[STREAM_BUF_SIZE];
+    size_t have;
+} SmiGovernor;
+
+static int smi_start(void* ctx, Fleet* fleet, int sample_ms) {
+    SmiGovernor* smi = ctx;
+    if (!load_fleet(fleet)) return 0;
+    smi->fleet = fleet;
+    smi->have = 0;
+
+    char cmd[CMD_SIZE];
+    snprintf(cmd, sizeof(cmd),
+             "exec %s --query-gpu=timestamp,pci.bus_id,power.draw,temperature.gpu,utilization.gpu "
+             "--format=csv,noheader,nounits -lms %d", nvidia_smi, sample_ms);
+    int fds[2];
+    if (pipe(fds) < 0) return 0;
+    smi->pid = fork();
+    if (smi->pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (smi->pid < 0) {
+        close(fds[0]);
+        return 0;
+    }
+    smi->fd = fds[0];
+    return 1;
+}
+
+// 解析一行 "2024/06/05 02:13:44.123, 00000000:01:00.0, 245.31, 78, 100"，
+// 总线号不认识或有 [N/A] 时返回 0。时间戳是 nvidia-smi 采样时的本地时间，
+// 下发设置期间积压在管道里的行读出来时间隔接近 0，只有用它才能算出真实的 dt
+static int smi_parse(SmiGovernor* smi, const char* line, Sample* sample) {
+    char bus_id[32];
+    struct tm tm = {0};
+    double seconds;
+    if (sscanf(line, " %d/%d/%d %d:%d:%lf, %31[^,], %lf, %lf, %lf", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &seconds, bus_id, &sample->power, &sample->temp, &sample->util) != 10) {
+        return 0;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    sample->ms = mktime(&tm) * 1000.0 + seconds * 1000.0;
+    for (int i = 0; i < smi->fleet->count; i++) {
+        if (strcasecmp(smi->fleet->gpus[i].info.bus_id, bus_id) == 0) {
+            sample->gpu = i;
+            return 1;
+        }
+    }
     return 0;
 }
 
-// 设置时钟频率
-int set_clocks(int core_mhz, int mem_mhz) {
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "%s -lgc %d,%d", NVIDIA_SMI, core_mhz, core_mhz);
-    if (system(cmd)) return 1;
-    
-    snprintf(cmd, sizeof(cmd), "%s -lmc %d,%d", NVIDIA_SMI, mem_mhz, mem_mhz);
-    return system(cmd);
+static int smi_sample(void* ctx, Sample* sample) {
+    SmiGovernor* smi = ctx;
+    for (;;) {
+        char* nl = memchr(smi->buf, '\n', smi->have);
+        while (nl) {
+            *nl = '\0';
+            int ok = smi_parse(smi, smi->buf, sample);
+            size_t used = nl - smi->buf + 1;
+            memmove(smi->buf, smi->buf + used, smi->have - used);
+            smi->have -= used;
+            if (ok) return 1;
+            nl = memchr(smi->buf, '\n', smi->have);
+        }
+        if (smi->have == sizeof(smi->buf)) smi->have = 0;  // 超长的行直接丢弃
+
+        ssize_t n = read(smi->fd, smi->buf + smi->have, sizeof(smi->buf) - smi->have);
+        if (n <= 0) return 0;  // nvidia-smi 退出，或者被信号打断
+        smi->have += n;
+    }
 }
 
-// 恢复默认设置
-int reset_settings() {
-    GPUInfo info;
-    if (!parse_gpu_info(&info)) return 1;
+static int smi_apply(void* ctx, GPUState* state, int rate, char* report, size_t report_size) {
+    (void)ctx;
+    return apply_rate(state, rate, report, report_size);
+}
+
+static void smi_stop(void* ctx) {
+    SmiGovernor* smi = ctx;
+    if (smi->pid > 0) {
+        kill(smi->pid, SIGTERM);
+        waitpid(smi->pid, NULL, 0);
+    }
+    close(smi->fd);
+}
+
+// 模拟后端：负载需要的功耗超过限制时被压到限制值，锁定核心频率时按频率比例降低；
+// 温度按一阶模型向 环境温度 + 热阻 × 功耗 靠拢
+typedef struct {
+    double demand;      // 满频运行时想要的功耗（W）
+    double power;
+    double temp;
+} SimDevice;
+
+typedef struct {
+    Fleet* fleet;
+    SimDevice devices[SIM_GPUS];
+    int sample_ms;
+    int next;           // 下一条采样属于哪个设备
+    double round_ms;    // 本轮采样的时刻
+} SimGovernor;
+
+#define SIM_AMBIENT 30.0     // 环境温度（°C）
+#define SIM_THERMAL_R 0.2    // 热阻（°C/W）
+#define SIM_THERMAL_TAU 5.0  // 温度时间常数（秒）
 
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "%s -pl %d", NVIDIA_SMI, info.default_power);
-    system(cmd);
-    system(NVIDIA_SMI " -rgc"); // 重置核心时钟
-    system(NVIDIA_SMI " -rmc"); // 重置显存时钟
+static int sim_start(void* ctx, Fleet* fleet, int sample_ms) {
+    SimGovernor* sim = ctx;
+    sim->fleet = fleet;
+    sim->sample_ms = sample_ms;
+    sim->next = 0;
+    fleet->count = SIM_GPUS;
+    for (int i = 0; i < SIM_GPUS; i++) {
+        GPUState* state = &fleet->gpus[i];
+        memset(&state->info, 0, sizeof(GPUInfo));
+        snprintf(state->info.bus_id, sizeof(state->info.bus_id), "00000000:%02X:00.0", i + 1);
+        state->info.min_power = 100;
+        state->info.max_power = 300;
+        state->info.default_power = state->info.power_limit = 250;
+        state->info.max_core_clock = DEFAULT_MAX_CORE_CLOCK;
+        state->info.max_mem_clock = DEFAULT_MAX_MEM_CLOCK;
+        state->power = 250;
+        state->core = state->mem = 0;
+        state->rate = -1;
+        sim->devices[i].demand = 320 + 40 * i;  // 各设备负载不同
+        sim->devices[i].power = 0;
+        sim->devices[i].temp = SIM_AMBIENT;
+    }
+    return 1;
+}
+
+static int sim_sample(void* ctx, Sample* sample) {
+    SimGovernor* sim = ctx;
+    if (sim->next == 0) {
+        // 每轮开始时推进一个采样间隔
+        struct timespec ts = {sim->sample_ms / 1000, (sim->sample_ms % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+        if (daemon_stop) return 0;
+        sim->round_ms = wall_ms();
+        double dt = sim->sample_ms / 1000.0;
+        for (int i = 0; i < SIM_GPUS; i++) {
+            GPUState* state = &sim->fleet->gpus[i];
+            SimDevice* dev = &sim->devices[i];
+            double scale = state->core > 0 ? (double)state->core / state->info.max_core_clock : 1.0;
+            dev->power = fmin(dev->demand * scale, state->power);
+            dev->temp += (SIM_AMBIENT + SIM_THERMAL_R * dev->power - dev->temp) * fmin(dt / SIM_THERMAL_TAU, 1.0);
+        }
+    }
+    sample->gpu = sim->next;
+    sample->ms = sim->round_ms;
+    sample->power = sim->devices[sim->next].power;
+    sample->temp = sim->devices[sim->next].temp;
+    sample->util = 100;
+    sim->next = (sim->next + 1) % SIM_GPUS;
+    return 1;
+}
+
+// 模拟设备上直接修改状态，不调用 nvidia-smi
+static int sim_apply(void* ctx, GPUState* state, int rate, char* report, size_t report_size) {
+    (void)ctx;
+    if (rate > 0) {
+        compute_targets(&state->info, rate, &state->power, &state->core, &state->mem);
+    } else {
+        state->power = state->info.default_power;
+        state->core = state->mem = 0;
+    }
+    state->rate = rate;
+    snprintf(report, report_size, "模拟设置：功耗 %dW，核心 %d MHz\n", state->power, state->core);
     return 0;
 }
 
+static void sim_stop(void* ctx) {
+    (void)ctx;
+}
+
+// 每个设备的 PID 控制器，输出为连续的档位，下发时取整
+typedef struct {
+    double rate;
+    double error[2];    // 上一次、上上次的误差
+    double last_ms;     // 上一次采样的时刻，0 表示还没有采样
+    double applied_ms;  // 上一次下发设置完成的时刻，此前的采样反映的是旧设置
+} Controller;
+
+// 按预算计算误差（换算成档位单位，正数表示还有余量），取最紧的一项。
+// 余量在死区内时视为 0：已经贴着预算运行，积分不再推高档位
+static double governor_error(const GovernorConfig* config, const GPUInfo* info, const Sample* sample) {
+    double span = info->max_power > info->min_power ? info->max_power - info->min_power : 1;
+    double error = 1e9;
+    if (config->power_budget > 0) {
+        error = fmin(error, (config->power_budget - sample->power) * 100 / span);
+    }
+    if (config->temp_budget > 0) {
+        error = fmin(error, (config->temp_budget - sample->temp) * GOVERN_TEMP_W_PER_C * 100 / span);
+    }
+    if (error >= 0 && error < GOVERN_DEADBAND) error = 0;
+    return error;
+}
+
+// 调速器：持续采样选中设备的功耗、温度和利用率，用增量式 PID 调整档位，
+// 让功耗和温度贴着预算运行；退出时恢复默认设置
+int governor_run(const GovernorConfig* config, const char* devices) {
+    static Fleet fleet;
+    static SmiGovernor smi;
+    static SimGovernor sim;
+    GovernorOps smi_ops = {smi_start, smi_sample, smi_apply, smi_stop};
+    GovernorOps sim_ops = {sim_start, sim_sample, sim_apply, sim_stop};
+    const GovernorOps* ops = config->simulate ? &sim_ops : &smi_ops;
+    void* ctx = config->simulate ? (void*)&sim : (void*)&smi;
+
+    if (!ops->start(ctx, &fleet, config->sample_ms)) {
+        fprintf(stderr, "错误：无法启动采样\n");
+        free_fleet(&fleet);
+        return 1;
+    }
+    int selected[MAX_GPUS];
+    int count = select_devices(devices, fleet.count, selected);
+    if (count <= 0) {
+        fprintf(stderr, "错误：没有符合 -i %s 的设备（共 %d 个）\n", devices, fleet.count);
+        ops->stop(ctx);
+        free_fleet(&fleet);
+        return 1;
+    }
+    char active[MAX_GPUS] = {0};
+    for (int i = 0; i < count; i++) active[selected[i]] = 1;
+
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_stop;  // 不设 SA_RESTART，阻塞的读取会被信号打断
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    static Controller ctl[MAX_GPUS];
+    for (int i = 0; i < fleet.count; i++) {
+        ctl[i].rate = 100;
+        ctl[i].error[0] = ctl[i].error[1] = 0;
+        ctl[i].last_ms = ctl[i].applied_ms = 0;
+    }
+    printf("调速器已启动：%d 个设备，功耗预算 %.0fW，温度预算 %.0f°C，采样间隔 %d ms%s\n",
+           count, config->power_budget, config->temp_budget, config->sample_ms,
+           config->simulate ? "（模拟）" : "");
+    fflush(stdout);
+
+    char report[REPLY_SIZE];
+    double deadline = config->duration_s > 0 ? now_ms() + config->duration_s * 1000.0 : 0;
+    int failed = 0;
+    Sample sample;
+    while (!daemon_stop && (deadline == 0 || now_ms() < deadline) && ops->sample(ctx, &sample)) {
+        if (!active[sample.gpu]) continue;
+        GPUState* state = &fleet.gpus[sample.gpu];
+        Controller* c = &ctl[sample.gpu];
+        // 下发设置期间采到的样本反映的还是旧设置，再拿来修正会重复调整
+        if (sample.ms <= c->applied_ms || sample.ms <= c->last_ms) continue;
+        double error = governor_error(config, &state->info, &sample);
+
+        if (c->last_ms > 0 && sample.util >= GOVERN_IDLE_UTIL) {
+            // 增量式 PID：Δu = Kp·Δe + Ki·e·dt + Kd·Δ²e/dt，输出限幅即可避免积分饱和。
+            // dt 取两次采样各自的时间戳，而不是读到它们的时刻
+            double dt = (sample.ms - c->last_ms) / 1000.0;
+            double delta = GOVERN_KP * (error - c->error[0]) + GOVERN_KI * error * dt
+                         + GOVERN_KD * (error - 2 * c->error[0] + c->error[1]) / dt;
+            c->rate = fmax(GOVERN_MIN_RATE, fmin(100, c->rate + delta));
+        }
+        c->error[1] = c->last_ms > 0 ? c->error[0] : error;
+        c->error[0] = error;
+        c->last_ms = sample.ms;
+
+        // 超预算时任何下调都立即下发；向上只在积累到 GOVERN_MIN_STEP 档后才下发
+        int rate = (int)(c->rate + 0.5);
+        if (state->rate < 0 || rate < state->rate || rate >= state->rate + GOVERN_MIN_STEP) {
+            int ret = ops->apply(ctx, state, rate, report, sizeof(report));
+            c->applied_ms = wall_ms();
+            if (ret) failed++;
+            printf("GPU %d：功耗 %.1fW 温度 %.0f°C 利用率 %.0f%% → 档位 %d（功耗限制 %dW，核心 %d MHz）%s\n",
+                   sample.gpu, sample.power, sample.temp, sample.util, rate, state->power, state->core,
+                   ret ? "，部分设置失败" : "");
+            fflush(stdout);
+        }
+    }
+
+    ops->stop(ctx);
+    // 调速器不再盯着设备时，不留下压低的限制
+    for (int i = 0; i < count; i++) {
+        ops->apply(ctx, &fleet.gpus[selected[i]], 0, report, sizeof(report));
+    }
+    free_fleet(&fleet);
+    printf("调速器已退出，已恢复默认设置\n");
+    return failed ? 1 : 0;
+}
+#endif
+
 void show_help() {
     printf("使用说明:\n"
            "  nvidia_limiter -rate <50-100>   设置性能百分比\n"
            "  nvidia_limiter -reset          恢复默认设置\n"
+           "  nvidia_limiter -status         查看守护进程缓存的设备状态\n"
+           "  nvidia_limiter -daemon         以守护进程运行，缓存设备状态并通过本地套接字接受请求\n"
+           "  nvidia_limiter -govern -power-budget <W> [-temp-budget <°C>]\n"
+           "                                 调速器：持续采样功耗、温度和利用率，自动调整档位贴着预算运行\n"
            "  nvidia_limiter -help           显示帮助\n\n"
+           "选项:\n"
+           "  -i <设备>        all 或以逗号分隔的设备序号，例如 0,2,5（默认 all）；\n"
+           "                   选中的设备各用一个线程同时设置，总耗时取决于最慢的设备\n"
+           "  -socket <路径>   守护进程套接字（默认 $XDG_RUNTIME_DIR/nvidia_limiter.sock，\n"
+           "                   未设置时为 /run/nvidia_limiter/nvidia_limiter.sock），权限 0600\n"
+           "  -backend <命令>  替代 nvidia-smi 的命令，例如测试用的替身脚本\n\n"
+           "调速器选项:\n"
+           "  -power-budget <W>   每个设备的功耗预算\n"
+           "  -temp-budget <°C>   温度预算，与功耗预算同时给出时取更紧的一项\n"
+           "  -sample-ms <毫秒>   采样间隔（默认 500，最小 50）\n"
+           "  -duration <秒>      运行时长（默认一直运行到 Ctrl+C），退出时恢复默认设置\n"
+           "  -simulate           使用模拟的设备模型，不调用 nvidia-smi\n\n"
+           "守护进程运行时，-rate/-reset 会交给它执行，只下发有变化的设置\n\n"
            "示例:\n"
            "  nvidia_limiter -rate 70\n"
+           "  nvidia_limiter -rate 60 -i 0,1\n"
+           "  nvidia_limiter -govern -power-budget 220 -temp-budget 80\n"
            "  nvidia_limiter -reset\n");
 }
 
-//todo...
\ No newline at end of file
+//todo...
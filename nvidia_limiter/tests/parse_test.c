@@ -0,0 +1,159 @@
+// nvidia_limiter 解析器的回归测试：把 fixtures/ 下采集的 nvidia-smi 输出当作后端，
+// 经 query_gpus（stream_command + parse_line）解析，逐项核对得到的设备表。
+// 编译运行（在 nvidia_limiter 目录下）：
+//   gcc -O2 -pthread tests/parse_test.c -o parse_test -lm && ./parse_test tests/fixtures
+// 每个用例对应一对文件 <名称>.POWER.txt 和 <名称>.SUPPORTED_CLOCKS.txt。
+// 另外用解析得到的设备表核对 compute_targets 在几个档位下吸附出的功耗和频率。
+
+#define main nvidia_limiter_main
+#include "../nvidia_limiter.c"
+#undef main
+
+#define MAX_EXPECT_GPUS 4
+
+// 期望的设备表项，按 query_gpus 返回的顺序（即 POWER 输出中的顺序）
+typedef struct {
+    const char* bus_id;
+    int power_limit;
+    int default_power;
+    int min_power;
+    int max_power;
+    int clock_count;
+    int max_core_clock;
+    int max_mem_clock;
+} ExpectGPU;
+
+typedef struct {
+    const char* name;
+    int count;
+    ExpectGPU gpus[MAX_EXPECT_GPUS];
+} ParseCase;
+
+static const ParseCase cases[] = {
+    // 新驱动单卡："GPU Power Readings"，Module Power Readings 里的 N/A 不应覆盖前面的值
+    {"single", 1, {
+        {"00000000:01:00.0", 320, 320, 100, 336, 12, 3105, 11501},
+    }},
+    // 两张卡，SUPPORTED_CLOCKS 的设备顺序与 POWER 不同，按总线号对应
+    {"multi", 2, {
+        {"00000000:3B:00.0", 300, 300, 100, 300, 3, 1530, 1593},
+        {"00000000:AF:00.0", 250, 300, 100, 300, 4, 1410, 1215},
+    }},
+    // 旧驱动："Power Readings" 小节和 "Power Limit" 字段
+    {"legacy", 1, {
+        {"0000:02:00.0", 180, 180, 90, 216, 5, 1911, 5005},
+    }},
+    // 功耗字段全是 N/A、没有频率表：功耗记为 -1，频率退回估计值
+    {"na", 1, {
+        {"00000000:01:00.0", -1, -1, -1, -1, 0, DEFAULT_MAX_CORE_CLOCK, DEFAULT_MAX_MEM_CLOCK},
+    }},
+    // 超过 16 KB 读缓冲区的行：只处理开头一段，剩余部分不能被当成一条 9999 MHz 的记录
+    {"long_line", 1, {
+        {"00000000:01:00.0", 320, 320, 100, 336, 12, 3105, 11501},
+    }},
+};
+
+// 期望的档位目标：在 fixture 解析出的第一张卡上按 rate 计算
+typedef struct {
+    const char* name;
+    int rate;
+    int power;
+    int core;
+    int mem;
+} TargetCase;
+
+static const TargetCase target_cases[] = {
+    // 满档取最高组合
+    {"single", 100, 336, 3105, 11501},
+    // 目标 2949/10925 MHz：向上吸附到 11001 档，核心取该档不低于目标的 3105，而不是空闲的 210/810
+    {"single", 95, 325, 3105, 11001},
+    // 目标 1552/5750 MHz：810 档低于目标，仍取 11001 档和其中的 2520
+    {"single", 50, 218, 2520, 11001},
+    // 目标 155/575 MHz：低档位才会落到 810 档的最低核心频率
+    {"single", 5, 112, 210, 810},
+    // 目标 93/345 MHz：显存取最低的 405 档
+    {"single", 3, 108, 210, 405},
+    // 没有频率表时不吸附，直接用按比例算出的估计值
+    {"na", 50, -1, DEFAULT_MAX_CORE_CLOCK / 2, DEFAULT_MAX_MEM_CLOCK / 2},
+};
+
+static int check_int(const char* name, int gpu, const char* field, int got, int want) {
+    if (got == want) return 0;
+    fprintf(stderr, "%s: GPU %d %s = %d，期望 %d\n", name, gpu, field, got, want);
+    return 1;
+}
+
+static void use_fixture(const char* dir, const char* name, char* backend, size_t size) {
+    // 后端是一个 shell 函数：按 "-q -d <类型>" 的第三个参数输出对应的 fixture
+    snprintf(backend, size, "fixture() { cat \"%s/%s.$3.txt\"; }; fixture", dir, name);
+    nvidia_smi = backend;
+}
+
+static int run_case(const char* dir, const ParseCase* c) {
+    char backend[CMD_SIZE];
+    use_fixture(dir, c->name, backend, sizeof(backend));
+
+    GPUInfo gpus[MAX_GPUS];
+    int count = query_gpus(gpus, MAX_GPUS);
+    int failed = check_int(c->name, -1, "设备数", count, c->count);
+    for (int i = 0; i < count && i < c->count; i++) {
+        const ExpectGPU* want = &c->gpus[i];
+        const GPUInfo* got = &gpus[i];
+        if (strcmp(got->bus_id, want->bus_id) != 0) {
+            fprintf(stderr, "%s: GPU %d 总线号 = %s，期望 %s\n", c->name, i, got->bus_id, want->bus_id);
+            failed = 1;
+        }
+        failed |= check_int(c->name, i, "power_limit", got->power_limit, want->power_limit);
+        failed |= check_int(c->name, i, "default_power", got->default_power, want->default_power);
+        failed |= check_int(c->name, i, "min_power", got->min_power, want->min_power);
+        failed |= check_int(c->name, i, "max_power", got->max_power, want->max_power);
+        failed |= check_int(c->name, i, "clock_count", got->clock_count, want->clock_count);
+        failed |= check_int(c->name, i, "max_core_clock", got->max_core_clock, want->max_core_clock);
+        failed |= check_int(c->name, i, "max_mem_clock", got->max_mem_clock, want->max_mem_clock);
+        // 每个频率组合都应来自表中的 Memory/Graphics 行，不会出现 0 或负数
+        for (int k = 0; k < got->clock_count; k++) {
+            if (got->clocks[k].mem <= 0 || got->clocks[k].graphics <= 0) {
+                fprintf(stderr, "%s: GPU %d 第 %d 个频率组合无效\n", c->name, i, k);
+                failed = 1;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) free_gpu_info(&gpus[i]);
+    printf("%-10s %s\n", c->name, failed ? "FAIL" : "ok");
+    return failed;
+}
+
+static int run_target_case(const char* dir, const TargetCase* c) {
+    char backend[CMD_SIZE];
+    use_fixture(dir, c->name, backend, sizeof(backend));
+
+    GPUInfo gpus[MAX_GPUS];
+    int count = query_gpus(gpus, MAX_GPUS);
+    int failed = check_int(c->name, -1, "设备数", count > 0, 1);
+    if (count > 0) {
+        char label[64];
+        snprintf(label, sizeof(label), "%s rate %d", c->name, c->rate);
+        int power, core, mem;
+        compute_targets(&gpus[0], c->rate, &power, &core, &mem);
+        // 功耗字段为 N/A 时 compute_targets 的功耗没有意义，不核对
+        if (c->power >= 0) failed |= check_int(label, 0, "power", power, c->power);
+        failed |= check_int(label, 0, "core", core, c->core);
+        failed |= check_int(label, 0, "mem", mem, c->mem);
+        printf("%-10s rate %-3d %s\n", c->name, c->rate, failed ? "FAIL" : "ok");
+    }
+    for (int i = 0; i < count; i++) free_gpu_info(&gpus[i]);
+    return failed;
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = argc > 1 ? argv[1] : "tests/fixtures";
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        failed += run_case(dir, &cases[i]);
+    }
+    for (size_t i = 0; i < sizeof(target_cases) / sizeof(target_cases[0]); i++) {
+        failed += run_target_case(dir, &target_cases[i]);
+    }
+    if (failed) fprintf(stderr, "%d 个用例失败\n", failed);
+    return failed ? 1 : 0;
+}
@@ -1,44 +1,218 @@
 /*
 * wifi_optimizer.c
 * 编译命令：
-* Linux: gcc wifi_optimizer.c -o wifi_optimizer -Wno-deprecated-declarations && sudo ./wifi_optimizer
+* Linux: gcc wifi_optimizer.c -o wifi_optimizer -Wno-deprecated-declarations -lm && sudo ./wifi_optimizer
+*        单独测量延迟（无需root）：./wifi_optimizer -probe 127.0.0.1
 * Windows: cl.exe wifi_optimizer.c && .\wifi_optimizer.exe
 */
 
+#ifndef _WIN32
+#define _GNU_SOURCE  // getaddrinfo_a
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
 #include <signal.h>
+#include <math.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <shellapi.h>
 #else
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <linux/net_tstamp.h>
 #endif
 
 #define MAX_CONFIG 10
 #define MAX_LINE 256
 #define MAX_RETRY 3
 #define CONNECT_TIMEOUT 5 // seconds
+#define READY_TIMEOUT_MS 10000 // 连接成功后等待地址和默认路由就绪的上限
+#define RETRY_BASE_MS 250      // 重连退避：250ms 起每次翻倍，最多 RETRY_MAX_MS
+#define RETRY_MAX_MS 4000
+#define MAX_PROBES 100
+#define MAX_DOMAINS 4   // 每个网络可配置的应用端点数
+#define MAX_TARGETS 8   // 一次并发探测的目标数：网关、DNS 和应用端点
+
+// 延迟探测的默认参数
+#define PROBE_COUNT 10        // 每个目标发送的探测包数
+#define PROBE_INTERVAL_MS 20  // 相邻两包的发送间隔
+#define PROBE_TIMEOUT_MS 1000 // 最后一包发出后等待回复的时间
+#define PROBE_TCP_PORT 443    // ICMP 不可用时用 TCP 连接测量
+#define PROBE_LOSS_PENALTY_MS 1000.0  // 评分时每 100% 丢包折算的延迟
+
+// 守护模式参数
+#define MONITOR_INTERVAL_S 10     // 采样当前连接的间隔
+#define MONITOR_PROBE_COUNT 3     // 后台采样只发少量探测包
+#define MONITOR_THRESHOLD 150.0   // 平均评分高于此值才重新评估候选网络
+#define MONITOR_DWELL_S 120       // 两次切换（或评估）之间的最短间隔
+#define MONITOR_HYSTERESIS 0.8    // 候选评分低于当前的 80% 才切换
+#define MONITOR_MAX_CANDIDATES 2  // 每次评估最多试连的候选数，不做全量扫描
+#define HISTORY_TAU_S 300.0       // 评分历史的衰减时间常数
+#define HISTORY_STALE_S 1800      // 超过此时间没更新的历史视为过期
+
+// 评分缓存：按 SSID × 时段保存，启动时只探测排名第一或过期的网络
+#define CACHE_PATH "wifi_optimizer.cache"
+#define CACHE_MAGIC 0x43534f57u     // "WOSC"
+#define CACHE_VERSION 1
+#define CACHE_MAX_ENTRIES 256
+#define CACHE_BUCKET_HOURS 4        // 一天分成 6 个时段
+#define CACHE_FRESH_S (7 * 86400)   // 同一时段一周内的记录视为有效
+#define CACHE_TAU_S (3 * 86400.0)   // 缓存均值的衰减时间常数
+#define CACHE_MIN_GAIN 5.0          // 缓存评分好不到这么多，就不值得为它多连一次
+
+enum { PROBE_ICMP_DGRAM, PROBE_ICMP_RAW, PROBE_TCP };
+enum { TARGET_GATEWAY, TARGET_DNS, TARGET_DOMAIN };
+
+typedef struct {
+    int count;
+    int interval_ms;
+    int timeout_ms;
+    int port;
+} ProbeConfig;
+
+// 一组探测的统计结果（毫秒），received 为 0 时其余字段无意义
+typedef struct {
+    int method;
+    int sent;
+    int received;
+    double min;
+    double median;
+    double p95;
+    double avg;
+    double jitter;  // 相邻两次往返时间差的平均值
+    double loss;    // 丢包率（0-1）
+} ProbeStats;
+
+// 一个探测目标及其在网络评分中的权重
+typedef struct {
+    char host[64];
+    int role;
+    double weight;
+    int ok;         // 是否收到过回复
+    ProbeStats stats;
+} ProbeTarget;
 
 typedef struct {
     char ssid[64];
     char password[64];
-    char domain[64];
+    char domains[MAX_DOMAINS][64];
+    int domain_count;
 } WifiConfig;
 
 typedef struct {
     int (*connect)(const char* ssid, const char* password);
     int (*disconnect)(void);
-    float (*ping)(const char* domain);
+    int (*wait_ready)(int timeout_ms);               // 等到网络可用返回 0，超时返回 -1
+    int (*probe)(ProbeTarget* targets, int count, const ProbeConfig* cfg);  // 同时探测全部目标，返回有回复的目标数
 } PlatformOps;
 
 // 全局平台操作实例
 static PlatformOps ops;
+static ProbeConfig probe_config = {PROBE_COUNT, PROBE_INTERVAL_MS, PROBE_TIMEOUT_MS, PROBE_TCP_PORT};
+
+static const char* probe_method_name(int method) {
+    switch (method) {
+    case PROBE_ICMP_DGRAM: return "ICMP";
+    case PROBE_ICMP_RAW: return "ICMP(raw)";
+    default: return "TCP";
+    }
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// rtts 按发送顺序排列，未收到回复的为负数
+void probe_summarize(const double* rtts, int sent, ProbeStats* stats) {
+    double sorted[MAX_PROBES];
+    int n = 0;
+    double sum = 0, jitter = 0, prev = -1;
+    int pairs = 0;
+
+    for (int i = 0; i < sent; i++) {
+        if (rtts[i] < 0) continue;
+        sorted[n++] = rtts[i];
+        sum += rtts[i];
+        if (prev >= 0) {
+            jitter += fabs(rtts[i] - prev);
+            pairs++;
+        }
+        prev = rtts[i];
+    }
+    stats->sent = sent;
+    stats->received = n;
+    stats->loss = sent > 0 ? 1.0 - (double)n / sent : 1.0;
+    if (n == 0) return;
+
+    qsort(sorted, n, sizeof(double), compare_double);
+    stats->min = sorted[0];
+    stats->median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    stats->p95 = sorted[(int)ceil(n * 0.95) - 1];  // 最近秩法
+    stats->avg = sum / n;
+    stats->jitter = pairs > 0 ? jitter / pairs : 0;
+}
+
+double now_ms() {
+#ifdef _WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+static void add_target(ProbeTarget* targets, int* count, const char* host, int role, double weight) {
+    if (*count >= MAX_TARGETS || !host[0]) return;
+    ProbeTarget* t = &targets[(*count)++];
+    memset(t, 0, sizeof(*t));
+    snprintf(t->host, sizeof(t->host), "%s", host);
+    t->role = role;
+    t->weight = weight;
+}
+
+static const char* target_role_name(int role) {
+    switch (role) {
+    case TARGET_GATEWAY: return "网关";
+    case TARGET_DNS: return "DNS";
+    default: return "应用";
+    }
+}
+
+// 网络评分（越低越好）：各目标的 中位延迟 + 2×抖动 + 丢包惩罚 按权重平均，
+// 完全无回复的目标按 100% 丢包计
+double network_score(const ProbeTarget* targets, int count) {
+    double sum = 0, weights = 0;
+    for (int i = 0; i < count; i++) {
+        const ProbeStats* st = &targets[i].stats;
+        double cost = targets[i].ok ? st->median + 2 * st->jitter + st->loss * PROBE_LOSS_PENALTY_MS
+                                    : PROBE_LOSS_PENALTY_MS;
+        sum += targets[i].weight * cost;
+        weights += targets[i].weight;
+    }
+    return weights > 0 ? sum / weights : PROBE_LOSS_PENALTY_MS;
+}
+
 static volatile sig_atomic_t keep_running = 1;
 
 void cleanup(int sig) {
@@ -97,7 +271,13 @@ int parse_config(const char* filename, WifiConfig* configs, int* count) {
         if (ssid && pass && domain) {
             strncpy(configs[*count].ssid, ssid, sizeof(configs[*count].ssid));
             strncpy(configs[*count].password, pass, sizeof(configs[*count].password));
-            strncpy(configs[*count].domain, domain, sizeof(configs[*count].domain));
+            // 第三列起都是应用端点，一起并发探测
+            configs[*count].domain_count = 0;
+            while (domain && configs[*count].domain_count < MAX_DOMAINS) {
+                char* d = configs[*count].domains[configs[*count].domain_count++];
+                snprintf(d, sizeof(configs[*count].domains[0]), "%s", domain);
+                domain = strtok_r(NULL, ",\n", &saveptr);
+            }
             (*count)++;
             
             if (*count >= MAX_CONFIG) break;
@@ -135,9 +315,13 @@ int win_connect(const char* ssid, const char* password) {
     return system(cmd);
 }
 
-float win_ping(const char* domain) {
+// Windows 仍然借助 ping 命令，只能拿到平均值
+int win_ping(const char* domain, ProbeStats* stats) {
     char cmd[128];
     snprintf(cmd, sizeof(cmd), "ping -n 2 %s", domain);
+    memset(stats, 0, sizeof(*stats));
+    stats->sent = 2;
+    stats->loss = 1.0;
     
     FILE* pipe = _popen(cmd, "r");
     if (!pipe) return -1;
@@ -147,11 +331,32 @@ float win_ping(const char* domain) {
         if (strstr(buffer, "Average")) {
             char* p = strchr(buffer, '=');
             _pclose(pipe);
-            return p ? atof(p + 2) : -1;
+            if (!p) return -1;
+            stats->min = stats->median = stats->p95 = stats->avg = atof(p + 2);
+            stats->received = 2;
+            stats->loss = 0;
+            return 0;
         }
     }
     _pclose(pipe);
-    return -1.0f;
+    return -1;
+}
+
+// Windows 没有并发探测，逐个目标调用 ping
+int win_probe(ProbeTarget* targets, int count, const ProbeConfig* cfg) {
+    int ok = 0;
+    (void)cfg;
+    for (int i = 0; i < count && keep_running; i++) {
+        targets[i].ok = win_ping(targets[i].host, &targets[i].stats) == 0;
+        ok += targets[i].ok;
+    }
+    return ok;
+}
+
+// Windows 没有订阅地址变化，仍按固定时间等待 DHCP
+int win_wait_ready(int timeout_ms) {
+    Sleep(timeout_ms < 3000 ? timeout_ms : 3000);
+    return 0;
 }
 
 int win_disconnect() {
@@ -167,23 +372,443 @@ int lin_connect(const char* ssid, const char* password) {
     return system(cmd);
 }
 
-float lin_ping(const char* domain) {
-    char cmd[128];
-    snprintf(cmd, sizeof(cmd), "ping -c 2 -W 1 %s", domain);
-    
-    FILE* pipe = popen(cmd, "r");
-    if (!pipe) return -1;
+static double real_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
 
-    char buffer[128];
-    while (fgets(buffer, sizeof(buffer), pipe) && keep_running) {
-        if (strstr(buffer, "avg")) {
-            char* p = strchr(buffer, '/');
-            pclose(pipe);
-            return p ? atof(p + 1) : -1;
+static uint16_t icmp_checksum(const void* data, size_t len) {
+    const uint8_t* p = data;
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) sum += (p[i] << 8) | p[i + 1];
+    if (len & 1) sum += p[len - 1] << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+// 按 ICMP 数据报套接字、原始套接字的顺序打开，前者需要 net.ipv4.ping_group_range 允许，后者需要 root
+static int icmp_open(int* method) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_ICMP);
+    *method = PROBE_ICMP_DGRAM;
+    if (fd < 0) {
+        fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMP);
+        *method = PROBE_ICMP_RAW;
+    }
+    if (fd >= 0) {
+        // 让内核在收包时打时间戳，不把调度延迟算进往返时间
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    }
+    return fd;
+}
+
+// 收一个回复：返回序号并把接收时间（单调时钟毫秒）写入 when，
+// 不是本次探测的回复返回 -1，没有可读的包返回 -2
+static int icmp_receive(int fd, int method, uint16_t ident, double clock_offset, double* when) {
+    unsigned char packet[1500];
+    char control[256];
+    struct iovec iov = {packet, sizeof(packet)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(fd, &msg, 0);
+    *when = now_ms();
+    if (n < 0) return -2;
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPING) {
+            struct timespec ts[3];
+            memcpy(ts, CMSG_DATA(cm), sizeof(ts));
+            if (ts[0].tv_sec || ts[0].tv_nsec) {
+                // 内核时间戳是实时时钟，换算到单调时钟
+                *when = ts[0].tv_sec * 1000.0 + ts[0].tv_nsec / 1e6 - clock_offset;
+            }
+        }
+    }
+
+    // 原始套接字收到的包带 IP 头，且会收到本机所有 ICMP，需要按标识过滤；
+    // 数据报套接字由内核按标识分发，没有 IP 头
+    const unsigned char* p = packet;
+    if (method == PROBE_ICMP_RAW) {
+        size_t ihl = (p[0] & 0x0f) * 4;
+        if ((size_t)n < ihl + sizeof(struct icmphdr)) return -1;
+        p += ihl;
+        n -= ihl;
+    }
+    if ((size_t)n < sizeof(struct icmphdr)) return -1;
+    struct icmphdr icmp;
+    memcpy(&icmp, p, sizeof(icmp));
+    if (icmp.type != ICMP_ECHOREPLY) return -1;
+    if (method == PROBE_ICMP_RAW && icmp.un.echo.id != ident) return -1;
+    return ntohs(icmp.un.echo.sequence);
+}
+
+// 一个目标的探测过程。ICMP 目标共用一个套接字；TCP 目标每个探测一个连接，
+// 各自有截止时间。所有套接字登记在同一个 epoll 上，data 为 (目标序号 << 16) | 探测序号
+typedef struct {
+    ProbeTarget* target;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int method;
+    int fd;
+    uint16_t ident;
+    int next;                   // 下一个要发的探测序号
+    double next_send;
+    double done_at;             // ICMP：最后一包发出后等到此时
+    int pending;                // TCP：尚未完成的连接数
+    int tcp_fd[MAX_PROBES];
+    double deadline[MAX_PROBES];
+    double sent_at[MAX_PROBES];
+    double rtts[MAX_PROBES];
+} ProbeRun;
+
+#define EPOLL_ICMP 0xffff
+
+static void tcp_finish(int ep, ProbeRun* run, int seq, int replied, double now) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, run->tcp_fd[seq], NULL);
+    close(run->tcp_fd[seq]);
+    run->tcp_fd[seq] = -1;
+    run->pending--;
+    if (replied) run->rtts[seq] = now - run->sent_at[seq];
+}
+
+static void probe_send(int ep, ProbeRun* run, int index, const ProbeConfig* cfg) {
+    int seq = run->next++;
+    run->next_send += cfg->interval_ms;
+    run->sent_at[seq] = now_ms();
+
+    if (run->method != PROBE_TCP) {
+        unsigned char packet[sizeof(struct icmphdr) + 16] = {0};
+        struct icmphdr icmp = {0};
+        icmp.type = ICMP_ECHO;
+        icmp.un.echo.id = run->ident;
+        icmp.un.echo.sequence = htons(seq);
+        memcpy(packet, &icmp, sizeof(icmp));
+        memcpy(packet + sizeof(icmp), "wifi_optimizer", 14);
+        icmp.checksum = icmp_checksum(packet, sizeof(packet));
+        memcpy(packet, &icmp, sizeof(icmp));
+
+        run->sent_at[seq] = now_ms();
+        if (sendto(run->fd, packet, sizeof(packet), 0, (struct sockaddr*)&run->addr, run->addr_len) < 0) {
+            run->sent_at[seq] = -1;
+        }
+        if (run->next == cfg->count) run->done_at = now_ms() + cfg->timeout_ms;
+        return;
+    }
+
+    int fd = socket(run->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) return;
+    run->sent_at[seq] = now_ms();
+    if (connect(fd, (struct sockaddr*)&run->addr, run->addr_len) == 0 || errno == ECONNREFUSED) {
+        // 本机地址可能立即完成，对方回 RST 同样是一次完整的往返
+        run->rtts[seq] = now_ms() - run->sent_at[seq];
+        close(fd);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+    struct epoll_event ev = {EPOLLOUT, {.u64 = ((uint64_t)index << 16) | seq}};
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    run->tcp_fd[seq] = fd;
+    run->deadline[seq] = run->sent_at[seq] + cfg->timeout_ms;
+    run->pending++;
+}
+
+static int run_finished(const ProbeRun* run, const ProbeConfig* cfg, double now) {
+    if (run->next < cfg->count) return 0;
+    if (run->method == PROBE_TCP) return run->pending == 0;
+    if (now >= run->done_at) return 1;
+    for (int i = 0; i < cfg->count; i++) {
+        if (run->sent_at[i] >= 0 && run->rtts[i] < 0) return 0;
+    }
+    return 1;
+}
+
+// 并发解析所有目标的地址，总共最多等 timeout_ms
+static void resolve_targets(ProbeTarget* targets, int count, int port, int timeout_ms, struct addrinfo** results) {
+    struct gaicb requests[MAX_TARGETS];
+    struct gaicb* list[MAX_TARGETS];
+    struct addrinfo hints = {0};
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    hints.ai_socktype = SOCK_STREAM;
+
+    for (int i = 0; i < count; i++) {
+        memset(&requests[i], 0, sizeof(requests[i]));
+        requests[i].ar_name = targets[i].host;
+        requests[i].ar_service = service;
+        requests[i].ar_request = &hints;
+        list[i] = &requests[i];
+        results[i] = NULL;
+    }
+    if (getaddrinfo_a(GAI_NOWAIT, list, count, NULL) != 0) return;
+
+    double deadline = now_ms() + timeout_ms;
+    for (;;) {
+        int waiting = 0;
+        for (int i = 0; i < count; i++) waiting += gai_error(list[i]) == EAI_INPROGRESS;
+        double left = deadline - now_ms();
+        if (!waiting || left <= 0 || !keep_running) break;
+        struct timespec ts = {(time_t)(left / 1000), (long)fmod(left, 1000) * 1000000L};
+        gai_suspend((const struct gaicb* const*)list, count, &ts);
+    }
+    for (int i = 0; i < count; i++) {
+        if (gai_error(list[i]) == 0) {
+            results[i] = list[i]->ar_result;
+        } else if (gai_cancel(list[i]) == EAI_NOTCANCELED) {
+            // 解析线程还在用 requests，只能等它结束
+            const struct gaicb* one[1] = {list[i]};
+            while (gai_error(list[i]) == EAI_INPROGRESS) gai_suspend(one, 1, NULL);
+            if (gai_error(list[i]) == 0) freeaddrinfo(list[i]->ar_result);
+        }
+    }
+}
+
+// 同时探测多个目标：所有套接字由一个 epoll 复用，按各自的发送计划和截止时间推进，
+// 总耗时约等于最慢的一个目标，而不是各目标之和
+int probe_targets(ProbeTarget* targets, int count, const ProbeConfig* cfg) {
+    static ProbeRun runs[MAX_TARGETS];
+    struct addrinfo* resolved[MAX_TARGETS];
+    ProbeConfig local = *cfg;
+    if (local.count > MAX_PROBES) local.count = MAX_PROBES;
+    if (count > MAX_TARGETS) count = MAX_TARGETS;
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) return 0;
+    resolve_targets(targets, count, local.port, local.timeout_ms, resolved);
+
+    double now = now_ms();
+    double clock_offset = real_ms() - now;
+    for (int i = 0; i < count; i++) {
+        ProbeRun* run = &runs[i];
+        memset(run, 0, sizeof(*run));
+        run->target = &targets[i];
+        run->fd = -1;
+        run->next_send = now;
+        for (int j = 0; j < local.count; j++) {
+            run->rtts[j] = -1;
+            run->tcp_fd[j] = -1;
+        }
+        targets[i].ok = 0;
+        memset(&targets[i].stats, 0, sizeof(targets[i].stats));
+        targets[i].stats.loss = 1.0;
+        if (!resolved[i]) {
+            run->next = local.count;  // 解析失败，不发探测
+            continue;
+        }
+
+        // 优先 ICMP（仅 IPv4），打不开时用 TCP
+        struct addrinfo* ai = resolved[i];
+        for (struct addrinfo* p = resolved[i]; p; p = p->ai_next) {
+            if (p->ai_family == AF_INET) {
+                ai = p;
+                break;
+            }
+        }
+        memcpy(&run->addr, ai->ai_addr, ai->ai_addrlen);
+        run->addr_len = ai->ai_addrlen;
+        run->method = PROBE_TCP;
+        if (ai->ai_family == AF_INET) {
+            run->fd = icmp_open(&run->method);
+            if (run->fd < 0) run->method = PROBE_TCP;
+        }
+        if (run->fd >= 0) {
+            run->ident = htons((getpid() + i) & 0xffff);  // 原始套接字靠标识区分各目标的回复
+            struct epoll_event ev = {EPOLLIN, {.u64 = ((uint64_t)i << 16) | EPOLL_ICMP}};
+            epoll_ctl(ep, EPOLL_CTL_ADD, run->fd, &ev);
         }
+        freeaddrinfo(resolved[i]);
     }
-    pclose(pipe);
-    return -1.0f;
+
+    struct epoll_event events[32];
+    while (keep_running) {
+        now = now_ms();
+        double wake = now + local.timeout_ms;
+        int unfinished = 0;
+        for (int i = 0; i < count; i++) {
+            ProbeRun* run = &runs[i];
+            while (run->next < local.count && now >= run->next_send) probe_send(ep, run, i, &local);
+            for (int j = 0; j < run->next && run->pending; j++) {
+                if (run->tcp_fd[j] >= 0 && now >= run->deadline[j]) tcp_finish(ep, run, j, 0, now);
+            }
+            if (run_finished(run, &local, now)) continue;
+            unfinished++;
+
+            // 下一次需要醒来的时间：下一次发送、TCP 连接超时或 ICMP 等待结束
+            if (run->next < local.count && run->next_send < wake) wake = run->next_send;
+            if (run->method != PROBE_TCP && run->next == local.count && run->done_at < wake) wake = run->done_at;
+            for (int j = 0; j < run->next; j++) {
+                if (run->tcp_fd[j] >= 0 && run->deadline[j] < wake) wake = run->deadline[j];
+            }
+        }
+        if (!unfinished) break;
+
+        double wait = wake - now_ms();
+        int n = epoll_wait(ep, events, 32, wait > 0 ? (int)ceil(wait) : 0);
+        for (int e = 0; e < n; e++) {
+            ProbeRun* run = &runs[events[e].data.u64 >> 16];
+            int seq = events[e].data.u64 & 0xffff;
+            if (seq == EPOLL_ICMP) {
+                double when;
+                int got;
+                while ((got = icmp_receive(run->fd, run->method, run->ident, clock_offset, &when)) != -2) {
+                    if (got >= 0 && got < run->next && run->sent_at[got] >= 0 && run->rtts[got] < 0) {
+                        run->rtts[got] = when > run->sent_at[got] ? when - run->sent_at[got] : 0;
+                    }
+                }
+            } else {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(run->tcp_fd[seq], SOL_SOCKET, SO_ERROR, &err, &len);
+                tcp_finish(ep, run, seq, err == 0 || err == ECONNREFUSED, now_ms());
+            }
+        }
+    }
+
+    int ok = 0;
+    for (int i = 0; i < count; i++) {
+        ProbeRun* run = &runs[i];
+        for (int j = 0; j < local.count; j++) {
+            if (run->tcp_fd[j] >= 0) close(run->tcp_fd[j]);
+        }
+        if (run->fd >= 0) close(run->fd);
+        if (!resolved[i]) continue;
+        probe_summarize(run->rtts, local.count, &targets[i].stats);
+        targets[i].stats.method = run->method;
+        targets[i].ok = targets[i].stats.received > 0;
+        ok += targets[i].ok;
+    }
+    close(ep);
+    return ok;
+}
+
+// 默认路由的网关，读 /proc/net/route
+static int default_gateway(char* buf, size_t size) {
+    FILE* fp = fopen("/proc/net/route", "r");
+    if (!fp) return 0;
+    char line[MAX_LINE];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        char iface[32];
+        unsigned int dest, gateway, flags;
+        if (sscanf(line, "%31s %x %x %x", iface, &dest, &gateway, &flags) == 4 &&
+            dest == 0 && (flags & 0x2) && gateway != 0) {  // 0x2 即 RTF_GATEWAY
+            struct in_addr addr = {gateway};
+            found = inet_ntop(AF_INET, &addr, buf, size) != NULL;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// resolv.conf 中第一个非本机的 nameserver；本机的存根解析器（如 127.0.0.53）测不出网络质量
+static int first_nameserver(char* buf, size_t size) {
+    FILE* fp = fopen("/etc/resolv.conf", "r");
+    if (!fp) return 0;
+    char line[MAX_LINE];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        char addr[64];
+        if (sscanf(line, " nameserver %63s", addr) == 1 && strncmp(addr, "127.", 4) != 0 &&
+            strcmp(addr, "::1") != 0) {
+            snprintf(buf, size, "%s", addr);
+            found = 1;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+int lin_probe(ProbeTarget* targets, int count, const ProbeConfig* cfg) {
+    return probe_targets(targets, count, cfg);
+}
+
+static int is_wireless(const char* iface) {
+    char path[300];
+    struct stat st;
+    snprintf(path, sizeof(path), "/sys/class/net/%s/wireless", iface);
+    return stat(path, &st) == 0;
+}
+
+static int has_wireless_interface() {
+    DIR* dir = opendir("/sys/class/net");
+    if (!dir) return 0;
+    struct dirent* ent;
+    int found = 0;
+    while (!found && (ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.') found = is_wireless(ent->d_name);
+    }
+    closedir(dir);
+    return found;
+}
+
+// 是否已有可用的默认路由。本机有无线网卡时只认经过无线网卡的默认路由，
+// 避免有线网络的路由让等待提前结束
+static int default_route_ready() {
+    FILE* fp = fopen("/proc/net/route", "r");
+    if (!fp) return 0;
+    char line[MAX_LINE];
+    int any = 0, wireless = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char iface[32];
+        unsigned int dest, gateway, flags;
+        if (sscanf(line, "%31s %x %x %x", iface, &dest, &gateway, &flags) != 4) continue;
+        if (dest != 0 || !(flags & 0x1)) continue;  // 0x1 即 RTF_UP
+        any = 1;
+        if (is_wireless(iface)) wireless = 1;
+    }
+    fclose(fp);
+    return wireless || (any && !has_wireless_interface());
+}
+
+// 订阅 rtnetlink 的链路、IPv4 地址和路由变化，默认路由一出现就返回，不做固定等待。
+// 先订阅再检查当前状态，检查和订阅之间发生的变化也不会漏掉
+int lin_wait_ready(int timeout_ms) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    struct sockaddr_nl sa = {0};
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+    if (fd >= 0 && bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    double deadline = now_ms() + timeout_ms;
+    int ready = default_route_ready();
+    while (!ready && keep_running) {
+        double left = deadline - now_ms();
+        if (left <= 0) break;
+        if (fd < 0) {
+            // 打不开 netlink 时退回到短间隔轮询
+            usleep(100 * 1000);
+            ready = default_route_ready();
+            continue;
+        }
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, (int)ceil(left)) <= 0) continue;
+        char buf[8192];
+        ssize_t n;
+        int relevant = 0;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            for (struct nlmsghdr* nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, (size_t)n); nh = NLMSG_NEXT(nh, n)) {
+                if (nh->nlmsg_type == RTM_NEWROUTE || nh->nlmsg_type == RTM_NEWADDR ||
+                    nh->nlmsg_type == RTM_NEWLINK) {
+                    relevant = 1;
+                }
+            }
+        }
+        if (n < 0 && errno == ENOBUFS) relevant = 1;  // 事件太多溢出了，直接重新检查
+        if (relevant) ready = default_route_ready();
+    }
+    if (fd >= 0) close(fd);
+    return ready ? 0 : -1;
 }
 
 int lin_disconnect() {
@@ -191,82 +816,595 @@ int lin_disconnect() {
 }
 #endif
 
-int main() {
-    signal(SIGINT, cleanup);
-    check_privileges();
+// 模拟后端：不碰真实网卡，用来验证重连退避和就绪等待的流程，探测仍走真实的探测引擎。
+// SSID 以 fail 开头的总是连接失败，以 flaky 开头的前两次失败；就绪等待模拟 DHCP 耗时
+#define MOCK_READY_MS 150
 
-    WifiConfig configs[MAX_CONFIG];
-    int count = 0;
-    
-    if (parse_config("lan.conf", configs, &count) != 0) {
-        fprintf(stderr, "配置文件错误或无有效配置\n");
-        return 1;
+int mock_connect(const char* ssid, const char* password) {
+    static char last[64];
+    static int attempts;
+    (void)password;
+    if (strcmp(last, ssid) != 0) {
+        snprintf(last, sizeof(last), "%s", ssid);
+        attempts = 0;
     }
+    attempts++;
+    if (strncmp(ssid, "fail", 4) == 0) return -1;
+    if (strncmp(ssid, "flaky", 5) == 0 && attempts <= 2) return -1;
+    return 0;
+}
+
+int mock_disconnect() {
+    return 0;
+}
 
+void sleep_ms(int ms) {
 #ifdef _WIN32
-    ops.connect = win_connect;
-    ops.disconnect = win_disconnect;
-    ops.ping = win_ping;
+    Sleep(ms);
 #else
-    ops.connect = lin_connect;
-    ops.disconnect = lin_disconnect;
-    ops.ping = lin_ping;
+    usleep(ms * 1000);
 #endif
+}
 
-    int best_index = -1;
-    float min_latency = 9999.0f;
+int mock_wait_ready(int timeout_ms) {
+    sleep_ms(MOCK_READY_MS < timeout_ms ? MOCK_READY_MS : timeout_ms);
+    return 0;
+}
 
-    for (int i = 0; i < count && keep_running; ++i) {
-        printf("测试网络: %-15s => ", configs[i].ssid);
-        
-        int retries = MAX_RETRY;
-        int connected = 0;
-        
-        while (retries-- > 0 && keep_running) {
-            if (ops.connect(configs[i].ssid, configs[i].password) == 0) {
-                connected = 1;
-                break;
-            }
+void print_stats(const ProbeStats* stats) {
+    printf("%s %d/%d 收到，最小 %.2f ms，中位 %.2f ms，P95 %.2f ms，抖动 %.2f ms，丢包 %.0f%%\n",
+           probe_method_name(stats->method), stats->received, stats->sent, stats->min, stats->median,
+           stats->p95, stats->jitter, stats->loss * 100);
+}
+
+void print_targets(const ProbeTarget* targets, int count) {
+    for (int i = 0; i < count; i++) {
+        printf("  %-4s %-20s ", target_role_name(targets[i].role), targets[i].host);
+        if (targets[i].ok) print_stats(&targets[i].stats);
+        else printf("无回复\n");
+    }
+}
+
+void show_help() {
+    printf("使用说明:\n"
+           "  wifi_optimizer                 依次连接 lan.conf 中的网络，选出延迟最低的一个（需要root）\n"
+           "  wifi_optimizer -daemon         选出最佳网络后保持运行，质量下降时才切换\n"
+           "  wifi_optimizer -mock           用模拟的连接后端走一遍完整流程（无需root和无线网卡）\n"
+           "  wifi_optimizer -probe <主机>   只测量到主机的延迟并输出统计，可重复指定以并发测量多个主机\n\n"
+           "选项:\n"
+           "  -config <文件>    网络配置文件（默认 lan.conf）\n"
+           "  -cache <文件>     评分缓存（默认 %s），按 SSID 和时段（每 %d 小时）保存测量结果；\n"
+           "                    启动时只测量没有记录、记录过期或排名靠前的网络\n"
+           "  -rescan           忽略缓存，重新测量全部网络\n\n"
+           "守护模式选项:\n"
+           "  -monitor-interval <秒>  采样当前连接的间隔（默认 %d）\n"
+           "  -threshold <评分>       平均评分高于此值才评估其他网络（默认 %.0f）\n"
+           "  -dwell <秒>             两次切换之间的最短间隔（默认 %d）\n"
+           "  候选网络按评分历史（指数衰减的均值）排序，每次最多试连 %d 个，评分低于当前的 %.0f%% 才切换\n\n"
+           "探测选项:\n"
+           "  -count <N>        每个目标发送的探测包数（默认 %d，最多 %d）\n"
+           "  -interval <毫秒>  发包间隔（默认 %d）\n"
+           "  -timeout <毫秒>   最后一包发出后等待回复的时间（默认 %d）\n"
+           "  -port <端口>      ICMP 不可用时 TCP 连接探测的端口（默认 %d）\n\n"
+           "ICMP 优先使用无需特权的数据报套接字（受 net.ipv4.ping_group_range 限制），\n"
+           "其次是原始套接字，都不可用时改用 TCP 连接测量\n\n"
+           "lan.conf 每行为 SSID,密码,应用端点[,应用端点...]（最多 %d 个端点）。\n"
+           "测试每个网络时同时探测网关、DNS 和全部应用端点，按权重合成评分（越低越好）\n",
+           CACHE_PATH, CACHE_BUCKET_HOURS,
+           MONITOR_INTERVAL_S, MONITOR_THRESHOLD, MONITOR_DWELL_S, MONITOR_MAX_CANDIDATES, MONITOR_HYSTERESIS * 100,
+           PROBE_COUNT, MAX_PROBES, PROBE_INTERVAL_MS, PROBE_TIMEOUT_MS, PROBE_TCP_PORT, MAX_DOMAINS);
+}
+
+// 缓存文件：文件头后紧跟定长记录，整体写入临时文件再改名，不会留下半截文件
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t record_size;
+} CacheHeader;
+
+typedef struct {
+    char ssid[64];
+    int64_t updated;     // 最近一次更新的时间（Unix 秒）
+    float score;         // 以下均为按时间衰减的均值
+    float median;        // 各目标中位延迟的加权平均（毫秒）
+    float p95;
+    float jitter;
+    float loss;
+    float connect_ms;    // 从发起连接到网络就绪的耗时
+    uint32_t samples;
+    uint8_t bucket;      // 时段：本地时间的小时 / CACHE_BUCKET_HOURS
+    uint8_t reserved[3];
+} CacheEntry;
+
+typedef struct {
+    CacheEntry entries[CACHE_MAX_ENTRIES];
+    int count;
+    const char* path;    // NULL 表示不使用缓存
+} ScoreCache;
+
+static ScoreCache cache;
+
+static int current_bucket() {
+    time_t now = time(NULL);
+    struct tm tm_now;
 #ifdef _WIN32
-            Sleep(2000);
+    localtime_s(&tm_now, &now);
 #else
-            sleep(2);
+    localtime_r(&now, &tm_now);
 #endif
+    return tm_now.tm_hour / CACHE_BUCKET_HOURS;
+}
+
+// 读取缓存；文件不存在或格式不符时当作空缓存
+void cache_load(const char* path) {
+    cache.path = path;
+    cache.count = 0;
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return;
+    CacheHeader header;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == CACHE_MAGIC &&
+        header.version == CACHE_VERSION && header.record_size == sizeof(CacheEntry)) {
+        int n = header.count < CACHE_MAX_ENTRIES ? (int)header.count : CACHE_MAX_ENTRIES;
+        cache.count = (int)fread(cache.entries, sizeof(CacheEntry), n, fp);
+        for (int i = 0; i < cache.count; i++) cache.entries[i].ssid[sizeof(cache.entries[i].ssid) - 1] = '\0';
+    }
+    fclose(fp);
+}
+
+void cache_save() {
+    if (!cache.path) return;
+    char tmp[MAX_LINE + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache.path);
+    FILE* fp = fopen(tmp, "wb");
+    if (!fp) return;
+    CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, (uint32_t)cache.count, sizeof(CacheEntry)};
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(cache.entries, sizeof(CacheEntry), cache.count, fp) == (size_t)cache.count;
+    ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+    remove(cache.path);
+#endif
+    if (!ok || rename(tmp, cache.path) != 0) remove(tmp);
+}
+
+// 当前时段的记录；没有时返回 NULL
+CacheEntry* cache_find(const char* ssid, int bucket) {
+    for (int i = 0; i < cache.count; i++) {
+        if (cache.entries[i].bucket == bucket && strcmp(cache.entries[i].ssid, ssid) == 0) return &cache.entries[i];
+    }
+    return NULL;
+}
+
+static int cache_fresh(const CacheEntry* e) {
+    return e && time(NULL) - e->updated < CACHE_FRESH_S;
+}
+
+// 记录一次测量结果：各项按时间衰减合并进当前时段的记录，表满时替换最旧的记录
+void cache_record(const char* ssid, double score, const ProbeTarget* targets, int target_count, double connect_ms) {
+    if (!cache.path) return;
+    int bucket = current_bucket();
+    time_t now = time(NULL);
+    CacheEntry* e = cache_find(ssid, bucket);
+    if (!e) {
+        if (cache.count < CACHE_MAX_ENTRIES) {
+            e = &cache.entries[cache.count++];
+        } else {
+            e = &cache.entries[0];
+            for (int i = 1; i < cache.count; i++) {
+                if (cache.entries[i].updated < e->updated) e = &cache.entries[i];
+            }
         }
+        memset(e, 0, sizeof(*e));
+        snprintf(e->ssid, sizeof(e->ssid), "%s", ssid);
+        e->bucket = (uint8_t)bucket;
+    }
+
+    // 网络整体的延迟分布：有回复的目标按权重平均，丢包把无回复的目标也算进去
+    double weights = 0, all_weights = 0, median = 0, p95 = 0, jitter = 0, loss = 0;
+    for (int i = 0; i < target_count; i++) {
+        const ProbeTarget* t = &targets[i];
+        all_weights += t->weight;
+        loss += t->weight * (t->ok ? t->stats.loss : 1.0);
+        if (!t->ok) continue;
+        weights += t->weight;
+        median += t->weight * t->stats.median;
+        p95 += t->weight * t->stats.p95;
+        jitter += t->weight * t->stats.jitter;
+    }
+    if (weights > 0) {
+        median /= weights;
+        p95 /= weights;
+        jitter /= weights;
+    }
+    loss = all_weights > 0 ? loss / all_weights : 1.0;
+
+    // 新样本的权重只取决于距上次更新的时间：短时间内的多次测量合起来只相当于一次
+    double alpha = e->samples == 0 ? 1.0 : 1 - exp(-(double)(now - e->updated) / CACHE_TAU_S);
+    e->score += (float)(alpha * (score - e->score));
+    e->median += (float)(alpha * (median - e->median));
+    e->p95 += (float)(alpha * (p95 - e->p95));
+    e->jitter += (float)(alpha * (jitter - e->jitter));
+    e->loss += (float)(alpha * (loss - e->loss));
+    e->connect_ms += (float)(alpha * (connect_ms - e->connect_ms));
+    e->updated = now;
+    e->samples++;
+    cache_save();
+}
+
+// 连接网络：失败时按有界指数退避重试，连上后等到地址和默认路由就绪，不做固定等待。
+// 成功返回 0，ready_ms 为等待就绪的耗时
+int connect_network(const WifiConfig* cfg, double* ready_ms) {
+    int connected = 0;
+    int backoff = RETRY_BASE_MS;
+
+    for (int attempt = 0; attempt < MAX_RETRY && keep_running; attempt++) {
+        if (attempt > 0) {
+            // 最后一次失败后不再等待
+            sleep_ms(backoff);
+            backoff = backoff * 2 < RETRY_MAX_MS ? backoff * 2 : RETRY_MAX_MS;
+        }
+        if (ops.connect(cfg->ssid, cfg->password) == 0) {
+            connected = 1;
+            break;
+        }
+    }
+    if (!connected) {
+        printf("连接失败\n");
+        return -1;
+    }
+
+    double ready_start = now_ms();
+    if (ops.wait_ready(READY_TIMEOUT_MS) != 0) {
+        printf("等待网络就绪超时\n");
+        ops.disconnect();
+        return -1;
+    }
+    *ready_ms = now_ms() - ready_start;
+    return 0;
+}
+
+// 探测当前连接的网络：网关、DNS 和配置的应用端点，返回评分，全部无回复返回 -1
+double measure_network(const WifiConfig* cfg, const ProbeConfig* pc, ProbeTarget* targets, int* target_count) {
+    *target_count = 0;
+#ifndef _WIN32
+    char gateway[64], dns[64];
+    if (default_gateway(gateway, sizeof(gateway))) {
+        add_target(targets, target_count, gateway, TARGET_GATEWAY, 1.0);
+    }
+    if (first_nameserver(dns, sizeof(dns))) {
+        add_target(targets, target_count, dns, TARGET_DNS, 1.0);
+    }
+#endif
+    for (int d = 0; d < cfg->domain_count; d++) {
+        add_target(targets, target_count, cfg->domains[d], TARGET_DOMAIN, 2.0);
+    }
+    if (ops.probe(targets, *target_count, pc) == 0) return -1;
+    return network_score(targets, *target_count);
+}
+
+// 每个 SSID 的评分历史：按时间指数衰减的均值，新样本的权重随距上次更新的时间增大
+typedef struct {
+    double score;     // 越低越好
+    double updated;   // 最近一次更新的时间（单调时钟毫秒），从缓存载入的旧记录可能早于开机而为负
+    int samples;      // 0 表示没有记录
+} ScoreHistory;
+
+void history_update(ScoreHistory* h, double score, double now) {
+    if (h->samples == 0) {
+        h->score = score;
+    } else {
+        double alpha = 1 - exp(-(now - h->updated) / (HISTORY_TAU_S * 1000));
+        h->score += alpha * (score - h->score);
+    }
+    h->updated = now;
+    h->samples++;
+}
+
+static int history_fresh(const ScoreHistory* h, double now) {
+    return h->samples > 0 && now - h->updated < HISTORY_STALE_S * 1000.0;
+}
+
+// 记录一个网络的测量结果（score 为负表示连接或探测失败），同时更新内存中的历史和磁盘缓存
+void note_result(ScoreHistory* h, const char* ssid, double score, const ProbeTarget* targets, int target_count,
+                 double connect_ms) {
+    if (score < 0) {
+        score = PROBE_LOSS_PENALTY_MS;
+        target_count = 0;
+    }
+    history_update(h, score, now_ms());
+    cache_record(ssid, score, targets, target_count, connect_ms);
+}
 
-        if (!connected) {
-            printf("连接失败\n");
+typedef struct {
+    int interval_s;
+    int dwell_s;
+    double threshold;
+} MonitorConfig;
+
+// 守护模式：保持连接，定期用少量探测包采样当前网络并更新历史。平均评分超过阈值、
+// 且距上次切换或评估已过最短间隔时，才按历史挑出少数候选试连；候选必须明显更好
+// （低于当前评分的 MONITOR_HYSTERESIS 倍）才切换，否则回到原网络
+void monitor_run(WifiConfig* configs, int count, ScoreHistory* history, int active, const MonitorConfig* mc) {
+    ProbeTarget targets[MAX_TARGETS];
+    int target_count;
+    ProbeConfig light = probe_config;
+    light.count = MONITOR_PROBE_COUNT < probe_config.count ? MONITOR_PROBE_COUNT : probe_config.count;
+    double last_change = now_ms();
+    double ready_ms;
+
+    printf("\n进入守护模式：每 %d 秒采样一次，阈值 %.0f，最短驻留 %d 秒\n", mc->interval_s, mc->threshold, mc->dwell_s);
+    fflush(stdout);
+    while (keep_running) {
+        sleep_ms(mc->interval_s * 1000);
+        if (!keep_running) break;
+
+        double now = now_ms();
+        double score = measure_network(&configs[active], &light, targets, &target_count);
+        // 少量探测包的采样只进内存历史：没有连接耗时，也不是完整测量，不写入磁盘缓存
+        history_update(&history[active], score >= 0 ? score : PROBE_LOSS_PENALTY_MS, now_ms());
+        double current = history[active].score;
+        printf("[监控] %s 本次 %.2f，平均 %.2f\n", configs[active].ssid, score, current);
+        fflush(stdout);
+
+        if (current <= mc->threshold) continue;
+        if (now - last_change < mc->dwell_s * 1000.0) {
+            printf("[监控] 质量下降，距上次切换不足 %d 秒，暂不评估\n", mc->dwell_s);
             continue;
         }
 
+        // 候选按历史排序：有新鲜记录的按评分，没有或已过期的排在后面；
+        // 历史明显不比当前好的直接跳过，不必重新连接
+        int order[MAX_CONFIG];
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (i == active) continue;
+            if (history_fresh(&history[i], now) && history[i].score >= current * MONITOR_HYSTERESIS) continue;
+            order[n++] = i;
+        }
+        for (int a = 0; a < n; a++) {
+            for (int b = a + 1; b < n; b++) {
+                int fa = history_fresh(&history[order[a]], now), fb = history_fresh(&history[order[b]], now);
+                if (fb > fa || (fa == fb && history[order[b]].score < history[order[a]].score)) {
+                    int t = order[a];
+                    order[a] = order[b];
+                    order[b] = t;
+                }
+            }
+        }
+
+        int switched = 0;
+        for (int c = 0; c < n && c < MONITOR_MAX_CANDIDATES && keep_running; c++) {
+            int i = order[c];
+            printf("[评估] %-15s => ", configs[i].ssid);
+            double connect_start = now_ms();
+            if (connect_network(&configs[i], &ready_ms) != 0) {
+                // 连不上的网络记为最差，过期前不再试连
+                note_result(&history[i], configs[i].ssid, -1, targets, 0, now_ms() - connect_start);
+                continue;
+            }
+            double connect_ms = now_ms() - connect_start;
+            double cand = measure_network(&configs[i], &probe_config, targets, &target_count);
+            note_result(&history[i], configs[i].ssid, cand, targets, target_count, connect_ms);
+            printf("评分 %.2f（当前 %s 平均 %.2f）\n", cand, configs[active].ssid, current);
+            if (cand >= 0 && cand < current * MONITOR_HYSTERESIS) {
+                printf("▶ 切换到 %s\n", configs[i].ssid);
+                active = i;
+                switched = 1;
+                break;
+            }
+        }
+        if (!switched) {
+            printf("[评估] 没有明显更好的网络，保持 %s\n", configs[active].ssid);
+            if (n > 0) {
+                printf("[评估] 重新连接 %-15s => ", configs[active].ssid);
+                if (connect_network(&configs[active], &ready_ms) == 0) printf("已连接\n");
+            }
+        }
+        last_change = now_ms();
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    ProbeTarget targets[MAX_TARGETS];
+    int probe_count = 0;
+    int mock = 0;
+    int daemon_flag = 0;
+    MonitorConfig monitor = {MONITOR_INTERVAL_S, MONITOR_DWELL_S, MONITOR_THRESHOLD};
+    const char* config_path = "lan.conf";
+    const char* cache_path = CACHE_PATH;
+    int rescan = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-help") == 0) {
+            show_help();
+            return 0;
+        } else if (strcmp(argv[i], "-daemon") == 0) {
+            daemon_flag = 1;
+        } else if ((strcmp(argv[i], "-monitor-interval") == 0 || strcmp(argv[i], "-dwell") == 0 ||
+                    strcmp(argv[i], "-threshold") == 0) && i + 1 < argc && isdigit((unsigned char)*argv[i + 1])) {
+            if (strcmp(argv[i], "-monitor-interval") == 0) monitor.interval_s = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-dwell") == 0) monitor.dwell_s = atoi(argv[i + 1]);
+            else monitor.threshold = atof(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-mock") == 0) {
+            mock = 1;
+        } else if (strcmp(argv[i], "-config") == 0 && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+            cache_path = argv[++i];
+        } else if (strcmp(argv[i], "-rescan") == 0) {
+            rescan = 1;
+        } else if (strcmp(argv[i], "-probe") == 0 && i + 1 < argc) {
+            add_target(targets, &probe_count, argv[++i], TARGET_DOMAIN, 1.0);
+        } else if ((strcmp(argv[i], "-count") == 0 || strcmp(argv[i], "-interval") == 0 ||
+                    strcmp(argv[i], "-timeout") == 0 || strcmp(argv[i], "-port") == 0) &&
+                   i + 1 < argc && isdigit((unsigned char)*argv[i + 1])) {
+            int value = atoi(argv[i + 1]);
+            if (strcmp(argv[i], "-count") == 0) {
+                if (value < 1 || value > MAX_PROBES) {
+                    fprintf(stderr, "错误：-count 范围需在1-%d之间\n", MAX_PROBES);
+                    return 1;
+                }
+                probe_config.count = value;
+            } else if (strcmp(argv[i], "-interval") == 0) {
+                probe_config.interval_ms = value;
+            } else if (strcmp(argv[i], "-timeout") == 0) {
+                probe_config.timeout_ms = value;
+            } else {
+                probe_config.port = value;
+            }
+            i++;
+        } else {
+            fprintf(stderr, "错误：未知参数或缺少参数值 %s\n", argv[i]);
+            show_help();
+            return 1;
+        }
+    }
+
 #ifdef _WIN32
-        Sleep(3000);
+    ops.probe = win_probe;
 #else
-        sleep(3);
+    ops.probe = lin_probe;
 #endif
+    if (probe_count > 0) {
+        double start = now_ms();
+        int ok = ops.probe(targets, probe_count, &probe_config);
+        print_targets(targets, probe_count);
+        printf("评分 %.2f，耗时 %.0f ms\n", network_score(targets, probe_count), now_ms() - start);
+        return ok == probe_count ? 0 : 1;
+    }
 
-        float latency = ops.ping(configs[i].domain);
-        if (latency < 0) {
-            printf("Ping失败\n");
-            latency = 9999.0f;
-        } else {
-            printf("延迟: %.2f ms\n", latency);
+#ifdef _WIN32
+    ops.connect = win_connect;
+    ops.disconnect = win_disconnect;
+    ops.wait_ready = win_wait_ready;
+#else
+    ops.connect = lin_connect;
+    ops.disconnect = lin_disconnect;
+    ops.wait_ready = lin_wait_ready;
+#endif
+    if (mock) {
+        ops.connect = mock_connect;
+        ops.disconnect = mock_disconnect;
+        ops.wait_ready = mock_wait_ready;
+    }
+
+    signal(SIGINT, cleanup);
+    if (!mock) check_privileges();
+
+    WifiConfig configs[MAX_CONFIG];
+    int count = 0;
+    
+    if (parse_config(config_path, configs, &count) != 0) {
+        fprintf(stderr, "配置文件错误或无有效配置\n");
+        return 1;
+    }
+    // -rescan 忽略已有记录做一次全量测量，结果仍然合并进缓存，其他网络和时段的记录保留
+    cache_load(cache_path);
+
+    static ScoreHistory history[MAX_CONFIG];
+    ProbeTarget targets_scan[MAX_TARGETS];
+    double scan_start = now_ms();
+    int best_index = -1;
+    double best_score = PROBE_LOSS_PENALTY_MS;
+    int connected_index = -1;   // 当前仍连着的网络
+    int measured_count = 0;
+
+    // 按缓存决定探测顺序：先测没有记录或记录过期的网络，再按缓存评分从好到差测有效记录。
+    // 排名第一的总要实测；之后下一名的缓存评分没有明显好于已测得的最好结果（同守护模式的滞回）
+    // 就停止，常见情况下只需连接一次
+    int order[MAX_CONFIG];
+    double cached[MAX_CONFIG];
+    int stale_count = 0, n = 0;
+    int bucket = current_bucket();
+    for (int i = 0; i < count; i++) {
+        CacheEntry* e = cache_find(configs[i].ssid, bucket);
+        cached[i] = !rescan && cache_fresh(e) ? e->score : -1;
+        if (cached[i] < 0) order[n++] = i;
+        if (cached[i] >= 0) {
+            // 用缓存的时间和均值初始化历史，守护模式判断候选时也能用上
+            history[i].score = e->score;
+            // 换算到单调时钟；开机时间短于记录的年龄时结果为负，不能截断，否则旧记录会被当成新的
+            history[i].updated = now_ms() - (double)(time(NULL) - e->updated) * 1000;
+            history[i].samples = e->samples > 0 ? (int)e->samples : 1;
+        }
+    }
+    stale_count = n;
+    for (int i = 0; i < count; i++) {
+        if (cached[i] >= 0) order[n++] = i;
+    }
+    for (int a = stale_count; a < n; a++) {
+        for (int b = a + 1; b < n; b++) {
+            if (cached[order[b]] < cached[order[a]]) {
+                int t = order[a];
+                order[a] = order[b];
+                order[b] = t;
+            }
+        }
+    }
+    if (cache.path && n - stale_count > 0) {
+        printf("缓存中有 %d 个网络的有效记录（时段 %d），%d 个需要重新测量\n", n - stale_count, bucket, stale_count);
+    }
+
+    for (int k = 0; k < n && keep_running; ++k) {
+        int i = order[k];
+        if (k > stale_count && best_index >= 0 &&
+            (cached[i] >= best_score * MONITOR_HYSTERESIS || best_score - cached[i] < CACHE_MIN_GAIN)) {
+            // 剩下的网络缓存评分都不比已测得的最好结果明显更好
+            printf("跳过网络: %-15s （缓存评分 %.2f）\n", configs[i].ssid, cached[i]);
+            continue;
+        }
+        printf("测试网络: %-15s => ", configs[i].ssid);
+        if (connected_index >= 0) {
+            ops.disconnect();
+            connected_index = -1;
         }
 
-        if (latency < min_latency) {
-            min_latency = latency;
-            best_index = i;
+        double ready_ms;
+        double connect_start = now_ms();
+        if (connect_network(&configs[i], &ready_ms) != 0) {
+            note_result(&history[i], configs[i].ssid, -1, targets_scan, 0, now_ms() - connect_start);
+            continue;
         }
+        double connect_ms = now_ms() - connect_start;
+        connected_index = i;
+        measured_count++;
 
-        ops.disconnect();
+        int target_count;
+        double start = now_ms();
+        double score = measure_network(&configs[i], &probe_config, targets_scan, &target_count);
+        note_result(&history[i], configs[i].ssid, score, targets_scan, target_count, connect_ms);
+        if (score < 0) {
+            printf("Ping失败\n");
+        } else {
+            printf("评分 %.2f（就绪 %.0f ms，探测 %.0f ms", score, ready_ms, now_ms() - start);
+            if (cached[i] >= 0) printf("，缓存 %.2f", cached[i]);
+            printf("）\n");
+            print_targets(targets_scan, target_count);
+            if (score < best_score) {
+                best_score = score;
+                best_index = i;
+            }
+        }
     }
 
+    printf("\n测量 %d/%d 个网络耗时 %.1f 秒\n", measured_count, count, (now_ms() - scan_start) / 1000);
     if (best_index != -1 && keep_running) {
-        printf("\n▶ 最佳网络: %s (延迟: %.2f ms)\n", 
-            configs[best_index].ssid, min_latency);
-        ops.connect(configs[best_index].ssid, 
-                   configs[best_index].password);
+        printf("▶ 最佳网络: %s (评分: %.2f)\n", 
+            configs[best_index].ssid, best_score);
+        // 最后测的就是最佳网络时仍连着，不必重连
+        int ready = connected_index == best_index;
+        if (!ready) {
+            if (connected_index >= 0) ops.disconnect();
+            double ready_ms;
+            ready = connect_network(&configs[best_index], &ready_ms) == 0;
+        }
+        if (ready) printf("启动到连接完成共 %.1f 秒\n", (now_ms() - scan_start) / 1000);
+        if (ready && daemon_flag) monitor_run(configs, count, history, best_index, &monitor);
     } else {
+        if (connected_index >= 0) ops.disconnect();
         printf("无可用网络\n");
     }
 